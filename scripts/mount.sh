@@ -28,6 +28,14 @@ then
     OPTS="-o $2"
 fi
 
+# With -o ro, everything on top has to be read-only too, or they'll try to write to it.
+if [[ ",$2," == *,ro,* ]]
+then
+    LOSETUP_RO="-r"
+    CRYPT_RO="--readonly"
+    MOUNT_RO="-o ro"
+fi
+
 CUR_USER=$USER
 
 sudo mkdir -p /mnt/loop-steg
@@ -56,15 +64,15 @@ echo 'Attaching loop device...'
 LOOP_DEV=$(sudo losetup -f)
 quit_maybe
 
-sudo losetup "$LOOP_DEV" /mnt/loop-steg/data
+sudo losetup $LOSETUP_RO "$LOOP_DEV" /mnt/loop-steg/data
 quit_maybe
 
 echo 'Opening LUKS device...'
-echo -n $PASSWORD | sudo cryptsetup open "$LOOP_DEV" loop-steg --key-file -
+echo -n $PASSWORD | sudo cryptsetup open $CRYPT_RO "$LOOP_DEV" loop-steg --key-file -
 quit_maybe 'Failed (wrong password?)'
 
 echo 'Mounting filesystem...'
-sudo mount /dev/mapper/loop-steg /mnt/secrets
+sudo mount $MOUNT_RO /dev/mapper/loop-steg /mnt/secrets
 quit_maybe
 
 echo 'Mounted at /mnt/secrets'
@@ -58,6 +58,10 @@ quit_maybe
 sudo chmod 755 /mnt/secrets
 quit_maybe
 
+echo 'Filling covers with random data...'
+loop-steg init <(echo -n $PASSWORD) "$1"
+quit_maybe
+
 echo 'Starting loop-steg...'
 loop-steg <(echo -n $PASSWORD) "$1" /mnt/loop-steg/ -o allow_other $OPTS
 
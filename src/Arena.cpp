@@ -0,0 +1,139 @@
+#include <vector>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <algorithm>
+
+#include <cstring>
+#include <cerrno>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "Arena.h"
+#include "exc.h"
+#include "util.h"
+
+using namespace std;
+
+Arena& Arena::get()
+{
+    // Never destroyed, on purpose. Covers' caches come from here, and they can belong to anything,
+    // including statics which were made before the first call to this, and so would be destroyed
+    // after it. Every buffer is wiped as it's released anyway, and the OS takes the slabs back.
+    static Arena* arena = new Arena();
+    return *arena;
+}
+
+Arena::Arena(): _slabs(), _next(nullptr), _left(0), _free(), _locked(true), _mutex() { }
+
+Arena::~Arena()
+{
+    for (const slab& s : _slabs)
+    {
+        explicit_bzero(s.base, s.size);
+        munlock(s.base, s.size);
+        munmap(s.base, s.size);
+    }
+}
+
+char* Arena::allocate(size_t size)
+{
+    size = size_class(size);
+
+    lock_guard<mutex> lock(_mutex);
+
+    // Reuse a released buffer of the same size class if there is one. These are already wiped.
+    auto it = _free.find(size);
+
+    if (it != _free.end() && !it->second.empty())
+    {
+        char* buf = it->second.back();
+        it->second.pop_back();
+        return buf;
+    }
+
+    if (_left < size) grow(size);
+
+    char* buf = _next;
+    _next += size;
+    _left -= size;
+    return buf;
+}
+
+void Arena::release(char* buf, size_t size)
+{
+    if (!buf) return;
+
+    // Only the first `size` bytes could have been written to; the rest of the size class is still
+    // zero from when it was last wiped (or from `mmap()`). `explicit_bzero()` is `memset()`, which
+    // is as vectorised as it gets, but it won't be optimised away for being a dead store.
+    explicit_bzero(buf, size);
+
+    lock_guard<mutex> lock(_mutex);
+    _free[size_class(size)].push_back(buf);
+}
+
+bool Arena::locked()
+{
+    lock_guard<mutex> lock(_mutex);
+    if (!_slabs.empty()) return _locked;
+
+    // There's nothing to go on yet, so try a slab's worth, and give it straight back.
+    void* base = mmap(nullptr, SLAB, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) return false;
+
+    bool locked = mlock(base, SLAB) == 0;
+    munmap(base, SLAB);
+    return locked;
+}
+
+size_t Arena::size_class(size_t size)
+{
+    static const size_t page = sysconf(_SC_PAGESIZE);
+
+    size = max<size_t>(size, 1);
+    size = (size + page - 1) / page * page;
+
+    if (size <= 64 << 10) return size;
+
+    // Find the power of two just below `size`, and round up to the next quarter of it.
+    size_t power = 1;
+    while (power <= size / 2) power *= 2;
+
+    size_t step = power / 4;
+    return (size + step - 1) / step * step;
+}
+
+void Arena::grow(size_t size)
+{
+    size = (max(size, SLAB) + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+
+    // Try for real huge pages first. These only exist if the admin reserved some, so this will
+    // usually fail, and we fall back to normal pages, asking for transparent huge pages instead.
+    void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+    if (base == MAP_FAILED)
+    {
+        base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (base == MAP_FAILED)
+        {
+            stringstream ss;
+            ss << "could not map " << size << " bytes for cover caches: " << strerror(errno);
+            THROW(too_big, ss.str());
+        }
+
+        madvise(base, size, MADV_HUGEPAGE);
+    }
+
+    // Keep hidden data out of swap and out of core dumps. Neither of these are fatal if they fail.
+    if (mlock(base, size) < 0) _locked = false;
+    madvise(base, size, MADV_DONTDUMP);
+
+    // Whatever was left of the old slab is wasted, but it's less than one buffer's worth.
+    _slabs.push_back({ static_cast<char*>(base), size });
+    _next = static_cast<char*>(base);
+    _left = size;
+}
@@ -0,0 +1,97 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <vector>
+#include <map>
+#include <mutex>
+
+#include <cstddef>
+
+// Where cover caches live. Every `CachedFile` needs a buffer the size of its capacity while it's
+// prepared, and used to get it with `new char[]`, and give it back with `delete []` every time it
+// was synced, over and over again, for every cover. That's a lot of churn, and worse, the buffers
+// are full of hidden data which could end up in swap. So instead, buffers come from here.
+//
+// An `Arena` carves buffers out of big slabs of memory which it gets from the OS with `mmap()`.
+// Slabs are backed by huge pages if we can get them, (or at least transparent huge pages if not),
+// to save on TLB misses when working through big caches, and `mlock()`ed so that their contents
+// never hit swap. Slabs are never given back to the OS: buffers which are `.release()`d are wiped
+// and kept on a free list for the next `.allocate()` of a similar size.
+//
+// NOTE: `mlock()` needs a big enough RLIMIT_MEMLOCK (see `ulimit -l`), or CAP_IPC_LOCK. If it
+//       fails, the arena still works, but memory might be swapped out. Check `.locked()`.
+class Arena
+{
+    public:
+    // The one arena that all the covers share. It's never destroyed, so it outlives every cover.
+    static Arena& get();
+
+    Arena();
+
+    // Give the slabs back to the OS. Everything in them should have been `.release()`d by now (and
+    // so wiped), but they're wiped again anyway, just in case.
+    ~Arena();
+
+    Arena(const Arena& other)            = delete;
+    Arena& operator=(const Arena& other) = delete;
+
+    // Gets a buffer of at least `size` bytes. Its contents are all zero.
+    //
+    // size: Minimum size of the buffer in bytes.
+    //
+    // Returns the buffer. Give it back with `.release()`, not `delete` or `free()`.
+    //
+    // Throws `exc::too_big` if we couldn't get the memory from the OS.
+    char* allocate(size_t size);
+
+    // Wipes a buffer from `.allocate()` and keeps it for reuse.
+    //
+    // buf:  The buffer. If null, does nothing.
+    // size: Exactly the `size` that was given to `.allocate()`.
+    void release(char* buf, size_t size);
+
+    // Whether every slab so far could be `mlock()`ed. Before the first slab, whether one could be,
+    // found by trying with one that's given straight back.
+    bool locked();
+
+    private:
+    // Slabs are at least this big. Bigger requests get a slab to themselves.
+    static const size_t SLAB = 64 << 20;
+
+    // Slabs are a multiple of this, so they can be backed by 2 MiB huge pages.
+    static const size_t HUGE_PAGE = 2 << 20;
+
+    // A slab we got from `mmap()`.
+    struct slab
+    {
+        char*  base;
+        size_t size;
+    };
+
+    // Every slab, so we can `munmap()` them in `~Arena()`.
+    std::vector<slab> _slabs;
+
+    // Where the next fresh buffer comes from in the newest slab, and how much is left after it.
+    char*  _next;
+    size_t _left;
+
+    // Buffers which have been released, by size class. See `size_class()`.
+    std::map<size_t, std::vector<char*>> _free;
+
+    // Whether every slab could be `mlock()`ed.
+    bool _locked;
+
+    std::mutex _mutex;
+
+    // Rounds a size up to the size of the buffer we'll actually hand out. Sizes are rounded to a
+    // whole number of pages, then, above 64 KiB, to one of four steps per power of two. So at most
+    // a quarter of a buffer is wasted, and similarly sized covers can reuse each other's buffers.
+    static size_t size_class(size_t size);
+
+    // Gets a new slab of at least `size` bytes from the OS and makes it the newest slab.
+    //
+    // Throws `exc::too_big` if `mmap()` failed.
+    void grow(size_t size);
+};
+
+#endif
@@ -0,0 +1,95 @@
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <sstream>
+
+#include "ByteLayout.h"
+#include "exc.h"
+
+using namespace std;
+
+ByteLayout::ByteLayout(const vector<size_t>& capacities, const string& seed):
+    _cum_cap(),
+    _search(),
+    _shuffler(0, 0, "")
+{
+    for (size_t capacity : capacities)
+        _cum_cap.push_back((_cum_cap.empty() ? 0 : _cum_cap.back()) + capacity);
+
+    _capacity = _cum_cap.empty() ? 0 : _cum_cap.back();
+    _search   = Eytzinger(_cum_cap);
+    _shuffler = Shuffler(0, _capacity, seed);
+}
+
+void ByteLayout::map(size_t offset, size_t size,
+        const function<void(size_t, size_t, size_t, size_t)>& fn)
+{
+    if (offset > _capacity || size > _capacity - offset)
+    {
+        stringstream ss;
+        ss << "range [" << offset << ", " << offset + size << ") must lie within `.capacity()` ("
+            << _capacity << ")";
+        THROW(arg, ss.str());
+    }
+
+    // The run we're building up, which is passed on to `fn` once the next byte doesn't carry on
+    // from it.
+    size_t run_at = 0, run_file = 0, run_offset = 0, run_size = 0;
+
+    for (size_t i = 0; i < size; ++i)
+    {
+        size_t byte = _shuffler[offset + i];
+
+        // Same as the old `Manager::which_file()`: the file is the first one whose cumulative
+        // capacity is greater than `byte`.
+        size_t file = _search.upper_bound(byte);
+        size_t at   = byte - (file ? _cum_cap[file - 1] : 0);
+
+        if (run_size && file == run_file && at == run_offset + run_size)
+        {
+            ++run_size;
+            continue;
+        }
+
+        if (run_size) fn(run_at, run_file, run_offset, run_size);
+
+        run_at     = i;
+        run_file   = file;
+        run_offset = at;
+        run_size   = 1;
+    }
+
+    if (run_size) fn(run_at, run_file, run_offset, run_size);
+}
+
+void ByteLayout::invert(const vector<size_t>& files, const vector<size_t*>& out)
+{
+    // Where each file's places go, or null if it isn't wanted, and the range of places wanted, so
+    // that bytes which land anywhere else can be skipped without looking up their file.
+    vector<size_t*> dest(_cum_cap.size(), nullptr);
+    size_t low = _capacity, high = 0;
+
+    for (size_t k = 0; k < files.size(); ++k)
+    {
+        dest[files[k]] = out[k];
+        low  = min(low, files[k] ? _cum_cap[files[k] - 1] : 0);
+        high = max(high, _cum_cap[files[k]]);
+    }
+
+    for (size_t i = 0; i < _capacity; ++i)
+    {
+        size_t byte = _shuffler[i];
+        if (byte < low || byte >= high) continue;
+
+        size_t file = _search.upper_bound(byte);
+        if (dest[file]) dest[file][byte - (file ? _cum_cap[file - 1] : 0)] = i;
+    }
+}
+
+size_t ByteLayout::places(size_t file)
+{
+    return _cum_cap[file] - (file ? _cum_cap[file - 1] : 0);
+}
+
+size_t ByteLayout::block() const { return 1; }
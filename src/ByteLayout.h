@@ -0,0 +1,49 @@
+#ifndef BYTE_LAYOUT_H
+#define BYTE_LAYOUT_H
+
+#include <string>
+#include <vector>
+#include <functional>
+
+#include "Layout.h"
+#include "Shuffler.h"
+#include "Eytzinger.h"
+
+// The original layout: every byte is shuffled across the entire capacity of every file, one at a
+// time. This spreads things out as much as possible, but it means one 4 KiB block is spread across
+// up to 4096 covers, and writing it dirties every one of them. See <Layout.h>.
+class ByteLayout : public Layout
+{
+    public:
+    // `ByteLayout` constructor.
+    //
+    // capacities: Capacity of each file.
+    // seed:       Source of randomness. Same seed = same layout.
+    ByteLayout(const std::vector<size_t>& capacities, const std::string& seed);
+
+    // See `Layout::map()`.
+    void map(size_t offset, size_t size,
+            const std::function<void(size_t, size_t, size_t, size_t)>& fn);
+
+    // See `Layout::invert()`. Every byte of the volume is looked up, which takes as long however
+    // few files there are, so ask for as many at once as there's room for.
+    void invert(const std::vector<size_t>& files, const std::vector<size_t*>& out);
+
+    // See `Layout::places()`. Every place in every file is used.
+    size_t places(size_t file);
+
+    // See `Layout::block()`. Every byte is its own block.
+    size_t block() const;
+
+    private:
+    // Cumulative capacity of each file, so the first byte of file `i` is at `_cum_cap[i - 1]`.
+    std::vector<size_t> _cum_cap;
+
+    // `_cum_cap`, for finding which file a byte is in.
+    Eytzinger _search;
+
+    // Shuffles every byte of the capacity.
+    Shuffler _shuffler;
+};
+
+#endif
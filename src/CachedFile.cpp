@@ -5,69 +5,154 @@
 #include <sstream>
 #include <algorithm>
 #include <exception>
+#include <mutex>
+#include <unordered_map>
 
 #include <cstring>
 #include <cerrno>
-#include <sys/random.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "CachedFile.h"
+#include "Arena.h"
+#include "PathTable.h"
+#include "fs.h"
 #include "exc.h"
 #include "util.h"
 
 using namespace std;
 
+namespace
+{
+
+// Every `CachedFile`'s path, see `CachedFile::intern()`, along with the index of every directory in
+// `table`, so that each is only added once.
+struct path_table
+{
+    path_table(): table(), dirs(), mutex() { }
+
+    PathTable table;
+    unordered_map<string, size_t> dirs;
+    std::mutex mutex;
+};
+
+// Never destroyed, like `Arena::get()`, since `CachedFile`s can outlive any static.
+path_table& paths()
+{
+    static path_table* paths = new path_table();
+    return *paths;
+}
+
+}
+
+atomic<bool> CachedFile::_check_headers(false);
+
 CachedFile::CachedFile(const string& path):
     _capacity(0),
-    _path(path),
+    _path(intern(path)),
     _bytes(nullptr),
-    _synced(true)
+    _synced(true),
+    _frozen(false),
+    _rewritten(false),
+    _overlay(),
+    _hash(0),
+    _hashed(false),
+    _fingerprint(),
+    _quarantined(false)
 {
-    // Only reason we open the file is to get its size with `.tellg()` in a moment.
-    ifstream file(_path, ifstream::ate | ifstream::binary);
-
-    if (!file)
-    {
-        stringstream ss;
-        ss << "could not get size of '" << _path << "': " << strerror(errno);
-        THROW(file, ss.str());
-    }
+    // The fingerprint has the size in it, which is all we need.
+    remember();
+    _capacity = _fingerprint.size;
+}
 
-    _capacity = file.tellg();
+CachedFile::CachedFile():
+    _capacity(),
+    _path(SIZE_MAX),
+    _bytes(nullptr),
+    _synced(true),
+    _frozen(false),
+    _rewritten(false),
+    _overlay(),
+    _hash(0),
+    _hashed(false),
+    _fingerprint(),
+    _quarantined(false)
+{ }
 
-    if (!file)
-    {
-        stringstream ss;
-        ss << "could not get size of '" << _path << "': " << strerror(errno);
-        THROW(file, ss.str());
-    }
+// The arena wipes the buffer, just in case there was some important super secret stuff in there.
+CachedFile::~CachedFile()
+{
+    for (char* page : _overlay) Arena::get().release(page, PAGE);
+    Arena::get().release(_bytes, _capacity);
 }
 
-CachedFile::CachedFile(): _capacity(), _path(), _bytes(nullptr), _synced(true) { }
+size_t CachedFile::capacity() const { return _capacity; }
 
-CachedFile::~CachedFile()
+string CachedFile::path() const
 {
-    // Overwrite the buffer with randomness, just in case there was some important super secret
-    // stuff in there. Set it to zero first in case `getrandom()` fails, since we can't signal an
-    // error in a destructor. I'm OK with this since setting it to 0 is probably OK on its own.
-    // Randomness is just a bonus and will basically never fail in practice anyway.
-    if (_bytes)
-    {
-        memset(_bytes, 0, _capacity);
-        getrandom(_bytes, _capacity, 0);
-        delete [] _bytes;
-    }
+    if (_path == SIZE_MAX) return "";
+
+    path_table& t = paths();
+    lock_guard<mutex> lock(t.mutex);
+    return t.table[_path];
 }
 
-const string& CachedFile::path() const { return _path;     }
-size_t CachedFile::capacity()    const { return _capacity; }
+size_t CachedFile::intern(const string& path)
+{
+    // If there's no '/', this is 0, and the directory is empty.
+    size_t slash = path.rfind('/') + 1;
+    string dir   = path.substr(0, slash);
+
+    path_table& t = paths();
+    lock_guard<mutex> lock(t.mutex);
+
+    auto it = t.dirs.find(dir);
+    if (it == t.dirs.end()) it = t.dirs.emplace(dir, t.table.add_dir(dir)).first;
+
+    t.table.add(it->second, path.c_str() + slash, path.size() - slash);
+    return t.table.size() - 1;
+}
+
+bool CachedFile::quarantined() const { return _quarantined; }
+
+void CachedFile::check_headers(bool on) { _check_headers = on; }
 
 size_t CachedFile::write(const void* buf, size_t size, off_t offset)
 {
     if (offset < 0)                  THROW(arg, "`offset` must be positive");
     if ((size_t)offset >= _capacity) THROW(arg, "`offset` must be < `.capacity()`");
 
-    if (_bytes == nullptr) prepare();
+    if (_bytes == nullptr) populate();
     size = min(size, _capacity - offset);
+
+    // `.sync()` is busy with `_bytes`, so leave them alone, and write to copies of their pages. A
+    // page which already holds what's being written doesn't need a copy.
+    if (_frozen)
+    {
+        for (size_t done = 0; done < size;)
+        {
+            size_t at = offset + done, len = min(size - done, PAGE - at % PAGE);
+            const char* page = _overlay[at / PAGE];
+            const char* from = (const char*)buf + done;
+
+            if (memcmp((page ? page : _bytes + at / PAGE * PAGE) + at % PAGE, from, len) != 0)
+            {
+                memcpy(overlay(at / PAGE) + at % PAGE, from, len);
+                _rewritten = true;
+            }
+
+            done += len;
+        }
+
+        return size;
+    }
+
+    // File systems write the same blocks over again all the time, (journals, bitmaps, superblocks),
+    // and it's a lot cheaper to notice than to re-encode the whole cover for nothing.
+    if (memcmp(_bytes + offset, buf, size) == 0) return size;
+
     memcpy(_bytes + offset, buf, size);
     _synced = false;
     return size;
@@ -78,86 +163,302 @@ size_t CachedFile::read(char* buf, size_t size, off_t offset)
     if (offset < 0)                  THROW(arg, "`offset` must be positive");
     if ((size_t)offset >= _capacity) THROW(arg, "`offset` must be < `.capacity()`");
 
-    if (_bytes == nullptr) prepare();
+    if (_bytes == nullptr) populate();
     size = min(size, _capacity - offset);
+
+    if (_frozen)
+    {
+        for (size_t done = 0; done < size;)
+        {
+            size_t at = offset + done, len = min(size - done, PAGE - at % PAGE);
+            const char* page = _overlay[at / PAGE];
+            memcpy(buf + done, (page ? page : _bytes + at / PAGE * PAGE) + at % PAGE, len);
+            done += len;
+        }
+
+        return size;
+    }
+
     memcpy(buf, _bytes + offset, size);
     return size;
 }
 
+void CachedFile::assign(const char* buf)
+{
+    if (!_bytes) _bytes = Arena::get().allocate(_capacity);
+    else if (memcmp(_bytes, buf, _capacity) == 0) return;
+
+    memcpy(_bytes, buf, _capacity);
+    _synced = false;
+}
+
+void CachedFile::drop()
+{
+    if (_frozen || !_synced) return;
+
+    Arena::get().release(_bytes, _capacity);
+    _bytes = nullptr;
+}
+
+void CachedFile::load(char* buf)
+{
+    if (_bytes)
+    {
+        memcpy(buf, _bytes, _capacity);
+        return;
+    }
+
+    // `.prepare()` fills in `_bytes`, so point that at `buf` for the time being.
+    _bytes = buf;
+
+    try { populate(); }
+
+    catch (...)
+    {
+        _bytes = nullptr;
+        throw;
+    }
+
+    // Let go of anything else `.prepare()` left lying around, (like a decoded image), but not
+    // `buf`, which isn't ours.
+    _bytes = nullptr;
+    drop();
+}
+
+void CachedFile::fetch()
+{
+    if (_bytes == nullptr) populate();
+}
+
+void CachedFile::discard()
+{
+    _synced = true;
+    drop();
+}
+
 void CachedFile::sync()
 {
     // Check if we're already synced.
     if (synced()) return;
 
-    ofstream file(_path);
+    uint64_t hash;
 
-    if (!file)
+    if (!unchanged(&hash))
     {
-        stringstream ss;
-        ss << "could not open '" << _path << "' for writing: " << strerror(errno);
-        THROW(file, ss.str());
-    }
+        // It's the same size as ever, so there's no need to truncate it, which also means that if
+        // it's changed, we find out before we've done any damage.
+        int fd = open_checked(O_RDWR);
+        fs::fd_guard guard(fd);
 
-    file.write(_bytes, _capacity);
+        // If it only gets part of the way, there's no knowing what's in there.
+        _hashed = false;
 
-    if (!file)
-    {
-        stringstream ss;
-        ss << "could not write to '" << _path << "': " << strerror(errno);
-        THROW(file, ss.str());
+        // And it has to be on the disk, not just in the page cache, before the journal can let go
+        // of what was written.
+        bool written = fs::pwrite_all(fd, _bytes, _capacity, 0) && fsync(fd) == 0;
+        int  error   = errno;
+
+        // Even if it only got part of the way, whatever's in there now is ours.
+        remember(fd);
+
+        if (!written)
+        {
+            stringstream ss;
+            ss << "could not write to '" << path() << "': " << strerror(error);
+            THROW(file, ss.str());
+        }
+
+        _hash   = hash;
+        _hashed = true;
     }
 
     _synced = true;
 
-    delete [] _bytes;
+    // `.thaw()` needs them, if anything was written in the meantime.
+    if (_frozen) return;
+
+    Arena::get().release(_bytes, _capacity);
     _bytes = nullptr;
 }
 
-bool CachedFile::synced() { return _synced; }
+// Don't look at `_synced` while frozen; `.sync()` could be changing it.
+bool CachedFile::synced() { return !_frozen && _synced; }
+
+void CachedFile::freeze()
+{
+    _overlay.assign((_capacity + PAGE - 1) / PAGE, nullptr);
+    _frozen    = true;
+    _rewritten = false;
+}
+
+void CachedFile::thaw()
+{
+    for (size_t i = 0; i < _overlay.size(); ++i)
+    {
+        if (!_overlay[i]) continue;
+
+        memcpy(_bytes + i * PAGE, _overlay[i], min(PAGE, _capacity - i * PAGE));
+        Arena::get().release(_overlay[i], PAGE);
+    }
+
+    // Give the memory back, rather than just emptying it; there's a pointer for every page.
+    vector<char*>().swap(_overlay);
+
+    _frozen = false;
+    if (_rewritten) _synced = false;
+}
+
+char* CachedFile::overlay(size_t page)
+{
+    if (!_overlay[page])
+    {
+        _overlay[page] = Arena::get().allocate(PAGE);
+        memcpy(_overlay[page], _bytes + page * PAGE, min(PAGE, _capacity - page * PAGE));
+    }
+
+    return _overlay[page];
+}
+
+void CachedFile::populate()
+{
+    prepare();
+
+    _hash   = util::hash(_bytes, _capacity);
+    _hashed = true;
+}
+
+bool CachedFile::unchanged(uint64_t* hash) const
+{
+    *hash = util::hash(_bytes, _capacity);
+    return _hashed && *hash == _hash;
+}
 
 void CachedFile::prepare()
 {
-    if (!_bytes)
+    if (!_bytes) _bytes = Arena::get().allocate(_capacity);
+
+    int fd = open_checked(O_RDONLY);
+    fs::fd_guard guard(fd);
+
+    if (!fs::pread_all(fd, _bytes, _capacity, 0))
     {
-        try { _bytes = new char[_capacity]; }
+        stringstream ss;
+        ss << "could read from '" << path() << "': " << strerror(errno);
+        THROW(file, ss.str());
+    }
 
-        catch (const bad_alloc& e)
-        {
-            stringstream ss;
-            ss << "could not allocate memory to cache '" << _path << "': " << e.what();
-            THROW(too_big, ss.str());
-        }
+    _synced = true;
+}
+
+int CachedFile::open_checked(int flags)
+{
+    int fd = open(path().c_str(), flags | O_CLOEXEC);
+
+    if (fd < 0)
+    {
+        stringstream ss;
+        ss << "could not open '" << path() << "': " << strerror(errno);
+        THROW(file, ss.str());
     }
 
-    // If the file has changed on the disk since `_capacity` was created, very bad things will
-    // happen. (Probably.)
-    ifstream file(_path, ifstream::ate | ifstream::binary);
-    size_t capacity = file.tellg();
+    try { check(fd); }
 
-    if (!file)
+    catch (...)
+    {
+        close(fd);
+        throw;
+    }
+
+    return fd;
+}
+
+void CachedFile::check(int fd)
+{
+    if (_quarantined)
     {
         stringstream ss;
-        ss << "could not open '" << _path << "' for reading: " << strerror(errno);
+        ss << "'" << path() << "' is quarantined, since it changed behind our back";
         THROW(file, ss.str());
     }
 
-    if (capacity != _capacity)
+    fingerprint now = take(fd);
+
+    // Say what changed, so whoever has to sort it out knows where to start.
+    vector<string> changes;
+
+    if (now.size  != _fingerprint.size)   changes.push_back("size");
+    if (now.mtime != _fingerprint.mtime)  changes.push_back("modification time");
+    if (now.ino   != _fingerprint.ino
+            || now.dev != _fingerprint.dev) changes.push_back("inode");
+    if (now.header != _fingerprint.header) changes.push_back("header");
+
+    if (changes.empty()) return;
+
+    _quarantined = true;
+
+    stringstream ss;
+    ss << "'" << path() << "' has changed behind our back (";
+
+    for (size_t i = 0; i < changes.size(); ++i)
+        ss << (i ? ", " : "") << changes[i];
+
+    ss << "), so it's quarantined: nothing more will be read from or written to it";
+    THROW(file, ss.str());
+}
+
+void CachedFile::remember(int fd)
+{
+    if (fd >= 0)
     {
+        _fingerprint = take(fd);
+        return;
+    }
 
+    fd = open(path().c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+    {
         stringstream ss;
-        ss << "file '" << _path << "' has changed";
+        ss << "could not open '" << path() << "': " << strerror(errno);
         THROW(file, ss.str());
     }
 
-    file.seekg(0);
-    file.read(_bytes, _capacity);
+    fs::fd_guard guard(fd);
+    _fingerprint = take(fd);
+}
+
+CachedFile::fingerprint CachedFile::take(int fd) const
+{
+    struct stat st;
 
-    if (!file)
+    if (fstat(fd, &st) != 0)
     {
         stringstream ss;
-        ss << "could read from '" << _path << "': " << strerror(errno);
+        ss << "could not get the size of '" << path() << "': " << strerror(errno);
         THROW(file, ss.str());
     }
 
-    _synced = true;
+    fingerprint f;
+    f.size   = st.st_size;
+    f.mtime  = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    f.ino    = st.st_ino;
+    f.dev    = st.st_dev;
+    f.header = 0;
+
+    if (_check_headers)
+    {
+        char header[HEADER];
+        size_t size = min<size_t>(HEADER, st.st_size);
+
+        if (!fs::pread_all(fd, header, size, 0))
+        {
+            stringstream ss;
+            ss << "could not read from '" << path() << "': " << strerror(errno);
+            THROW(file, ss.str());
+        }
+
+        f.header = util::hash(header, size);
+    }
+
+    return f;
 }
@@ -4,8 +4,12 @@
 #include <string>
 #include <vector>
 #include <fstream>
+#include <atomic>
 
 #include <cstring>
+#include <cstdint>
+
+#include <sys/types.h>
 
 // This is intended to be an abstract base class, but provides a simple default implementation
 // for testing purposes. This class reperesents a file, the contents of which are to be held in a
@@ -17,6 +21,14 @@
 // does so when the first read/write request is made, as a form of lazy initialisation. It writes
 // the entire contents back to the original file when `.sync()` is called.
 //
+// Every `CachedFile` takes a fingerprint of its file when it's created, (its size, modification
+// time and inode, and optionally a hash of its first few bytes), and again every time it writes the
+// file itself. Before reading or writing the file, it checks the fingerprint with one `fstat()`, on
+// the file descriptor it was going to use anyway, rather than decoding the file to see whether it
+// still looks right. If the file has changed behind our back, it's quarantined: it's never read or
+// written again, and everything that needs it throws, rather than mixing our bytes with whatever
+// is in there now.
+//
 // NOTE: Neither `CachedFile`, nor the classes that derive from it, call `.sync()` in their
 // destructors as you might expect. This is because `.sync()` might throw exceptions, in which case
 // Very Bad Things™ will happen.
@@ -30,12 +42,11 @@ class CachedFile
     // Throws `exc::file` if the size of the file at `path` could not be determined.
     CachedFile(const std::string& path);
 
-    // Move constructors, so we can push `CachedFile`s back to a vector without shenanigans.
-    CachedFile(CachedFile&& other)      = default;
-    CachedFile& operator=(CachedFile&&) = default;
-
     // Delete these, since there should only be one `CachedFile` per file on the disk, else horrible
-    // things will happen when they all `.sync()`.
+    // things will happen when they all `.sync()`. Moving is out too: `_quarantined` is atomic, so
+    // it can't be moved, and `Manager` only ever holds `CachedFile`s by pointer anyway.
+    CachedFile(CachedFile&& other)                 = delete;
+    CachedFile& operator=(CachedFile&& other)      = delete;
     CachedFile(const CachedFile& other)            = delete;
     CachedFile& operator=(const CachedFile& other) = delete;
 
@@ -47,7 +58,19 @@ class CachedFile
     size_t capacity() const;
 
     // The path of the file in the file system. Same as `path` given to `CachedFile(const string&).`
-    const std::string& path() const;
+    std::string path() const;
+
+    // Whether the file has been quarantined, because it changed in the file system since we last
+    // looked at it. See above.
+    bool quarantined() const;
+
+    // Makes every `CachedFile` include a hash of the first `HEADER` bytes of its file in its
+    // fingerprint, which catches files rewritten in place with the same size and modification time,
+    // at the cost of reading those bytes every time the fingerprint is checked. Off by default.
+    //
+    // on: Whether to hash the headers. Only affects fingerprints taken from now on, so set this
+    //     before creating any `CachedFile`s.
+    static void check_headers(bool on);
 
     // Write to this `CachedFile`. Analagous to `pwrite()`.
     //
@@ -82,18 +105,69 @@ class CachedFile
     //       overrun.
     size_t read(char* buf, size_t size, off_t offset);
 
+    // Replaces the entire contents of this `CachedFile` with `buf`, without bothering to load the
+    // old contents first, since they'd be overwritten anyway.
+    //
+    // buf: Buffer of `.capacity()` bytes.
+    //
+    // Throws anything `Arena::allocate()` throws.
+    void assign(const char* buf);
+
+    // Frees the cached contents, if there are no writes waiting to be `.sync()`ed. They'll be loaded
+    // again by the next `.read()` or `.write()`. If there are writes waiting, does nothing.
+    virtual void drop();
+
+    // Reads the entire contents into `buf`, without caching them. For when the caller does the
+    // caching itself, like `ReadCache`. If the contents are already cached, they're copied from
+    // there.
+    //
+    // buf: Buffer of `.capacity()` bytes.
+    //
+    // Throws anything `.prepare()` throws.
+    void load(char* buf);
+
+    // Loads the contents into the cache, if they aren't already, so that the next `.read()` or
+    // `.write()` doesn't have to.
+    //
+    // Throws anything `.prepare()` throws.
+    void fetch();
+
+    // Throws away the cached contents, along with any writes waiting to be `.sync()`ed, as if they
+    // never happened. The file in the file system is left alone.
+    void discard();
+
     // Flushes the contents of the `CachedFile` to the file system, freeing the cached contents from
-    // memory in the process. If the `CachedFile` is already synced, does nothing.
+    // memory in the process, (unless it's `.freeze()`ed, in which case they're kept for `.thaw()`).
+    // If the `CachedFile` is already synced, does nothing. Children of this class should override
+    // this along with `.prepare()`, and `fsync()` like it does: once this returns, the contents
+    // are on the disk, and the journal is free to forget them.
     //
     // Throws `exc::file` if the file at `.path()` could not be written to.
-    void sync();
+    virtual void sync();
 
     // Gets whether any `.write()`s have been performed since the `CachedFile` was last `.sync()`ed.
-    // (If the file is synced, its contents are not buffered in memory.)
+    // (If the file is synced, its contents are not buffered in memory.) A `.freeze()`ed file is
+    // never synced, since it's in the middle of it.
     //
     // Returns whether the file is synced with the one in the file system.
     bool synced();
 
+    // Takes a snapshot of the contents for `.sync()` to write out, so that `.sync()` doesn't need
+    // to keep everyone else away while it encodes them. Until `.thaw()`, the cached contents stay
+    // exactly as they are now, and `.write()`s go to copies of the pages of them they touch
+    // instead, which `.read()`s look at first. Nothing is copied up front, so this is cheap, and
+    // only the pages written to before `.thaw()` ever get copied.
+    //
+    // Only `.read()`, `.write()`, `.sync()`, and `.thaw()` may be called on a frozen file, and
+    // `.sync()` is the only one which can be called at the same time as the others. Only freeze a
+    // file which isn't `.synced()`.
+    void freeze();
+
+    // Ends a `.freeze()`, once `.sync()` is done, successfully or not. Every page written to in the
+    // meantime is copied into the cached contents, and if there were any, the file isn't synced,
+    // so the next `.sync()` picks them up.
+    void thaw();
+
     protected:
     // Empty constructor, so that base classes can derive from this without having to initialise it
     // with a file.
@@ -102,27 +176,137 @@ class CachedFile
     // Size in bytes of our buffer. Basically, the size of the file at `.path()`.
     size_t _capacity;
 
-    // Location in the file system of the file we're wrapping. Same as `path` given to
-    // `CachedFile(const string&)`.
-    std::string _path;
+    // Location in the file system of the file we're wrapping, as an index into the `PathTable`
+    // every `CachedFile` shares, (see `.intern()`), rather than a `std::string` per cover. Use
+    // `.path()` to get the path itself.
+    size_t _path;
+
+    // Adds a path to the table every `CachedFile` shares. Each directory is only stored once, so
+    // with millions of covers, this is far smaller than a `std::string` each. Paths are never taken
+    // back out, even once their `CachedFile` is gone, but covers don't come and go often.
+    //
+    // path: The path to the file.
+    //
+    // Returns the index of the path, for `_path`.
+    static size_t intern(const std::string& path);
 
     // Loads the file from the file system and fills up `_bytes` with its contents. This is called
     // at the beginning of the `.read()` and `.write()` methods if the file is not already in
     // memory. Children of this class should probably override or delete this.
     //
-    // Throws `exc::too_big` if the file at `.path()` is larger than the maximum amount of memory we
-    //        can allocate.
+    // Throws `exc::too_big` if memory for the file at `.path()` could not be allocated.
     // Throws `exc::file` if the file at `.path()` could not be read from.
     // Throws `exc::file` if the file at `.path()` has a different capacity in the file system than
     //        reported by `.capacity()`. (i.e., the file has changed in the file system since this
     //        `CachedFile` was created.)
     virtual void prepare();
 
-    // The buffer where the contents of the file we're wrapping are stored.
+    // Calls `.prepare()`, and takes a hash of what it loaded, for `.unchanged()`. Call this rather
+    // than `.prepare()` itself.
+    //
+    // Throws anything `.prepare()` throws.
+    void populate();
+
+    // Whether the cached contents are the same as what's in the file, going by a hash of them and
+    // the one taken when they were loaded or last synced, so `.sync()` needn't write anything. A
+    // cover written to and then written back again, (say, a block that was zeroed and reinitialised
+    // in between two `.sync()`s), has nothing to write.
+    //
+    // hash: Set to the hash of the cached contents. If the cover is written, store it in `_hash`
+    //       and set `_hashed` once it's in.
+    //
+    // Returns whether they're the same. Always false if `_hashed` isn't set.
+    bool unchanged(uint64_t* hash) const;
+
+    // Opens the file at `.path()`, and `.check()`s it.
+    //
+    // flags: Flags for `open()`.
+    //
+    // Returns the file descriptor.
+    //
+    // Throws `exc::file` if the file could not be opened.
+    // Throws anything `.check()` throws.
+    int open_checked(int flags);
+
+    // Makes sure the file hasn't changed since we last took its fingerprint, and quarantines it if
+    // it has.
+    //
+    // fd: The file at `.path()`, open for reading.
+    //
+    // Throws `exc::file` if the file has changed, or was quarantined already.
+    // Throws `exc::file` if the fingerprint could not be taken.
+    void check(int fd);
+
+    // Takes a new fingerprint of the file, for after we've written it ourselves.
+    //
+    // fd: The file at `.path()`, open for reading, or -1 to open it.
+    //
+    // Throws `exc::file` if the fingerprint could not be taken.
+    void remember(int fd = -1);
+
+    // How many bytes at the start of a file `.check_headers()` hashes.
+    static const size_t HEADER = 4096;
+
+    // The buffer where the contents of the file we're wrapping are stored. This comes from
+    // `Arena::get()`, see <Arena.h>, and must be given back there, not `delete`d.
     char* _bytes;
 
-    // Whether or not `.write()` has been called since the last call to `.sync()`.
+    // Whether or not `.write()` has been called since the last call to `.sync()`. While the file is
+    // `.freeze()`ed, this belongs to `.sync()`, and `.write()`s go in `_rewritten` instead.
     bool _synced;
+
+    // Whether the file is `.freeze()`ed, and whether it's been written to since.
+    bool _frozen;
+    bool _rewritten;
+
+    // While the file is `.freeze()`ed, a copy of every page of `_bytes` which has been written to
+    // since, or null for the pages which haven't. Empty otherwise.
+    std::vector<char*> _overlay;
+
+    // Hash of the contents of the file, as of when they were last loaded or synced, if `_hashed`.
+    // Not set when the contents aren't known, like before they've ever been loaded, or after a
+    // `.sync()` that failed part of the way. See `.unchanged()`.
+    uint64_t _hash;
+    bool     _hashed;
+
+    // Size of the pages in `_overlay`.
+    static const size_t PAGE = 4096;
+
+    // The copy in `_overlay` of a page of `_bytes`, making it first if there isn't one yet.
+    //
+    // page: Index of the page.
+    //
+    // Throws anything `Arena::allocate()` throws.
+    char* overlay(size_t page);
+
+    private:
+    // See `.remember()`.
+    struct fingerprint
+    {
+        off_t   size;
+        int64_t mtime; // In nanoseconds.
+        ino_t   ino;
+        dev_t   dev;
+
+        // See `.check_headers()`. 0 if it was off.
+        uint64_t header;
+    };
+
+    // The fingerprint from the last `.remember()`.
+    fingerprint _fingerprint;
+
+    // See `.quarantined()`. Atomic since `.sync()` can set it while the file is `.freeze()`ed.
+    std::atomic<bool> _quarantined;
+
+    // See `.check_headers()`.
+    static std::atomic<bool> _check_headers;
+
+    // Takes the fingerprint of an open file.
+    //
+    // fd: The file at `.path()`, open for reading.
+    //
+    // Throws `exc::file` if the file could not be `fstat()`ed, or its header could not be read.
+    fingerprint take(int fd) const;
 };
 
 #endif
@@ -0,0 +1,175 @@
+#include <string>
+#include <vector>
+#include <sstream>
+#include <mutex>
+
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Checkpoint.h"
+#include "exc.h"
+
+using namespace std;
+
+const char Checkpoint::MAGIC[8] = { 'L', 'S', 'M', 'I', 'G', 'R', 'T', '1' };
+
+namespace
+{
+
+// Little endian, like the journal.
+void put(char* out, uint64_t value, size_t bytes)
+{
+    for (size_t i = 0; i < bytes; ++i) out[i] = (char)(value >> (i * 8));
+}
+
+uint64_t get(const char* in, size_t bytes)
+{
+    uint64_t value = 0;
+    for (size_t i = 0; i < bytes; ++i) value |= (uint64_t)(unsigned char)in[i] << (i * 8);
+    return value;
+}
+
+}
+
+Checkpoint::Checkpoint(const string& path, size_t covers, size_t size):
+    _path(path),
+    _fd(-1),
+    _end(0),
+    _unpacked(false),
+    _packed(covers, false),
+    _mutex()
+{
+    _fd = open(_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+
+    if (_fd < 0)
+    {
+        stringstream ss;
+        ss << "could not open checkpoint '" << _path << "': " << strerror(errno);
+        THROW(file, ss.str());
+    }
+
+    struct stat st;
+
+    if (fstat(_fd, &st) < 0)
+    {
+        stringstream ss;
+        ss << "could not get size of checkpoint '" << _path << "': " << strerror(errno);
+        close(_fd);
+        THROW(file, ss.str());
+    }
+
+    char header[HEADER];
+    memcpy(header, MAGIC, sizeof(MAGIC));
+    put(header + 8,  covers, 8);
+    put(header + 16, size,   8);
+
+    // A brand new (or empty) file is a migration that hasn't started yet.
+    if (st.st_size == 0)
+    {
+        if (pwrite(_fd, header, HEADER, 0) != (ssize_t)HEADER || fdatasync(_fd) < 0)
+        {
+            stringstream ss;
+            ss << "could not initialise checkpoint '" << _path << "': " << strerror(errno);
+            close(_fd);
+            THROW(file, ss.str());
+        }
+
+        _end = HEADER;
+        return;
+    }
+
+    // Anything else had better be the checkpoint of this very migration.
+    vector<char> contents(st.st_size);
+
+    if (pread(_fd, contents.data(), contents.size(), 0) != (ssize_t)contents.size())
+    {
+        stringstream ss;
+        ss << "could not read from checkpoint '" << _path << "': " << strerror(errno);
+        close(_fd);
+        THROW(file, ss.str());
+    }
+
+    if (contents.size() < HEADER || memcmp(contents.data(), MAGIC, sizeof(MAGIC)))
+    {
+        stringstream ss;
+        ss << "'" << _path << "' is not a checkpoint";
+        close(_fd);
+        THROW(file, ss.str());
+    }
+
+    if (memcmp(contents.data(), header, HEADER))
+    {
+        stringstream ss;
+        ss << "checkpoint '" << _path << "' is for " << get(contents.data() + 8, 8)
+            << " covers and " << get(contents.data() + 16, 8) << " bytes, not " << covers
+            << " covers and " << size << " bytes";
+        close(_fd);
+        THROW(file, ss.str());
+    }
+
+    // A record which was only partly written when we crashed is simply left out, and written
+    // over by the next one.
+    for (_end = HEADER; _end + 4 <= contents.size(); _end += 4)
+    {
+        uint32_t record = get(contents.data() + _end, 4);
+
+        if (record == UNPACKED)   _unpacked = true;
+        else if (record < covers) _packed[record] = true;
+    }
+}
+
+Checkpoint::~Checkpoint() { close(_fd); }
+
+const string& Checkpoint::path() const { return _path; }
+
+bool Checkpoint::unpacked()
+{
+    lock_guard<mutex> lock(_mutex);
+    return _unpacked;
+}
+
+void Checkpoint::mark_unpacked()
+{
+    lock_guard<mutex> lock(_mutex);
+
+    if (_unpacked) return;
+
+    append(UNPACKED);
+    _unpacked = true;
+}
+
+bool Checkpoint::packed(size_t cover)
+{
+    lock_guard<mutex> lock(_mutex);
+    return _packed[cover];
+}
+
+void Checkpoint::mark_packed(size_t cover)
+{
+    lock_guard<mutex> lock(_mutex);
+
+    if (_packed[cover]) return;
+
+    append(cover);
+    _packed[cover] = true;
+}
+
+void Checkpoint::append(uint32_t record)
+{
+    char buf[4];
+    put(buf, record, 4);
+
+    if (pwrite(_fd, buf, sizeof(buf), _end) != sizeof(buf) || fdatasync(_fd) < 0)
+    {
+        stringstream ss;
+        ss << "could not write to checkpoint '" << _path << "': " << strerror(errno);
+        THROW(file, ss.str());
+    }
+
+    _end += sizeof(buf);
+}
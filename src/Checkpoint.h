@@ -0,0 +1,103 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+
+#include <cstddef>
+#include <cstdint>
+
+// How far a migration has got, (see `loop-steg migrate`), so that one which was interrupted can
+// carry on where it left off rather than starting again. A migration has two passes: first the
+// whole volume is unpacked to a scratch file under the old seed and layout, then it's packed back
+// into the covers from there under the new ones. Unpacking only reads the covers, so it's recorded
+// once it's finished. Packing is recorded a cover at a time, since once a cover has been packed,
+// it no longer holds what it did under the old seed, and there's no going back to the first pass.
+//
+// The checkpoint lives in a small file of its own, next to the scratch file. It looks like:
+//
+// "LSMIGRT1"                        8 byte magic number
+// [covers: 8 bytes][size: 8 bytes] How many covers, and the size of the scratch file, so that a
+//                                  checkpoint isn't used for a different migration by mistake.
+// [record: 4 bytes]...              The index of every cover which has been packed, or `UNPACKED`
+//                                  once the first pass is done.
+//
+// All integers are little endian. Every record is made durable before the next thing is done, so a
+// crash loses at most a record which was being written, and only means redoing that cover.
+class Checkpoint
+{
+    public:
+    // Opens the checkpoint at `path`, creating it if it doesn't exist.
+    //
+    // path:   The path to the checkpoint file.
+    // covers: How many covers there are.
+    // size:   The size of the scratch file, i.e. the capacity of the volume under the old seed.
+    //
+    // Throws `exc::file` if the file at `path` could not be opened, created or read.
+    // Throws `exc::file` if the file at `path` exists, is not empty, and is not a checkpoint, or
+    // is one for a different number of covers or size.
+    Checkpoint(const std::string& path, size_t covers, size_t size);
+
+    // There should only be one `Checkpoint` per file, for the same reasons as `Journal`.
+    Checkpoint(const Checkpoint& other)            = delete;
+    Checkpoint& operator=(const Checkpoint& other) = delete;
+
+    ~Checkpoint();
+
+    // The path to the checkpoint file, as given to `Checkpoint()`.
+    const std::string& path() const;
+
+    // Whether the first pass has finished, so the scratch file holds the whole volume.
+    bool unpacked();
+
+    // Records that the first pass has finished. Only do this once the scratch file is durable.
+    //
+    // Throws `exc::file` if the record could not be written or synced.
+    void mark_unpacked();
+
+    // Whether a cover has been packed under the new seed already.
+    //
+    // cover: Index of the cover.
+    bool packed(size_t cover);
+
+    // Records that a cover has been packed under the new seed. Only do this once it's synced.
+    //
+    // cover: Index of the cover.
+    //
+    // Throws `exc::file` if the record could not be written or synced.
+    void mark_packed(size_t cover);
+
+    private:
+    // The magic number at the start of every checkpoint.
+    static const char MAGIC[8];
+
+    // Size in bytes of the magic number and everything else before the records.
+    static const size_t HEADER = 24;
+
+    // The record which says the first pass is done.
+    static const uint32_t UNPACKED = UINT32_MAX;
+
+    // Same as `path` given to `Checkpoint()`.
+    std::string _path;
+
+    // File descriptor of the open checkpoint file.
+    int _fd;
+
+    // Size of the checkpoint file. New records go at the end.
+    size_t _end;
+
+    // See `.unpacked()`.
+    bool _unpacked;
+
+    // Whether each cover has been packed, by index.
+    std::vector<bool> _packed;
+
+    // Protects everything, since covers are packed many at a time.
+    std::mutex _mutex;
+
+    // Appends a record and syncs it. Call with `_mutex` held.
+    void append(uint32_t record);
+};
+
+#endif
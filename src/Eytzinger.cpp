@@ -0,0 +1,40 @@
+#include <vector>
+
+#include "Eytzinger.h"
+
+using namespace std;
+
+Eytzinger::Eytzinger(): _tree(1), _index(1) { }
+
+Eytzinger::Eytzinger(const vector<size_t>& sorted):
+    _tree(sorted.size() + 1),
+    _index(sorted.size() + 1)
+{
+    size_t i = 0;
+    build(sorted, 1, i);
+}
+
+size_t Eytzinger::upper_bound(size_t value) const
+{
+    // Go left if the number at this node is greater than `value`, right otherwise. The left child
+    // of node `k` is at 2k and the right one at 2k + 1, so that's just adding the comparison.
+    size_t k = 1;
+    while (k < _tree.size()) k = 2 * k + (_tree[k] <= value);
+
+    // We've fallen off the bottom of the tree. The answer is the last node where we went left: every
+    // time we went right since, a 1 was added to the end of `k`, and going left added a 0, so get
+    // rid of the trailing 1s and the 0 before them. If we never went left, this leaves 0.
+    k >>= __builtin_ffsll(~(unsigned long long)k);
+
+    return k ? _index[k] : _tree.size() - 1;
+}
+
+void Eytzinger::build(const vector<size_t>& sorted, size_t k, size_t& i)
+{
+    if (k >= _tree.size()) return;
+
+    build(sorted, 2 * k, i);
+    _tree[k]  = sorted[i];
+    _index[k] = i++;
+    build(sorted, 2 * k + 1, i);
+}
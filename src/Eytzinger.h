@@ -0,0 +1,48 @@
+#ifndef EYTZINGER_H
+#define EYTZINGER_H
+
+#include <vector>
+
+#include <cstddef>
+
+// A sorted list of numbers, laid out for searching quickly. `std::upper_bound()` on a sorted
+// `vector` jumps all over memory, and mispredicts a branch at every step. This keeps the numbers in
+// the order a binary search visits them, (Eytzinger order: the middle, then the middle of each
+// half, and so on, like a heap), so the first few steps of every search share the same cache lines,
+// and each step is a comparison rather than a branch.
+//
+// Used by the layouts to find which file a byte is in, out of the cumulative capacities of
+// possibly millions of files.
+class Eytzinger
+{
+    public:
+    // Empty, so `.upper_bound()` always returns 0.
+    Eytzinger();
+
+    // sorted: The numbers to search. Must be sorted, smallest first.
+    Eytzinger(const std::vector<size_t>& sorted);
+
+    // Same as `std::upper_bound()`.
+    //
+    // value: The value to search for.
+    //
+    // Returns the index in `sorted`, as given to the constructor, of the first number which is
+    //         greater than `value`, or the number of numbers if there isn't one.
+    size_t upper_bound(size_t value) const;
+
+    private:
+    // The numbers, in Eytzinger order, starting from index 1. Index 0 is unused.
+    std::vector<size_t> _tree;
+
+    // The index in `sorted` of each number in `_tree`.
+    std::vector<size_t> _index;
+
+    // Fills in `_tree` and `_index` from node `k` down, in order.
+    //
+    // sorted: As given to the constructor.
+    // k:      The node to start from.
+    // i:      The next index in `sorted` to put in the tree. Updated as we go.
+    void build(const std::vector<size_t>& sorted, size_t k, size_t& i);
+};
+
+#endif
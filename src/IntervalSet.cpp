@@ -0,0 +1,96 @@
+#include <map>
+#include <vector>
+#include <utility>
+#include <functional>
+#include <algorithm>
+
+#include "IntervalSet.h"
+
+using namespace std;
+
+IntervalSet::IntervalSet(): _ranges() { }
+
+void IntervalSet::add(size_t start, size_t end, const function<void(size_t, size_t)>& fn)
+{
+    if (start >= end) return;
+
+    // Every range which overlaps or touches the new one gets swallowed up by it, and the gaps
+    // between them are the parts which are new.
+    auto it = _ranges.upper_bound(start);
+    if (it != _ranges.begin() && prev(it)->second >= start) --it;
+
+    size_t first = start, last = end, at = start;
+
+    while (it != _ranges.end() && it->first <= end)
+    {
+        if (fn && it->first > at) fn(at, it->first);
+
+        at    = max(at, it->second);
+        first = min(first, it->first);
+        last  = max(last, it->second);
+        it    = _ranges.erase(it);
+    }
+
+    if (fn && at < end) fn(at, end);
+
+    _ranges.emplace(first, last);
+}
+
+void IntervalSet::remove(size_t start, size_t end, const function<void(size_t, size_t)>& fn)
+{
+    if (start >= end) return;
+
+    auto it = first_after(start);
+
+    // Whatever's left of the ranges on either side, if they stick out past the range.
+    vector<pair<size_t, size_t>> left;
+
+    while (it != _ranges.end() && it->first < end)
+    {
+        if (fn) fn(max(it->first, start), min(it->second, end));
+
+        if (it->first < start) left.emplace_back(it->first, start);
+        if (it->second > end)  left.emplace_back(end, it->second);
+
+        it = _ranges.erase(it);
+    }
+
+    _ranges.insert(left.begin(), left.end());
+}
+
+void IntervalSet::walk(size_t start, size_t end,
+        const function<void(size_t, size_t, bool)>& fn) const
+{
+    auto it = first_after(start);
+
+    for (size_t at = start; at < end; ++it)
+    {
+        // No more ranges in the way, so the rest isn't in the set.
+        if (it == _ranges.end() || it->first >= end)
+        {
+            fn(at, end, false);
+            return;
+        }
+
+        if (it->first > at)
+        {
+            fn(at, it->first, false);
+            at = it->first;
+        }
+
+        size_t stop = min(it->second, end);
+        fn(at, stop, true);
+        at = stop;
+    }
+}
+
+bool IntervalSet::empty() const { return _ranges.empty(); }
+
+void IntervalSet::clear() { _ranges.clear(); }
+
+map<size_t, size_t>::const_iterator IntervalSet::first_after(size_t at) const
+{
+    auto it = _ranges.upper_bound(at);
+    if (it != _ranges.begin() && prev(it)->second > at) --it;
+    return it;
+}
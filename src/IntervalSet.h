@@ -0,0 +1,55 @@
+#ifndef INTERVAL_SET_H
+#define INTERVAL_SET_H
+
+#include <map>
+#include <functional>
+
+#include <cstddef>
+
+// A set of numbers, kept as disjoint ranges rather than one at a time, so that a set covering
+// billions of numbers can be just a handful of ranges. Used to keep track of which parts of a
+// `Manager` have been discarded.
+//
+// Ranges are half-open: [`start`, `end`). Ranges which touch are merged, so the set always has as
+// few ranges as it can.
+class IntervalSet
+{
+    public:
+    IntervalSet();
+
+    // Adds a range to the set.
+    //
+    // start, end: The range.
+    // fn:         If not null, called with the start and end of every part of the range which
+    //             wasn't already in the set, in order.
+    void add(size_t start, size_t end, const std::function<void(size_t, size_t)>& fn = nullptr);
+
+    // Removes a range from the set.
+    //
+    // start, end: The range.
+    // fn:         If not null, called with the start and end of every part of the range which was
+    //             in the set, in order.
+    void remove(size_t start, size_t end, const std::function<void(size_t, size_t)>& fn = nullptr);
+
+    // Goes through a range, part by part, in order.
+    //
+    // start, end: The range.
+    // fn:         Called with the start and end of every part of the range, and whether that part
+    //             is in the set. Parts which are in the set and parts which aren't take turns.
+    void walk(size_t start, size_t end, const std::function<void(size_t, size_t, bool)>& fn) const;
+
+    // Whether there's nothing in the set.
+    bool empty() const;
+
+    // Removes everything from the set.
+    void clear();
+
+    private:
+    // Every range in the set, start to end. No two overlap or touch.
+    std::map<size_t, size_t> _ranges;
+
+    // The first range which ends after `at`, or `_ranges.end()` if there isn't one.
+    std::map<size_t, size_t>::const_iterator first_after(size_t at) const;
+};
+
+#endif
@@ -0,0 +1,379 @@
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <algorithm>
+
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "IoEngine.h"
+#include "ThreadPool.h"
+
+using namespace std;
+
+struct IoEngine::batch
+{
+    // How many pieces haven't been reaped yet.
+    size_t left;
+};
+
+struct IoEngine::piece
+{
+    batch* owner;
+    char*  buf;
+    size_t size;
+    off_t  offset;
+
+    // What the kernel said: the number of bytes transferred, or a negated `errno`.
+    int result;
+};
+
+namespace
+{
+
+// What `.read()` and `.write()` do without a ring, and how short transfers from the ring are
+// finished off.
+bool fallback(int fd, char* buf, size_t size, off_t offset, bool write)
+{
+    for (size_t done = 0; done < size;)
+    {
+        ssize_t result = write ? pwrite(fd, buf + done, size - done, offset + done)
+                               : pread(fd, buf + done, size - done, offset + done);
+
+        if (result < 0 && errno == EINTR) continue;
+
+        if (result == 0 && !write) errno = 0;
+        if (result <= 0) return false;
+
+        done += result;
+    }
+
+    return true;
+}
+
+int io_uring_setup(unsigned entries, io_uring_params* params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+}
+
+IoEngine& IoEngine::get()
+{
+    static IoEngine engine;
+
+    static once_flag once;
+    call_once(once, []()
+    { ThreadPool::at_fork(&before_fork, &after_fork_parent, &after_fork_child); });
+
+    return engine;
+}
+
+IoEngine::IoEngine(unsigned entries):
+    _fd(-1),
+    _entries(entries),
+    _sq_map(nullptr),
+    _sq_size(0),
+    _cq_map(nullptr),
+    _cq_size(0),
+    _sqes(nullptr),
+    _sqes_size(0),
+    _sq_head(nullptr),
+    _sq_tail(nullptr),
+    _sq_mask(nullptr),
+    _sq_array(nullptr),
+    _cq_head(nullptr),
+    _cq_tail(nullptr),
+    _cq_mask(nullptr),
+    _cqes(nullptr),
+    _queued(0),
+    _pending(0),
+    _reaping(false),
+    _ready(false),
+    _mutex(),
+    _cv()
+{ }
+
+IoEngine::~IoEngine() { teardown(); }
+
+bool IoEngine::read(int fd, void* buf, size_t size, off_t offset)
+{
+    if (size >= SMALL && ring()) return transfer(fd, (char*)buf, size, offset, false);
+    return fallback(fd, (char*)buf, size, offset, false);
+}
+
+bool IoEngine::write(int fd, const void* buf, size_t size, off_t offset)
+{
+    if (size >= SMALL && ring()) return transfer(fd, (char*)buf, size, offset, true);
+    return fallback(fd, (char*)buf, size, offset, true);
+}
+
+bool IoEngine::ring()
+{
+    lock_guard<mutex> lock(_mutex);
+
+    if (!_ready)
+    {
+        setup();
+        _ready = true;
+    }
+
+    return _fd >= 0;
+}
+
+void IoEngine::setup()
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    _fd = io_uring_setup(_entries, &params);
+    if (_fd < 0) return;
+
+    // Plain `IORING_OP_READ` and `IORING_OP_WRITE` arrived in the same kernel as this feature. If
+    // they're not there, the ring isn't worth having.
+    if (!(params.features & IORING_FEAT_RW_CUR_POS))
+    {
+        teardown();
+        return;
+    }
+
+    _entries = params.sq_entries;
+    _sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    _cq_size = params.cq_off.cqes  + params.cq_entries * sizeof(io_uring_cqe);
+
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) _sq_size = _cq_size = max(_sq_size, _cq_size);
+
+    _sq_map = mmap(nullptr, _sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd,
+                   IORING_OFF_SQ_RING);
+
+    if (_sq_map == MAP_FAILED)
+    {
+        _sq_map = nullptr;
+        teardown();
+        return;
+    }
+
+    _cq_map = single ? _sq_map : mmap(nullptr, _cq_size, PROT_READ | PROT_WRITE,
+                                      MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_CQ_RING);
+
+    if (_cq_map == MAP_FAILED)
+    {
+        _cq_map = nullptr;
+        teardown();
+        return;
+    }
+
+    _sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(nullptr, _sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd,
+                      IORING_OFF_SQES);
+
+    if (sqes == MAP_FAILED)
+    {
+        teardown();
+        return;
+    }
+
+    _sqes = (io_uring_sqe*)sqes;
+
+    char* sq = (char*)_sq_map;
+    _sq_head  = (unsigned*)(sq + params.sq_off.head);
+    _sq_tail  = (unsigned*)(sq + params.sq_off.tail);
+    _sq_mask  = (unsigned*)(sq + params.sq_off.ring_mask);
+    _sq_array = (unsigned*)(sq + params.sq_off.array);
+
+    char* cq = (char*)_cq_map;
+    _cq_head = (unsigned*)(cq + params.cq_off.head);
+    _cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    _cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    _cqes    = (io_uring_cqe*)(cq + params.cq_off.cqes);
+}
+
+void IoEngine::teardown()
+{
+    if (_sqes)                         munmap(_sqes, _sqes_size);
+    if (_cq_map && _cq_map != _sq_map) munmap(_cq_map, _cq_size);
+    if (_sq_map)                       munmap(_sq_map, _sq_size);
+    if (_fd >= 0)                      close(_fd);
+
+    _fd     = -1;
+    _sq_map = _cq_map = nullptr;
+    _sqes   = nullptr;
+    _queued = _pending = 0;
+}
+
+bool IoEngine::transfer(int fd, char* buf, size_t size, off_t offset, bool write)
+{
+    size_t count = (size + PIECE - 1) / PIECE;
+
+    batch b = {count};
+    vector<piece> pieces(count);
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        size_t start = i * PIECE;
+        pieces[i] = {&b, buf + start, min(PIECE, size - start), offset + (off_t)start, 0};
+    }
+
+    {
+        unique_lock<mutex> lock(_mutex);
+
+        for (size_t next = 0; b.left;)
+        {
+            // Put in as many of our pieces as there's room for, and send them off. If there isn't
+            // room for all of them, the rest wait for some room to be reaped.
+            for (; next < count && _pending < _entries; ++next) queue(pieces[next], fd, write);
+            submit();
+
+            if (!b.left) break;
+
+            // Someone else is already waiting on the kernel, and will wake us when they've reaped.
+            if (_reaping)
+            {
+                _cv.wait(lock);
+                continue;
+            }
+
+            // Nothing's in flight to wait for, since the kernel wouldn't take anything. Give it a
+            // moment and try again.
+            if (_pending == _queued)
+            {
+                lock.unlock();
+                this_thread::yield();
+                lock.lock();
+                continue;
+            }
+
+            // Otherwise it's our turn to wait for completions, and reap them for everyone.
+            _reaping = true;
+            lock.unlock();
+            io_uring_enter(_fd, 0, 1, IORING_ENTER_GETEVENTS);
+            lock.lock();
+            _reaping = false;
+
+            reap();
+            _cv.notify_all();
+        }
+    }
+
+    // The kernel is allowed to transfer less than we asked for, (for example, if a read reaches the
+    // end of the file), so finish off any short pieces the slow way. That also sorts out whether it
+    // really was the end of the file.
+    for (const piece& p : pieces)
+    {
+        if (p.result < 0)
+        {
+            errno = -p.result;
+            return false;
+        }
+
+        size_t done = p.result;
+
+        if (done < p.size && !fallback(fd, p.buf + done, p.size - done, p.offset + done, write))
+            return false;
+    }
+
+    return true;
+}
+
+void IoEngine::queue(piece& p, int fd, bool write)
+{
+    // Only we ever move the tail, so there's no need for an atomic load, only an atomic store so
+    // that the kernel sees the entry before it sees the new tail.
+    unsigned tail  = *_sq_tail;
+    unsigned index = tail & *_sq_mask;
+
+    io_uring_sqe& sqe = _sqes[index];
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode    = write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe.fd        = fd;
+    sqe.addr      = (uintptr_t)p.buf;
+    sqe.len       = p.size;
+    sqe.off       = p.offset;
+    sqe.user_data = (uintptr_t)&p;
+
+    _sq_array[index] = index;
+    __atomic_store_n(_sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    ++_queued;
+    ++_pending;
+}
+
+void IoEngine::submit()
+{
+    while (_queued)
+    {
+        int result = io_uring_enter(_fd, _queued, 0, 0);
+
+        if (result > 0)
+        {
+            _queued -= result;
+            continue;
+        }
+
+        if (result == 0 || errno == EAGAIN || errno == EBUSY) return;
+        if (errno == EINTR) continue;
+
+        // The kernel won't take these at all. It hasn't looked at anything past its head of the
+        // queue, so we can take them back out, and fail them.
+        int error = errno;
+        unsigned tail = *_sq_tail;
+
+        for (unsigned i = tail - _queued; i != tail; ++i)
+        {
+            piece* p = (piece*)(uintptr_t)_sqes[_sq_array[i & *_sq_mask]].user_data;
+            p->result = -error;
+            --p->owner->left;
+            --_pending;
+        }
+
+        __atomic_store_n(_sq_tail, tail - _queued, __ATOMIC_RELEASE);
+        _queued = 0;
+        _cv.notify_all();
+    }
+}
+
+void IoEngine::reap()
+{
+    // Only we ever move the head. The kernel moves the tail, so that needs an atomic load, so that
+    // we don't see the new tail before the entries behind it.
+    unsigned head = *_cq_head;
+    unsigned tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; ++head)
+    {
+        const io_uring_cqe& cqe = _cqes[head & *_cq_mask];
+
+        piece* p = (piece*)(uintptr_t)cqe.user_data;
+        p->result = cqe.res;
+        --p->owner->left;
+        --_pending;
+    }
+
+    __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+}
+
+void IoEngine::before_fork() { get()._mutex.lock(); }
+
+void IoEngine::after_fork_parent() { get()._mutex.unlock(); }
+
+void IoEngine::after_fork_child()
+{
+    IoEngine& engine = get();
+    engine.teardown();
+    engine._reaping = false;
+    engine._ready   = false;
+    engine._mutex.unlock();
+}
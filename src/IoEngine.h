@@ -0,0 +1,157 @@
+#ifndef IO_ENGINE_H
+#define IO_ENGINE_H
+
+#include <mutex>
+#include <condition_variable>
+
+#include <cstddef>
+
+#include <sys/types.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+// Where the bytes of covers actually come from and go to. Reading a cover, (or writing one back),
+// is a few big transfers, and with thousands of covers being prepared or synced at once from
+// `ThreadPool::get()`, plain `pread()` and `pwrite()` only ever have one transfer per thread in
+// flight, with the thread sat waiting on it instead of decoding or encoding.
+//
+// So an `IoEngine` has an io_uring, (set up with the raw syscalls, so there's no liburing to depend
+// on), shared by every thread. Big transfers are split into pieces which all go into the ring in
+// one submission, so that hundreds of pieces can be in flight at once across all the threads, and
+// the disk always has a deep queue to work through. There's no thread dedicated to reaping
+// completions: whichever waiting thread gets there first reaps for everybody, and wakes up whoever
+// it reaped for.
+//
+// If there's no io_uring to be had, (an old kernel, or a seccomp filter which forbids it, which is
+// common in containers), or a transfer is too small to be worth it, it's plain `pread()` and
+// `pwrite()` instead, which is slower but does the same thing.
+class IoEngine
+{
+    public:
+    // The one engine that everything shares.
+    static IoEngine& get();
+
+    // The ring isn't set up until the first transfer which needs it.
+    //
+    // entries: How many pieces can be in flight at once. The kernel might round this up.
+    IoEngine(unsigned entries = 256);
+
+    ~IoEngine();
+
+    IoEngine(const IoEngine& other)            = delete;
+    IoEngine& operator=(const IoEngine& other) = delete;
+
+    // Like `pread()`, but keeps going until it's read everything, or fails.
+    //
+    // fd, buf, size, offset: As for `pread()`.
+    //
+    // Returns true if all `size` bytes were read. Otherwise false, with `errno` set, or 0 if the
+    //         file ended first.
+    bool read(int fd, void* buf, size_t size, off_t offset);
+
+    // Like `pwrite()`, but keeps going until it's written everything, or fails.
+    //
+    // fd, buf, size, offset: As for `pwrite()`.
+    //
+    // Returns true if all `size` bytes were written. Otherwise false, with `errno` set.
+    bool write(int fd, const void* buf, size_t size, off_t offset);
+
+    // Whether transfers are going through an io_uring, rather than `pread()` and `pwrite()`.
+    bool ring();
+
+    private:
+    // Transfers are split into pieces of this size, so that one big transfer is lots of requests
+    // in flight, rather than one the kernel has to work through alone.
+    static const size_t PIECE = 1 << 20;
+
+    // Transfers smaller than this just go straight to `pread()` and `pwrite()`. There's nothing to
+    // batch, and the syscall is cheaper than the ring's bookkeeping.
+    static const size_t SMALL = 64 << 10;
+
+    // One piece of a transfer, and how it turned out.
+    struct piece;
+
+    // Every piece of one transfer.
+    struct batch;
+
+    // Sets up the ring. Leaves `_fd` negative if that couldn't be done.
+    void setup();
+
+    // Tears down the ring, if there is one.
+    void teardown();
+
+    // Reads or writes through the ring. See `.read()` and `.write()`.
+    bool transfer(int fd, char* buf, size_t size, off_t offset, bool write);
+
+    // Puts a piece in the submission queue, for the next `.submit()`. Must hold `_mutex`, and there
+    // must be room, (`_pending < _entries`).
+    void queue(piece& p, int fd, bool write);
+
+    // Hands every queued piece to the kernel. Must hold `_mutex`.
+    //
+    // If the kernel won't take them right now, (which it's allowed to do when it's short on memory,
+    // or has too many completions waiting to be reaped), they stay queued for next time. If it
+    // won't take them at all, they're taken back out of the queue and failed with its error.
+    void submit();
+
+    // Takes every completion off the ring, and hands each result to its piece. Must hold `_mutex`.
+    void reap();
+
+    // `ThreadPool::at_fork()` handlers for `IoEngine::get()`. Nobody can be halfway through using
+    // the ring when the process forks, and the child gets a ring of its own when it first needs
+    // one, rather than sharing the parent's. They go through `ThreadPool` so that the workers are
+    // stopped first, since they use the ring too.
+    static void before_fork();
+    static void after_fork_parent();
+    static void after_fork_child();
+
+    // The ring's file descriptor, or negative if there's no ring.
+    int _fd;
+
+    // How many pieces can be in flight at once, which is the size of the submission queue.
+    unsigned _entries;
+
+    // The submission and completion queues, as mapped from the kernel, and the sizes of the
+    // mappings. If the kernel supports it, both queues are in the one mapping.
+    void*  _sq_map;
+    size_t _sq_size;
+    void*  _cq_map;
+    size_t _cq_size;
+
+    // The submission queue entries themselves, which have a mapping of their own.
+    io_uring_sqe* _sqes;
+    size_t        _sqes_size;
+
+    // Pointers into the submission queue mapping. Only we move `_sq_tail`, and only the kernel
+    // moves `_sq_head`.
+    unsigned* _sq_head;
+    unsigned* _sq_tail;
+    unsigned* _sq_mask;
+    unsigned* _sq_array;
+
+    // Pointers into the completion queue mapping. Only the kernel moves `_cq_tail`, and only we
+    // move `_cq_head`.
+    unsigned*     _cq_head;
+    unsigned*     _cq_tail;
+    unsigned*     _cq_mask;
+    io_uring_cqe* _cqes;
+
+    // How many SQEs we've queued which the kernel hasn't taken yet, and how many pieces are in the
+    // ring altogether, (queued or in flight), waiting to be reaped.
+    unsigned _queued;
+    unsigned _pending;
+
+    // Whether some thread is waiting on the kernel for completions, and so will reap for everyone.
+    bool _reaping;
+
+    // Whether the ring has been set up yet, (or failed to be). It's set up lazily, so that the
+    // child after a `fork()` doesn't end up with a ring it never uses.
+    bool _ready;
+
+    // Protects everything, and signals when completions have been reaped.
+    std::mutex              _mutex;
+    std::condition_variable _cv;
+};
+
+#endif
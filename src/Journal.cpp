@@ -0,0 +1,313 @@
+#include <string>
+#include <vector>
+#include <sstream>
+#include <functional>
+#include <mutex>
+#include <algorithm>
+#include <exception>
+
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Journal.h"
+#include "fs.h"
+#include "exc.h"
+#include "util.h"
+
+using namespace std;
+
+const char Journal::MAGIC[8] = { 'L', 'S', 'J', 'O', 'U', 'R', 'N', '1' };
+
+namespace
+{
+
+// Little endian encoding/decoding, so the journal means the same thing on any machine.
+void put(char* out, uint64_t value, size_t bytes)
+{
+    for (size_t i = 0; i < bytes; ++i) out[i] = (char)(value >> (i * 8));
+}
+
+uint64_t get(const char* in, size_t bytes)
+{
+    uint64_t value = 0;
+    for (size_t i = 0; i < bytes; ++i) value |= (uint64_t)(unsigned char)in[i] << (i * 8);
+    return value;
+}
+
+// Checksum of a record, given its header (with the checksum field ignored) and its data.
+uint32_t checksum(const char* header, const char* data, size_t size)
+{ return (uint32_t)util::hash(data, size, util::hash(header, 12)); }
+
+}
+
+Journal::Journal(const string& path): _path(path), _fd(-1), _end(0), _buffer(), _mutex()
+{
+    _fd = open(_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+
+    if (_fd < 0)
+    {
+        stringstream ss;
+        ss << "could not open journal '" << _path << "': " << strerror(errno);
+        THROW(file, ss.str());
+    }
+
+    struct stat st;
+
+    if (fstat(_fd, &st) < 0)
+    {
+        stringstream ss;
+        ss << "could not get size of journal '" << _path << "': " << strerror(errno);
+        close(_fd);
+        THROW(file, ss.str());
+    }
+
+    _end = st.st_size;
+
+    // A brand new (or empty) file becomes a brand new journal.
+    if (_end == 0)
+    {
+        if (pwrite(_fd, MAGIC, sizeof(MAGIC), 0) != sizeof(MAGIC) || fdatasync(_fd) < 0)
+        {
+            stringstream ss;
+            ss << "could not initialise journal '" << _path << "': " << strerror(errno);
+            close(_fd);
+            THROW(file, ss.str());
+        }
+
+        _end = sizeof(MAGIC);
+        return;
+    }
+
+    // Otherwise, it had better be a journal already. Refuse to touch anything else, in case
+    // someone pointed us at something important by mistake.
+    char magic[sizeof(MAGIC)];
+
+    if (pread(_fd, magic, sizeof(magic), 0) != sizeof(magic) || memcmp(magic, MAGIC, sizeof(MAGIC)))
+    {
+        stringstream ss;
+        ss << "'" << _path << "' is not a journal";
+        close(_fd);
+        THROW(file, ss.str());
+    }
+}
+
+Journal::~Journal() { close(_fd); }
+
+const string& Journal::path() const { return _path; }
+
+size_t Journal::size()
+{
+    lock_guard<mutex> lock(_mutex);
+    return _end + _buffer.size();
+}
+
+size_t Journal::replay(const function<void(const char*, size_t, off_t)>& apply,
+                       const function<void(off_t, size_t)>& discard)
+{
+    lock_guard<mutex> lock(_mutex);
+
+    size_t pos = sizeof(MAGIC), records = 0;
+    char header[RECORD_HEADER];
+    vector<char> data;
+
+    while (pos + RECORD_HEADER <= _end)
+    {
+        if (pread(_fd, header, RECORD_HEADER, pos) != (ssize_t)RECORD_HEADER)
+        {
+            stringstream ss;
+            ss << "could not read from journal '" << _path << "': " << strerror(errno);
+            THROW(file, ss.str());
+        }
+
+        uint64_t offset = get(header, 8);
+        size_t   size   = get(header + 8, 4);
+
+        // A record that runs off the end of the file was torn when we crashed.
+        if (pos + RECORD_HEADER + size > _end) break;
+
+        data.resize(size);
+
+        if (pread(_fd, data.data(), size, pos + RECORD_HEADER) != (ssize_t)size)
+        {
+            stringstream ss;
+            ss << "could not read from journal '" << _path << "': " << strerror(errno);
+            THROW(file, ss.str());
+        }
+
+        if (get(header + 12, 4) != checksum(header, data.data(), size)) break;
+
+        // A discard's data is its length, and nothing else.
+        if ((offset & DISCARD) && size != 8) break;
+
+        if (!(offset & DISCARD)) apply(data.data(), size, offset);
+        else if (discard)        discard(offset & ~DISCARD, get(data.data(), 8));
+
+        pos += RECORD_HEADER + size;
+        ++records;
+    }
+
+    // Chop off whatever garbage was left after the last good record, if any.
+    if (pos != _end)
+    {
+        if (ftruncate(_fd, pos) < 0 || fdatasync(_fd) < 0)
+        {
+            stringstream ss;
+            ss << "could not truncate journal '" << _path << "': " << strerror(errno);
+            THROW(file, ss.str());
+        }
+
+        _end = pos;
+    }
+
+    return records;
+}
+
+void Journal::append(const char* buf, size_t size, off_t offset)
+{
+    if (size > UINT32_MAX) THROW(arg, "`size` must be < 4 GiB");
+
+    record(buf, size, offset);
+}
+
+void Journal::discard(off_t offset, size_t size)
+{
+    char data[8];
+    put(data, size, 8);
+
+    record(data, sizeof(data), offset | DISCARD);
+}
+
+void Journal::record(const char* buf, size_t size, uint64_t offset)
+{
+    lock_guard<mutex> lock(_mutex);
+
+    char header[RECORD_HEADER];
+    put(header, offset, 8);
+    put(header + 8, size, 4);
+    put(header + 12, checksum(header, buf, size), 4);
+
+    _buffer.insert(_buffer.end(), header, header + RECORD_HEADER);
+    _buffer.insert(_buffer.end(), buf, buf + size);
+
+    if (_buffer.size() >= FLUSH_AT) flush();
+}
+
+void Journal::commit()
+{
+    lock_guard<mutex> lock(_mutex);
+
+    flush();
+
+    if (fdatasync(_fd) < 0)
+    {
+        stringstream ss;
+        ss << "could not sync journal '" << _path << "': " << strerror(errno);
+        THROW(file, ss.str());
+    }
+}
+
+void Journal::reset(size_t upto)
+{
+    lock_guard<mutex> lock(_mutex);
+
+    // Some records need keeping, so copy them to a new journal, and swap it in.
+    if (upto < _end + _buffer.size())
+    {
+        flush();
+        keep(max(upto, sizeof(MAGIC)));
+        return;
+    }
+
+    _buffer.clear();
+
+    if (ftruncate(_fd, sizeof(MAGIC)) < 0 || fdatasync(_fd) < 0)
+    {
+        stringstream ss;
+        ss << "could not reset journal '" << _path << "': " << strerror(errno);
+        THROW(file, ss.str());
+    }
+
+    _end = sizeof(MAGIC);
+}
+
+void Journal::keep(size_t from)
+{
+    string path = _path + ".new";
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+
+    if (fd < 0)
+    {
+        stringstream ss;
+        ss << "could not create new journal '" << path << "': " << strerror(errno);
+        THROW(file, ss.str());
+    }
+
+    // Everything from `from` onwards goes after the magic number, a piece at a time.
+    vector<char> buf(max(sizeof(MAGIC), min(_end - from, FLUSH_AT)));
+    memcpy(buf.data(), MAGIC, sizeof(MAGIC));
+    bool ok = pwrite(fd, buf.data(), sizeof(MAGIC), 0) == sizeof(MAGIC);
+
+    for (size_t done = 0; ok && done < _end - from;)
+    {
+        ssize_t result = pread(_fd, buf.data(), min(buf.size(), _end - from - done), from + done);
+
+        if (result < 0 && errno == EINTR) continue;
+
+        ok = result > 0 && pwrite(fd, buf.data(), result, sizeof(MAGIC) + done) == result;
+        done += ok ? result : 0;
+    }
+
+    if (!ok || fdatasync(fd) < 0 || rename(path.c_str(), _path.c_str()) < 0)
+    {
+        // Before `close()` and `unlink()` get to it.
+        int error = errno;
+        close(fd);
+        unlink(path.c_str());
+
+        stringstream ss;
+        ss << "could not copy journal '" << _path << "' to '" << path << "': " << strerror(error);
+        THROW(file, ss.str());
+    }
+
+    // The rename has to be on the disk before anything is committed to the new journal, or after a
+    // crash, the old one could be back in its place, without records we said were durable.
+    exception_ptr error;
+
+    try { fs::sync_dir(_path); }
+    catch (...) { error = current_exception(); }
+
+    // Either way, the new journal is the one at `_path` now.
+    close(_fd);
+    _fd  = fd;
+    _end = sizeof(MAGIC) + (_end - from);
+
+    if (error) rethrow_exception(error);
+}
+
+void Journal::flush()
+{
+    for (size_t done = 0; done < _buffer.size();)
+    {
+        ssize_t result = pwrite(_fd, _buffer.data() + done, _buffer.size() - done, _end + done);
+
+        if (result < 0)
+        {
+            if (errno == EINTR) continue;
+
+            stringstream ss;
+            ss << "could not write to journal '" << _path << "': " << strerror(errno);
+            THROW(file, ss.str());
+        }
+
+        done += result;
+    }
+
+    _end += _buffer.size();
+    _buffer.clear();
+}
@@ -0,0 +1,160 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <mutex>
+
+#include <cstdint>
+
+#include <sys/types.h>
+
+// A write-ahead journal. Making a write durable the hard way means re-encoding every cover it
+// touched, which takes forever, so instead every write made to a `Manager` can also be appended to
+// a `Journal`. Appending is cheap, and so is making the journal durable with `.commit()`: it's one
+// `write()` and one `fdatasync()`, no matter how many covers the writes landed in. The covers
+// themselves are only rewritten later, whenever the `Manager` is next `.sync()`ed, after which the
+// journal can be `.reset()`. If we crash before that happens, the next mount `.replay()`s the
+// journal, and any writes which were committed are back in the cache, ready to be synced.
+//
+// The journal lives in a single regular file, (a 'designated cover', if you like), which must NOT
+// be inside the directory of covers given to `Manager`, since it isn't an image. It looks like:
+//
+// "LSJOURN1"                                              8 byte magic number, then records:
+// [offset: 8 bytes][size: 4 bytes][checksum: 4 bytes][size bytes of data]
+//
+// All integers are little endian. The checksum covers the offset, size and data, so that a record
+// which was only partially written when we crashed is detected, and it (and anything after it) is
+// ignored when replaying.
+//
+// A record with the top bit of its offset set is a `.discard()` rather than a write, and its data
+// is the 8 byte length of the range that was discarded. Replaying them in order with the writes
+// means a range which was written and then discarded, or the other way around, ends up the way it
+// was left. See `Manager::keep_discards()`.
+//
+// NOTE: The journal holds hidden data in the clear, or at least as clear as it was when it was
+//       written to the `Manager`. If you're using LUKS on top, as you should be, that's ciphertext,
+//       but the mere existence of the file is not very sneaky. Put it somewhere sensible.
+class Journal
+{
+    public:
+    // Opens the journal at `path`, creating it if it doesn't exist.
+    //
+    // path: The path to the journal file.
+    //
+    // Throws `exc::file` if the file at `path` could not be opened or created.
+    // Throws `exc::file` if the file at `path` exists, is not empty, and is not a journal.
+    Journal(const std::string& path);
+
+    // There should only be one `Journal` per file, for the same reasons as `CachedFile`.
+    Journal(const Journal& other)            = delete;
+    Journal& operator=(const Journal& other) = delete;
+
+    // Closes the journal. Anything that was `.append()`ed but not `.commit()`ed is lost, just like
+    // data in the page cache when you don't `fsync()`.
+    ~Journal();
+
+    // The path to the journal file, as given to `Journal(const string&)`.
+    const std::string& path() const;
+
+    // The size of the journal in bytes, including anything `.append()`ed but not yet `.commit()`ed.
+    size_t size();
+
+    // Reads every intact record in the journal, in the order they were written, and passes each one
+    // to `apply`. Reading stops at the first record which is torn or corrupt, and the journal is
+    // truncated there so that new records don't end up stranded behind it.
+    //
+    // apply:   Called with (data, size, offset) for every write.
+    // discard: Called with (offset, size) for every discard. If null, they're skipped.
+    //
+    // Returns the number of records replayed, including any discards.
+    //
+    // Throws `exc::file` if the journal could not be read from or truncated.
+    // Throws anything `apply` or `discard` throws.
+    size_t replay(const std::function<void(const char*, size_t, off_t)>& apply,
+                  const std::function<void(off_t, size_t)>& discard = nullptr);
+
+    // Adds a record to the journal. This is buffered in memory until the next `.commit()`, or until
+    // the buffer gets big, whichever comes first.
+    //
+    // buf:    The data that was written.
+    // size:   Number of bytes in `buf`.
+    // offset: Where `buf` was written to.
+    //
+    // Throws `exc::arg` if `size` doesn't fit in a record. (i.e. it's 4 GiB or more.)
+    // Throws `exc::file` if the buffer had to be flushed, and it could not be written.
+    void append(const char* buf, size_t size, off_t offset);
+
+    // Adds a record saying that a range was discarded. Buffered like `.append()`.
+    //
+    // offset: Start of the range.
+    // size:   Length of the range.
+    //
+    // Throws `exc::file` if the buffer had to be flushed, and it could not be written.
+    void discard(off_t offset, size_t size);
+
+    // Writes out anything buffered by `.append()`, and makes the whole journal durable with
+    // `fdatasync()`. Once this returns, every record appended so far will survive a crash.
+    //
+    // Throws `exc::file` if the journal could not be written to or synced.
+    void commit();
+
+    // Throws away every record in the journal before `upto`, (all of them by default). Only do this
+    // once everything in them has made it into the covers, i.e. after a successful
+    // `Manager::sync()`. Any records after `upto` are kept: they're copied into a new journal,
+    // which replaces the old one with `rename()`, so that a crash part way through leaves one or
+    // the other, and never loses a record which might not be in the covers.
+    //
+    // upto: A `.size()` from earlier, so that it's where a record starts.
+    //
+    // Throws `exc::file` if the journal could not be truncated, copied, or synced.
+    void reset(size_t upto = SIZE_MAX);
+
+    private:
+    // The magic number at the start of every journal.
+    static const char MAGIC[8];
+
+    // Size in bytes of the header before each record's data.
+    static const size_t RECORD_HEADER = 16;
+
+    // Set in the offset of a `.discard()` record.
+    static const uint64_t DISCARD = 1ULL << 63;
+
+    // Once this many bytes are waiting in `_buffer`, `.append()` writes them out without waiting
+    // for `.commit()`. They're still not durable until `.commit()` though.
+    static const size_t FLUSH_AT = 1 << 20;
+
+    // Same as `path` given to `Journal(const string&)`.
+    std::string _path;
+
+    // File descriptor of the open journal file.
+    int _fd;
+
+    // Size of the journal file itself, not counting `_buffer`. New records go at the end.
+    size_t _end;
+
+    // Records which have been `.append()`ed but not yet written to the file.
+    std::vector<char> _buffer;
+
+    // Every public method locks this, since `Manager` can be written to from many threads at once.
+    std::mutex _mutex;
+
+    // Adds a record to `_buffer`, flushing it if it's got big, for `.append()` and `.discard()`.
+    //
+    // Throws `exc::file` if the buffer had to be flushed, and it could not be written.
+    void record(const char* buf, size_t size, uint64_t offset);
+
+    // Replaces the journal with a new one holding only the records from `from` onwards, for
+    // `.reset()`. `_buffer` must be empty, and `_mutex` must be held.
+    //
+    // Throws `exc::file` if the new journal could not be written, synced, or renamed over the old.
+    void keep(size_t from);
+
+    // Writes out `_buffer` at `_end`, without syncing. `_mutex` must be held.
+    //
+    // Throws `exc::file` if the journal could not be written to.
+    void flush();
+};
+
+#endif
@@ -0,0 +1,38 @@
+#include <string>
+#include <vector>
+#include <memory>
+#include <sstream>
+
+#include "Layout.h"
+#include "ByteLayout.h"
+#include "StripeLayout.h"
+#include "exc.h"
+
+using namespace std;
+
+unique_ptr<Layout> Layout::create(const options& opts, const vector<size_t>& capacities,
+        const string& seed)
+{
+    unique_ptr<Layout> layout;
+
+    if (opts.policy == "bytes")
+        layout.reset(new ByteLayout(capacities, seed));
+
+    else if (opts.policy == "stripe")
+        layout.reset(new StripeLayout(capacities, seed, opts.block, opts.covers));
+
+    else
+    {
+        stringstream ss;
+        ss << "unknown layout '" << opts.policy << "', expected 'bytes' or 'stripe'";
+        THROW(config, ss.str());
+    }
+
+    if (!layout->capacity()) THROW(config, "the covers are too small to hold anything");
+
+    return layout;
+}
+
+Layout::Layout(): _capacity(0) { }
+
+size_t Layout::capacity() const { return _capacity; }
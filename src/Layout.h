@@ -0,0 +1,100 @@
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+
+#include <cstdint>
+
+// Decides where every byte of a `Manager` actually lives: which file, and where in that file. This
+// is an abstract base class; the different ways of doing this are the subclasses:
+//
+// <ByteLayout.h>:   Every byte goes somewhere completely random. This is how loop-steg has always
+//                   worked, and the default, so that existing volumes still work.
+// <StripeLayout.h>: Bytes go somewhere random in chunks, so that each block is confined to a few
+//                   covers, and small writes only dirty a few covers rather than thousands.
+//
+// Each file has a capacity, and files are numbered in the order their capacities were given. Every
+// byte of the layout's `.capacity()` lives at exactly one place in one file, and no two bytes share
+// a place. Some places in the files might not be used at all, depending on the layout.
+class Layout
+{
+    public:
+    // Which layout to use, and its settings. Given by the user with `-o`, so nonsense is possible.
+    struct options
+    {
+        // "bytes" for `ByteLayout`, or "stripe" for `StripeLayout`.
+        std::string policy;
+
+        // For "stripe": size in bytes of a block, which is confined to `covers` covers.
+        size_t block;
+
+        // For "stripe": how many covers each block is spread across, at most.
+        size_t covers;
+
+        options(): policy("bytes"), block(4096), covers(8) { }
+    };
+
+    // Returned by `.invert()` for places in a file which are not used.
+    static const size_t NONE = SIZE_MAX;
+
+    // Makes a layout.
+    //
+    // opts:       Which layout to make.
+    // capacities: Capacity of each file.
+    // seed:       Source of randomness. Same seed = same layout.
+    //
+    // Returns the layout.
+    //
+    // Throws `exc::config` if `opts` doesn't make sense.
+    // Throws `exc::config` if the files are too small to hold anything with this layout.
+    static std::unique_ptr<Layout> create(const options& opts,
+            const std::vector<size_t>& capacities, const std::string& seed);
+
+    virtual ~Layout() = default;
+
+    // Number of bytes this layout holds.
+    size_t capacity() const;
+
+    // Works out where a range of bytes lives. Calls `fn` for every run of the range which is
+    // contiguous within one file, in order, with:
+    //
+    // (offset of the run within the range, index of the file, offset within the file, length)
+    //
+    // offset: Start of the range.
+    // size:   Length of the range. `offset` + `size` must be <= `.capacity()`.
+    //
+    // Throws `exc::arg` if the range runs past `.capacity()`.
+    virtual void map(size_t offset, size_t size,
+            const std::function<void(size_t, size_t, size_t, size_t)>& fn) = 0;
+
+    // The opposite of `.map()`, for whole files at once. However many files there are, this is
+    // done in one pass over the layout, so inverting every file a batch at a time only ever needs
+    // memory for the batch in hand.
+    //
+    // files: Index of every file to invert, in any order, each only once.
+    // out:   One for every file in `files`, filled with the offset of the byte which lives at every
+    //        place in the file, or `NONE`, if nothing lives there. Each must have room for the
+    //        capacity of its file.
+    virtual void invert(const std::vector<size_t>& files, const std::vector<size_t*>& out) = 0;
+
+    // How many places in a file are used, i.e. how many bytes of the layout live in it.
+    //
+    // file: Index of the file.
+    virtual size_t places(size_t file) = 0;
+
+    // Size of the layout's blocks: the volume is made of runs of this many bytes, each of which
+    // lands somewhere random as a whole. A request which starts and ends on a block boundary splits
+    // up cleanly, without touching any block it only covers part of.
+    virtual size_t block() const = 0;
+
+    protected:
+    Layout();
+
+    // See `.capacity()`. Subclasses set this.
+    size_t _capacity;
+};
+
+#endif
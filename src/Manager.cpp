@@ -5,145 +5,1266 @@
 #include <sstream>
 #include <thread>
 #include <future>
+#include <memory>
+#include <exception>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+#include <deque>
+
+#include <cstdint>
+#include <cstdlib>
 
 #include <dirent.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/random.h>
 
 #include "StegFile.h"
+#include "WavFile.h"
 #include "Manager.h"
+#include "ThreadPool.h"
+#include "Arena.h"
 #include "fs.h"
+#include "PathTable.h"
 #include "exc.h"
+#include "util.h"
 
 using namespace std;
 
-Manager::Manager(const string& path, const string& seed):
+namespace
+{
+
+// Like `std::lock_guard`, but for a `pthread_rwlock_t`, since C++11 doesn't have a shared mutex.
+// If `engage` is false, it doesn't lock anything at all, for when it's only sometimes needed.
+class rwlock_guard
+{
+    public:
+    rwlock_guard(pthread_rwlock_t& lock, bool exclusive, bool engage = true):
+        _lock(lock),
+        _engaged(engage)
+    {
+        if (!_engaged)  return;
+        if (exclusive) pthread_rwlock_wrlock(&_lock);
+        else           pthread_rwlock_rdlock(&_lock);
+    }
+
+    rwlock_guard(const rwlock_guard& other)            = delete;
+    rwlock_guard& operator=(const rwlock_guard& other) = delete;
+
+    ~rwlock_guard() { if (_engaged) pthread_rwlock_unlock(&_lock); }
+
+    private:
+    pthread_rwlock_t& _lock;
+    bool _engaged;
+};
+
+// The path of a file within a root, for the manifest.
+string relative(const string& path, const string& root)
+{
+    size_t start = path.compare(0, root.size(), root) == 0 ? root.size() : 0;
+    while (start < path.size() && path[start] == '/') ++start;
+
+    return path.substr(start);
+}
+
+// The magic number at the start of a file of discards. See `Manager::keep_discards()`.
+const char DISCARDS_MAGIC[8] = { 'L', 'S', 'D', 'S', 'C', 'R', 'D', '1' };
+
+// Little endian, like the journal.
+void put(char* out, uint64_t value, size_t bytes)
+{
+    for (size_t i = 0; i < bytes; ++i) out[i] = (char)(value >> (i * 8));
+}
+
+uint64_t get(const char* in, size_t bytes)
+{
+    uint64_t value = 0;
+    for (size_t i = 0; i < bytes; ++i) value |= (uint64_t)(unsigned char)in[i] << (i * 8);
+    return value;
+}
+
+}
+
+vector<Manager::root> Manager::roots(const string& spec)
+{
+    auto is_dir = [](const string& path)
+    {
+        struct stat st;
+        return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+    };
+
+    vector<string> parts;
+
+    // A single directory with a colon or an '@' in its name is still just the one directory.
+    if (is_dir(spec)) parts.push_back(spec);
+
+    else for (size_t start = 0;;)
+    {
+        size_t colon = spec.find(':', start);
+        parts.push_back(spec.substr(start, colon == string::npos ? string::npos : colon - start));
+
+        if (colon == string::npos) break;
+        start = colon + 1;
+    }
+
+    vector<root> result;
+
+    for (const string& part : parts)
+    {
+        root r = { part, 1 };
+
+        // Only take what's after an '@' as a weight if there isn't a directory by the whole name.
+        auto at = part.rfind('@');
+
+        if (at != string::npos && !is_dir(part))
+        {
+            const char* weight = part.c_str() + at + 1;
+            char* end;
+
+            r.path   = part.substr(0, at);
+            r.weight = strtod(weight, &end);
+
+            if (!*weight || *end || !(r.weight > 0 && r.weight <= 1))
+            {
+                stringstream ss;
+                ss << "weight of '" << r.path << "' must be greater than 0 and at most 1, not '"
+                    << weight << "'";
+                THROW(config, ss.str());
+            }
+        }
+
+        // Make the path absolute, otherwise terrible things happen. If the path doesn't exist, just
+        // leave it how it is. The constructor can handle that.
+        if (char* path = realpath(r.path.c_str(), nullptr))
+        {
+            r.path = path;
+            free(path);
+        }
+
+        result.push_back(r);
+    }
+
+    return result;
+}
+
+Manager::Manager(const vector<root>& roots, const string& seed, const Layout::options& layout,
+        size_t jobs, size_t shard, size_t shards, const string& manifest):
     _files(),
-    _cum_cap(),
-    _shuffler(0, 0, "")
+    _locks(),
+    _layout(),
+    _device(),
+    _devices(0),
+    _jobs(jobs),
+    _discarded(),
+    _dead(),
+    _discards_changed(false),
+    _discard_mutex(),
+    _discards_path(),
+    _cache(),
+    _journal(),
+    _journal_limit(0),
+    _checkpoint(),
+    _sync_mutex(),
+    _scheduler(),
+    _readahead(0),
+    _last_read(SIZE_MAX),
+    _prefetching(false),
+    _roots(roots),
+    _root_device(),
+    _options(layout),
+    _seed(),
+    _manifest(),
+    _segments(nullptr),
+    _growing(),
+    _grow_mutex()
 {
-    _path  = path;
+    pthread_rwlock_init(&_checkpoint, nullptr);
+    pthread_rwlock_init(&_growing, nullptr);
+
+    _path  = roots.empty() ? SIZE_MAX : intern(roots[0].path);
     _bytes = nullptr; // Not used.
 
-    // Find the paths of all the regular files under `path`, and create `StegFile`s out of them.
+    if (roots.empty())     THROW(arg, "there must be at least one directory of covers");
+    if (shard >= shards)   THROW(arg, "`shard` must be < `shards`");
+
+    // Find the paths of all the regular files under every root, one root after another, and work
+    // out which device each root is on. Of those, we only get every `shards`th.
+    vector<PathTable> tables;
+    vector<size_t> first; // Index in `_files` of the first file of each root.
+    vector<size_t> skip;  // Index in each root's table of the first file which is ours.
+    vector<dev_t> devices;
+    size_t listed = 0;    // Files listed under every root so far, ours or not.
+
+    for (const root& r : roots)
     {
-        vector<string> paths = fs::list_files(path);
+        struct stat st;
 
-        if (paths.empty())
+        if (stat(r.path.c_str(), &st) != 0)
         {
             stringstream ss;
-            ss << "directory at '" << path << "' contains no regular files";
+            ss << "could not find directory at '" << r.path << "': " << strerror(errno);
             THROW(file, ss.str());
         }
 
-        _files.reserve(paths.size());
+        tables.push_back(fs::list_files(r.path));
 
-        vector<future<StegFile>> futures;
-        futures.reserve(paths.size());
+        if (!tables.back().size())
+        {
+            stringstream ss;
+            ss << "directory at '" << r.path << "' contains no regular files";
+            THROW(file, ss.str());
+        }
 
-        for (string& s : paths)
-            futures.emplace_back(async([&s]() -> StegFile { return StegFile(s); }));
+        auto device = find(devices.begin(), devices.end(), st.st_dev);
+        if (device == devices.end()) device = devices.insert(devices.end(), st.st_dev);
+        _root_device.push_back(device - devices.begin());
 
-        for (auto& f : futures)
-            _files.emplace_back(move(f.get()));
+        size_t size = tables.back().size();
+        size_t from = (shard + shards - listed % shards) % shards;
+        size_t ours = size > from ? (size - from + shards - 1) / shards : 0;
+
+        first.push_back(_files.size());
+        skip.push_back(from);
+        _files.resize(_files.size() + ours);
+        _device.resize(_files.size(), device - devices.begin());
+
+        listed += size;
+    }
+
+    if (listed < shards)
+    {
+        stringstream ss;
+        ss << "there are only " << listed << " covers, which isn't enough for " << shards
+            << " shards";
+        THROW(config, ss.str());
+    }
+
+    _devices = devices.size();
+
+    // Each shard is scattered its own way, so that they're no more alike than any two volumes.
+    _seed = shards == 1 ? seed : seed + "\nshard " + to_string(shard) + " of " + to_string(shards);
+
+    if (!manifest.empty())
+    {
+        if (shards > 1) THROW(arg, "a manifest can't be used with more than one shard");
+
+        _manifest.reset(new Manifest(manifest));
+
+        // The first time, the covers are whatever's there now, in the same order as they'd be
+        // without a manifest, so the layout is the same, and an existing volume can start using
+        // one whenever it likes.
+        if (_manifest->empty())
+        {
+            vector<Manifest::cover> covers;
+
+            for (size_t r = 0; r < tables.size(); ++r)
+                for (size_t j = 0; j < tables[r].size(); ++j)
+                    covers.push_back({ r, relative(tables[r][j], _roots[r].path) });
+
+            _manifest->append(covers);
+        }
+
+        // From then on, the covers are only ever what's in the manifest.
+        _files.clear();
+        _device.clear();
+
+        _segments = new SegmentedLayout();
+        _layout.reset(_segments);
+
+        for (size_t s = 0; s < _manifest->segments(); ++s)
+        {
+            const vector<Manifest::cover>& covers = _manifest->segment(s);
+            vector<unique_ptr<CachedFile>> files = open_covers(covers);
+            unique_ptr<Layout> segment = segment_layout(covers, files, s);
+
+            install(covers, files, move(segment));
+        }
+
+        return;
+    }
+
+    // Create `CachedFile`s out of them all. There could be millions, so rather than a thread each,
+    // every thread in the pool (and this one) takes the next few until there are none left.
+    parallel(_files.size(), [this, &tables, &first, &skip, shards](size_t i)
+    {
+        size_t r = upper_bound(first.begin(), first.end(), i) - first.begin() - 1;
+        _files[i] = open(tables[r][skip[r] + (i - first[r]) * shards]);
+    });
+
+    _locks.reset(new mutex[_files.size()]);
+
+    // Now work out where everything goes. Covers under a root with a weight below 1 only offer the
+    // layout that much of their capacity, and the rest of them goes unused.
+    vector<size_t> capacities;
+    capacities.reserve(_files.size());
+
+    for (size_t r = 0; r < roots.size(); ++r)
+    {
+        size_t end = r + 1 < roots.size() ? first[r + 1] : _files.size();
+
+        for (size_t i = first[r]; i < end; ++i)
+        {
+            size_t capacity = _files[i]->capacity();
+            capacities.push_back(roots[r].weight < 1 ? capacity * roots[r].weight : capacity);
+        }
     }
 
-    // Now work out the cumulative capacity of each file. The user doesn't need this; it's to help
-    // with `.which_file()`, see that method's body for an explanation.
-    _cum_cap.emplace_back(_files.front().capacity());
+    _layout   = Layout::create(layout, capacities, _seed);
+    _capacity = _layout->capacity();
 
-    for (auto it = _files.cbegin() + 1; it != _files.cend(); ++it)
-        _cum_cap.emplace_back(_cum_cap.back() + it->capacity());
+    _dead.resize(_files.size(), 0);
+}
 
-    _capacity = _cum_cap.back();
+Manager::~Manager()
+{
+    // A prefetch uses the files, so it has to finish before they go.
+    while (_prefetching) this_thread::yield();
 
-    // Initialise the shuffler.
-    _shuffler = Shuffler(0, _capacity, seed);
+    pthread_rwlock_destroy(&_checkpoint);
+    pthread_rwlock_destroy(&_growing);
 }
 
 size_t Manager::write(const char* buf, size_t size, off_t offset)
 {
+    if (_cache) THROW(arg, "can't write to a read-only `Manager`");
+
+    rwlock_guard grow_lock(_growing, false);
+
     if (offset < 0)                  THROW(arg, "`offset` must be positive");
     if ((size_t)offset >= _capacity) THROW(arg, "`offset` must be < `.capacity()`");
 
     size = min(size, _capacity - offset);
 
-    StegFile* file = nullptr;
+    rwlock_guard lock(_checkpoint, false);
 
-    // TODO 3 Support reading/writing in blocks. What happens if `offset` isn't a block boundary?
+    // Journal it first, so that if anything below throws, the journal might have a record of a
+    // write which didn't happen. That's harmless; the other way around isn't.
+    if (_journal) _journal->append(buf, size, offset);
 
-    for (size_t i = 0; i < size; ++i, ++offset)
+    // Anything discarded which this writes over is back in use.
     {
-        size_t file_offs = which_file(_shuffler[offset], file);
-        file->write(buf + i, 1, file_offs);
+        lock_guard<mutex> discard_lock(_discard_mutex);
+
+        if (!_discarded.empty())
+            _discarded.remove(offset, offset + size, [this](size_t start, size_t end)
+            {
+                _layout->map(start, end - start, [this](size_t, size_t file, size_t, size_t len)
+                { _dead[file] -= len; });
+
+                _discards_changed = true;
+            });
     }
 
+    fan_out(split(offset, size), [buf](CachedFile& file, const vector<extent>& extents)
+    {
+        for (const extent& e : extents)
+            file.write(buf + e.buf, e.size, e.offset);
+    });
+
     return size;
 }
 
 int Manager::read(char* buf, size_t size, off_t offset)
 {
+    // A read-only `Manager` can't grow, so its reads don't have to wait for it.
+    rwlock_guard grow_lock(_growing, false, !_cache);
+
     if (offset < 0)                  THROW(arg, "`offset` must be positive");
     if ((size_t)offset >= _capacity) THROW(arg, "`offset` must be < `.capacity()`");
 
     size = min(size, _capacity - offset);
 
-    StegFile* file = nullptr;
+    // Carrying on from the last read looks like someone reading straight through, so get the covers
+    // after this ready for them.
+    if (_readahead && _last_read.exchange(offset + size) == (size_t)offset)
+        prefetch(offset + size);
 
-    for (size_t i = 0; i < size; ++i, ++offset)
+    // Nothing can have been discarded, and nothing can change, so go straight to the cache. Each
+    // cover's extents are copied out by whichever thread gets to them first, without locking.
+    if (_cache)
     {
-        size_t file_offs = which_file(_shuffler[offset], file);
-        file->read(buf + i, 1, file_offs);
+        split_t pieces = split(offset, size);
+
+        parallel(pieces.size(), [this, buf, &pieces](size_t i)
+        {
+            for (const extent& e : pieces[i].second)
+                _cache->read(pieces[i].first, buf + e.buf, e.size, e.offset);
+        });
+
+        // Discards loaded by `.keep_discards()` can't change either, so they don't need locking.
+        _discarded.walk(offset, offset + size, [buf, offset](size_t start, size_t end, bool gone)
+        { if (gone) memset(buf + (start - offset), 0, end - start); });
+
+        return size;
     }
 
+    // Anything discarded is zeros, and only what's left needs reading from the files.
+    vector<pair<size_t, size_t>> ranges;
+
+    {
+        lock_guard<mutex> lock(_discard_mutex);
+
+        _discarded.walk(offset, offset + size, [&](size_t start, size_t end, bool discarded)
+        {
+            if (discarded) memset(buf + (start - offset), 0, end - start);
+            else           ranges.emplace_back(start, end - start);
+        });
+    }
+
+    fan_out(split(ranges, offset), [buf](CachedFile& file, const vector<extent>& extents)
+    {
+        for (const extent& e : extents)
+            file.read(buf + e.buf, e.size, e.offset);
+    });
+
     return size;
 }
 
 void Manager::sync()
 {
-    vector<future<void>> futures;
-    futures.reserve(_files.size());
+    // Nothing to sync.
+    if (_cache) return;
+
+    lock_guard<mutex> lock(_sync_mutex);
+    sync_files();
+}
+
+void Manager::sync_files()
+{
+    rwlock_guard grow_lock(_growing, false);
+
+    // Every write which has finished by now is in the caches, and so in the snapshots. Writes from
+    // here on might not be, so their records have to stay in the journal.
+    size_t mark = 0;
+
+    if (_journal)
+    {
+        rwlock_guard lock(_checkpoint, true);
+        mark = _journal->size();
+    }
+
+    // A file can only be left alone if the discards which say it's dead are on the disk first, or
+    // after a crash, it would hold whatever it held before, not zeros. In memory, it's fair game.
+    vector<bool> saved(_files.size(), true);
+    if (!_discards_path.empty()) saved = save_discards();
+
+    // Every file is synced, even if one fails, so that one bad cover doesn't stop the rest from
+    // being synced.
+    schedule(_files.size(), [](size_t i) { return i; }, SIZE_MAX, [this, &saved](size_t i)
+    {
+        CachedFile& file = *_files[i];
+
+        {
+            lock_guard<mutex> lock(_locks[i]);
+            bool dead;
+
+            {
+                lock_guard<mutex> discard_lock(_discard_mutex);
+                dead = saved[i] && _dead[i] && _dead[i] == _layout->places(i);
+            }
+
+            if (dead) file.discard();
+
+            // There's nothing to encode, so there's no need to let go of the lock.
+            if (dead || file.synced())
+            {
+                file.sync();
+                return;
+            }
+
+            file.freeze();
+        }
+
+        try { file.sync(); }
+
+        catch (...)
+        {
+            lock_guard<mutex> lock(_locks[i]);
+            file.thaw();
+            throw;
+        }
+
+        lock_guard<mutex> lock(_locks[i]);
+        file.thaw();
+    }, false, Scheduler::SYNC);
+
+    // Everything in the journal up to the mark is in the covers now, so we don't need it any more.
+    if (_journal) _journal->reset(mark);
+}
+
+void Manager::discard(off_t offset, size_t size)
+{
+    if (_cache) THROW(arg, "can't discard from a read-only `Manager`");
+
+    rwlock_guard grow_lock(_growing, false);
+
+    if (offset < 0)                  THROW(arg, "`offset` must be positive");
+    if ((size_t)offset >= _capacity) THROW(arg, "`offset` must be < `.capacity()`");
+
+    size = min(size, _capacity - offset);
+
+    rwlock_guard lock(_checkpoint, false);
+
+    // Journalled like a write, so a replay puts them back in the same order. Only worth it if
+    // they're kept, since otherwise they're forgotten at the end anyway.
+    if (_journal && !_discards_path.empty()) _journal->discard(offset, size);
+
+    lock_guard<mutex> discard_lock(_discard_mutex);
+
+    // Only count what wasn't discarded already, so nothing is counted twice.
+    _discarded.add(offset, offset + size, [this](size_t start, size_t end)
+    {
+        _layout->map(start, end - start, [this](size_t, size_t file, size_t, size_t len)
+        { _dead[file] += len; });
+
+        _discards_changed = true;
+    });
+}
+
+void Manager::keep_discards(const string& path)
+{
+    if (_journal) THROW(arg, "`.keep_discards()` must be called before `.journal()`");
+
+    rwlock_guard grow_lock(_growing, false);
+
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+    // Nothing's been discarded yet.
+    if (fd < 0 && errno == ENOENT)
+    {
+        _discards_path = path;
+        return;
+    }
+
+    fs::fd_guard guard(fd);
+    struct stat st;
+    string contents;
+    bool ok = fd >= 0 && fstat(fd, &st) == 0;
+
+    if (ok)
+    {
+        contents.resize(st.st_size);
+        ok = fs::pread_all(fd, &contents[0], contents.size(), 0);
+    }
+
+    if (!ok)
+    {
+        stringstream ss;
+        ss << "could not read discards '" << path << "': " << strerror(errno);
+        THROW(file, ss.str());
+    }
+
+    if (contents.size() < sizeof(DISCARDS_MAGIC) || (contents.size() - 8) % 16
+            || memcmp(contents.data(), DISCARDS_MAGIC, sizeof(DISCARDS_MAGIC)))
+    {
+        stringstream ss;
+        ss << "'" << path << "' is not a list of discards";
+        THROW(file, ss.str());
+    }
+
+    lock_guard<mutex> lock(_discard_mutex);
+
+    for (size_t pos = sizeof(DISCARDS_MAGIC); pos < contents.size(); pos += 16)
+    {
+        size_t start = get(contents.data() + pos, 8), end = get(contents.data() + pos + 8, 8);
+
+        if (start >= end || end > _capacity)
+        {
+            stringstream ss;
+            ss << "discards '" << path << "' has a range from " << start << " to " << end
+                << ", but the volume is only " << _capacity << " bytes";
+            THROW(file, ss.str());
+        }
+
+        _discarded.add(start, end, [this](size_t start, size_t end)
+        {
+            _layout->map(start, end - start, [this](size_t, size_t file, size_t, size_t len)
+            { _dead[file] += len; });
+        });
+    }
+
+    _discards_path = path;
+}
+
+bool Manager::keeps_discards() const { return !_discards_path.empty(); }
+
+vector<bool> Manager::save_discards()
+{
+    vector<bool> dead(_files.size());
+    string contents(DISCARDS_MAGIC, sizeof(DISCARDS_MAGIC));
+
+    {
+        lock_guard<mutex> lock(_discard_mutex);
+
+        for (size_t i = 0; i < _files.size(); ++i)
+            dead[i] = _dead[i] && _dead[i] == _layout->places(i);
+
+        if (!_discards_changed) return dead;
+
+        _discarded.walk(0, _capacity, [&contents](size_t start, size_t end, bool discarded)
+        {
+            if (!discarded) return;
+
+            char range[16];
+            put(range, start, 8);
+            put(range + 8, end, 8);
+            contents.append(range, sizeof(range));
+        });
+
+        _discards_changed = false;
+    }
+
+    try
+    {
+        fs::replacement copy(_discards_path, 0600);
+
+        if (!fs::pwrite_all(copy.fd(), contents.data(), contents.size(), 0))
+        {
+            stringstream ss;
+            ss << "could not write to discards '" << _discards_path << "': " << strerror(errno);
+            THROW(file, ss.str());
+        }
+
+        copy.commit();
+    }
+
+    // It'll have to be saved next time instead.
+    catch (...)
+    {
+        lock_guard<mutex> lock(_discard_mutex);
+        _discards_changed = true;
+        throw;
+    }
+
+    return dead;
+}
+
+void Manager::journal(const string& path, size_t limit)
+{
+    if (_cache) THROW(arg, "can't journal a read-only `Manager`");
+
+    unique_ptr<Journal> journal(new Journal(path));
+
+    // Replay it before setting `_journal`, so the replayed writes don't get journalled again.
+    // Discards only need replaying if they're kept, (and only get journalled if they are).
+    function<void(off_t, size_t)> discards;
+
+    if (!_discards_path.empty())
+        discards = [this](off_t offset, size_t size) { discard(offset, size); };
+
+    auto writes = [this](const char* buf, size_t size, off_t offset) { write(buf, size, offset); };
+    journal->replay(writes, discards);
+
+    _journal       = move(journal);
+    _journal_limit = limit;
+}
+
+bool Manager::journalled() const { return (bool)_journal; }
+
+void Manager::read_only(size_t limit)
+{
+    if (_cache)    return;
+    if (_journal)  THROW(config, "a journalled volume can't be read-only");
+    if (!synced()) THROW(config, "a volume with unsynced writes can't be read-only");
+
+    // Nothing can grow once this is read-only, but it might be growing right now.
+    lock_guard<mutex> grow_lock(_grow_mutex);
+
+    // Anything already loaded is only taking up memory now. The cache loads covers its own way.
+    for (size_t i = 0; i < _files.size(); ++i)
+    {
+        lock_guard<mutex> lock(_locks[i]);
+        _files[i]->drop();
+    }
+
+    _cache.reset(new ReadCache(_files, _locks.get(), limit));
+}
+
+bool Manager::read_only() const { return (bool)_cache; }
+
+size_t Manager::block() const { return _layout->block(); }
+
+size_t Manager::covers() const { return _files.size(); }
+
+size_t Manager::grow()
+{
+    if (!_manifest) THROW(config, "only a volume with a manifest can grow");
+
+    lock_guard<mutex> grow_lock(_grow_mutex);
+
+    if (_cache) THROW(arg, "can't grow a read-only `Manager`");
+
+    // Every cover which is already in, by root.
+    vector<unordered_set<string>> known(_roots.size());
+
+    for (size_t s = 0; s < _manifest->segments(); ++s)
+        for (const Manifest::cover& c : _manifest->segment(s))
+            known[c.root].insert(c.path);
 
-    for (StegFile& f : _files)
-        futures.emplace_back(async(&StegFile::sync, &f));
+    vector<Manifest::cover> covers;
 
-    for (auto& f : futures)
-        f.wait();
+    for (size_t r = 0; r < _roots.size(); ++r)
+    {
+        PathTable table = fs::list_files(_roots[r].path);
+
+        for (size_t j = 0; j < table.size(); ++j)
+        {
+            string path = relative(table[j], _roots[r].path);
+            if (!known[r].count(path)) covers.push_back({ r, path });
+        }
+    }
+
+    if (covers.empty()) return 0;
+
+    // All the slow parts happen while requests carry on as normal.
+    vector<unique_ptr<CachedFile>> files = open_covers(covers);
+    unique_ptr<Layout> segment = segment_layout(covers, files, _manifest->segments());
+    size_t added = segment->capacity();
+
+    // Once it's in the manifest, it's part of the volume, even if we crash before it's added.
+    _manifest->append(covers);
+
+    rwlock_guard lock(_growing, true);
+    install(covers, files, move(segment));
+
+    return added;
+}
+
+vector<unique_ptr<CachedFile>> Manager::open_covers(const vector<Manifest::cover>& covers)
+{
+    for (const Manifest::cover& c : covers)
+    {
+        if (c.root < _roots.size()) continue;
+
+        stringstream ss;
+        ss << "manifest lists a cover under root " << c.root << ", but only " << _roots.size()
+            << " were given";
+        THROW(config, ss.str());
+    }
+
+    vector<unique_ptr<CachedFile>> files(covers.size());
+
+    parallel(covers.size(), [this, &covers, &files](size_t i)
+    {
+        files[i] = open(_roots[covers[i].root].path + "/" + covers[i].path);
+    });
+
+    return files;
+}
+
+unique_ptr<Layout> Manager::segment_layout(const vector<Manifest::cover>& covers,
+        const vector<unique_ptr<CachedFile>>& files, size_t index)
+{
+    vector<size_t> capacities;
+    capacities.reserve(files.size());
+
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        size_t capacity = files[i]->capacity();
+        double weight   = _roots[covers[i].root].weight;
+
+        capacities.push_back(weight < 1 ? capacity * weight : capacity);
+    }
+
+    return Layout::create(_options, capacities,
+                          index ? _seed + "\nsegment " + to_string(index) : _seed);
+}
+
+void Manager::install(const vector<Manifest::cover>& covers, vector<unique_ptr<CachedFile>>& files,
+        unique_ptr<Layout> segment)
+{
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        _files.push_back(move(files[i]));
+        _device.push_back(_root_device[covers[i].root]);
+    }
+
+    // Nothing holds any of the locks while `_growing` is held for writing, so they can all be
+    // swapped for new ones.
+    _locks.reset(new mutex[_files.size()]);
+    _dead.resize(_files.size(), 0);
+
+    _segments->add(move(segment), files.size());
+    _capacity = _segments->capacity();
+}
+
+void Manager::limit(Scheduler::work_class c, size_t jobs, size_t rate)
+{
+    _scheduler.limit(c, jobs, rate);
+}
+
+void Manager::readahead(size_t bytes) { _readahead = bytes; }
+
+void Manager::commit()
+{
+    if (!_journal) return;
+
+    _journal->commit();
+
+    if (_journal->size() <= _journal_limit) return;
+
+    // The journal's got too big. Get everything in it into the covers, then start again. Writes
+    // carry on meanwhile, see `_checkpoint`. If someone else is already at it, leave it to them.
+    unique_lock<mutex> lock(_sync_mutex, try_to_lock);
+
+    // They might have finished just before we got the lock.
+    if (lock && _journal->size() > _journal_limit) sync_files();
+}
+
+void Manager::pack(const char* image, size_t size, size_t memory, Checkpoint* checkpoint)
+{
+    rwlock_guard grow_lock(_growing, false);
+
+    if (size > _capacity) THROW(arg, "`size` must be <= `.capacity()`");
+    if (_cache)           THROW(arg, "can't pack a read-only `Manager`");
+
+    // Everything's about to be overwritten, so nothing is discarded any more. That has to be on the
+    // disk before any of it is, or kept discards would hide what's written.
+    {
+        lock_guard<mutex> lock(_discard_mutex);
+        _discarded.clear();
+        fill(_dead.begin(), _dead.end(), 0);
+        _discards_changed = true;
+    }
+
+    if (!_discards_path.empty()) save_discards();
+
+    vector<size_t> files;
+
+    for (size_t i = 0; i < _files.size(); ++i)
+        if (!checkpoint || !checkpoint->packed(i)) files.push_back(i);
+
+    for_each_inverted(files, memory, [this, image, size, checkpoint](size_t i, const size_t* source)
+    {
+        overwrite(i, [this, i, image, size, source](char* buf)
+        {
+            // Anything the layout doesn't use is `Layout::NONE`, which is certainly >= `size`, so
+            // it stays zero.
+            for (size_t j = 0; j < _files[i]->capacity(); ++j)
+                buf[j] = source[j] < size ? image[source[j]] : 0;
+        });
+
+        // `.overwrite()` has `fsync()`ed the cover by now, (see `CachedFile::sync()`), so if we
+        // crash after this, it really is packed, and it's safe to skip it next time.
+        if (checkpoint) checkpoint->mark_packed(i);
+    });
+
+    if (_journal) _journal->reset();
+}
+
+void Manager::format(bool random, const string& header, size_t memory)
+{
+    rwlock_guard grow_lock(_growing, false);
+
+    if (header.size() > _capacity) THROW(arg, "`header` must fit within `.capacity()`");
+    if (_cache)                    THROW(arg, "can't format a read-only `Manager`");
+
+    // Everything's about to be overwritten, so nothing is discarded any more. That has to be on the
+    // disk before any of it is, or kept discards would hide what's written.
+    {
+        lock_guard<mutex> lock(_discard_mutex);
+        _discarded.clear();
+        fill(_dead.begin(), _dead.end(), 0);
+        _discards_changed = true;
+    }
+
+    if (!_discards_path.empty()) save_discards();
+
+    // Which bits of the header land in each file, if any.
+    split_t pieces = split(0, header.size());
+    vector<const vector<extent>*> headers(_files.size(), nullptr);
+
+    for (const auto& piece : pieces)
+        headers[piece.first] = &piece.second;
+
+    for_each_file(memory, [this, random, &header, &headers](size_t i)
+    {
+        overwrite(i, [this, i, random, &header, &headers](char* buf)
+        {
+            // `buf` starts off as zeros, so that's zero filling done already.
+            for (size_t done = 0; random && done < _files[i]->capacity();)
+            {
+                ssize_t result = getrandom(buf + done, _files[i]->capacity() - done, 0);
+
+                if (result < 0 && errno == EINTR) continue;
+
+                if (result < 0)
+                {
+                    stringstream ss;
+                    ss << "could not get random bytes: " << strerror(errno);
+                    THROW(file, ss.str());
+                }
+
+                done += result;
+            }
+
+            if (headers[i])
+                for (const extent& e : *headers[i])
+                    memcpy(buf + e.offset, header.data() + e.buf, e.size);
+        });
+    });
+
+    if (_journal) _journal->reset();
+}
+
+void Manager::unpack(char* image, size_t memory)
+{
+    rwlock_guard grow_lock(_growing, false);
+
+    vector<size_t> files;
+
+    for (size_t i = 0; i < _files.size(); ++i)
+        if (_files[i]->capacity()) files.push_back(i);
+
+    for_each_inverted(files, memory, [this, image](size_t i, const size_t* dest)
+    {
+        CachedFile& file = *_files[i];
+        char* buf = Arena::get().allocate(file.capacity());
+
+        try { file.read(buf, file.capacity(), 0); }
+
+        catch (...)
+        {
+            Arena::get().release(buf, file.capacity());
+            throw;
+        }
+
+        for (size_t j = 0; j < file.capacity(); ++j)
+            if (dest[j] != Layout::NONE) image[dest[j]] = buf[j];
+
+        Arena::get().release(buf, file.capacity());
+        file.drop();
+    });
+
+    // Whatever the covers still hold there was discarded, so it's meant to be zeros.
+    lock_guard<mutex> lock(_discard_mutex);
+
+    _discarded.walk(0, _capacity, [image](size_t start, size_t end, bool discarded)
+    { if (discarded) memset(image + start, 0, end - start); });
 }
 
 bool Manager::synced()
 {
-    for (StegFile& f : _files)
-        if (!f.synced())
-            return false;
+    rwlock_guard grow_lock(_growing, false);
+
+    for (size_t i = 0; i < _files.size(); ++i)
+    {
+        lock_guard<mutex> lock(_locks[i]);
+        if (!_files[i]->synced()) return false;
+    }
 
     return true;
 }
 
-size_t Manager::which_file(size_t byte, StegFile*& out_file)
+vector<string> Manager::quarantined()
+{
+    rwlock_guard grow_lock(_growing, false);
+
+    vector<string> paths;
+
+    for (size_t i = 0; i < _files.size(); ++i)
+        if (_files[i]->quarantined()) paths.push_back(_files[i]->path());
+
+    return paths;
+}
+
+Manager::split_t Manager::split(off_t offset, size_t size)
+{
+    return split(vector<pair<size_t, size_t>>(1, make_pair((size_t)offset, size)), offset);
+}
+
+Manager::split_t Manager::split(const vector<pair<size_t, size_t>>& ranges, size_t base)
+{
+    split_t pieces;
+
+    // Where each file's entry in `pieces` is, by its index in `_files`.
+    unordered_map<size_t, size_t> where;
+
+    for (const auto& range : ranges)
+    {
+        // Where this range starts in the request's buffer.
+        size_t skip = range.first - base;
+
+        _layout->map(range.first, range.second,
+                [&](size_t at, size_t index, size_t file_offs, size_t len)
+        {
+            at += skip;
+
+            auto it = where.find(index);
+
+            if (it == where.end())
+            {
+                it = where.emplace(index, pieces.size()).first;
+                pieces.emplace_back(index, vector<extent>());
+            }
+
+            vector<extent>& extents = pieces[it->second].second;
+
+            // Carry on the last extent if this run follows on from it, otherwise start a new one.
+            if (!extents.empty() && extents.back().buf + extents.back().size == at
+                    && extents.back().offset + extents.back().size == file_offs)
+                extents.back().size += len;
+            else
+                extents.push_back({ at, file_offs, len });
+        });
+    }
+
+    return pieces;
+}
+
+void Manager::fan_out(const split_t& pieces,
+        const function<void(CachedFile&, const vector<extent>&)>& fn)
+{
+    schedule(pieces.size(), [&pieces](size_t i) { return pieces[i].first; }, SIZE_MAX,
+            [this, &pieces, &fn](size_t i) { fn(*_files[pieces[i].first], pieces[i].second); });
+}
+
+void Manager::parallel(size_t count, const function<void(size_t)>& fn,
+        Scheduler::work_class priority)
+{
+    ThreadPool::get().parallel(count, fn, priority);
+}
+
+void Manager::prefetch(size_t offset)
+{
+    if (offset >= _capacity) return;
+
+    // Only one at a time. If one's already going, it's probably for much the same covers.
+    bool idle = false;
+    if (!_prefetching.compare_exchange_strong(idle, true)) return;
+
+    size_t size = min(_readahead, _capacity - offset);
+
+    auto task = [this, offset, size]()
+    {
+        rwlock_guard grow_lock(_growing, false, !_cache);
+
+        // One cover at a time, since it's in no hurry, and so that it only ever holds up a request
+        // for as long as it takes to load one cover.
+        for (const auto& piece : split(offset, size))
+        {
+            size_t i = piece.first;
+
+            try
+            {
+                _scheduler.expect(Scheduler::PREFETCH, 1);
+                Scheduler::job admit(_scheduler, Scheduler::PREFETCH, _files[i]->capacity());
+
+                if (_cache) _cache->fetch(i);
+
+                else
+                {
+                    lock_guard<mutex> lock(_locks[i]);
+                    _files[i]->fetch();
+                }
+            }
+
+            // If it can't be loaded, the read that wants it will find out for itself.
+            catch (...) { }
+        }
+
+        _prefetching = false;
+    };
+
+    try { ThreadPool::get().submit(task, Scheduler::PREFETCH); }
+
+    catch (...)
+    {
+        _prefetching = false;
+        throw;
+    }
+}
+
+void Manager::overwrite(size_t i, const function<void(char*)>& generate)
+{
+    CachedFile& file = *_files[i];
+    if (!file.capacity()) return;
+
+    char* buf = Arena::get().allocate(file.capacity());
+
+    try
+    {
+        generate(buf);
+        file.assign(buf);
+        file.sync();
+        file.drop();
+    }
+
+    catch (...)
+    {
+        Arena::get().release(buf, file.capacity());
+        throw;
+    }
+
+    Arena::get().release(buf, file.capacity());
+}
+
+unique_ptr<CachedFile> Manager::open(const string& path)
+{
+    auto dot = path.rfind(".");
+    string extension = dot == string::npos ? "" : util::upper(path.substr(dot + 1));
+
+    if (extension == "WAV") return unique_ptr<CachedFile>(new WavFile(path));
+    return unique_ptr<CachedFile>(new StegFile(path));
+}
+
+void Manager::for_each_file(size_t memory, const function<void(size_t)>& fn)
+{
+    schedule(_files.size(), [](size_t i) { return i; }, memory, fn);
+}
+
+void Manager::for_each_inverted(const vector<size_t>& files, size_t memory,
+        const function<void(size_t, const size_t*)>& fn)
 {
-    // Find the first entry in `_cum_cap` (which contains the cumulative capacity of all the files
-    // in `_files`) which is greater than `byte`.
-    for (size_t i = 0; i < _cum_cap.size(); ++i)
+    for (size_t next = 0; next < files.size();)
     {
-        // We found it! That means that `byte` lies within `_files[i]`.
-        if (_cum_cap[i] > byte)
+        // As many files as fit, (but always at least one), so they can all be in flight at once.
+        vector<size_t> batch;
+        size_t used = 0;
+
+        for (; next < files.size(); ++next)
         {
-            // The offset within this file is just `byte` - (the cumulative capacity of the file
-            // before this one). If there was no file before this one, the offset is just `byte`.
-            out_file = &_files[i];
-            return byte - (i ? _cum_cap[i - 1] : 0);
+            size_t need = _files[files[next]]->capacity() * (FOOTPRINT + sizeof(size_t));
+            if (!batch.empty() && need > memory - min(memory, used)) break;
+
+            batch.push_back(files[next]);
+            used += need;
         }
+
+        vector<vector<size_t>> maps(batch.size());
+        vector<size_t*> out;
+        size_t mapped = 0;
+
+        for (size_t k = 0; k < batch.size(); ++k)
+        {
+            maps[k].assign(_files[batch[k]]->capacity(), Layout::NONE);
+            out.push_back(maps[k].data());
+            mapped += maps[k].size() * sizeof(size_t);
+        }
+
+        _layout->invert(batch, out);
+
+        schedule(batch.size(), [&batch](size_t k) { return batch[k]; },
+                 memory - min(memory, mapped), [&batch, &maps, &fn](size_t k)
+        { fn(batch[k], maps[k].data()); });
+    }
+}
+
+void Manager::schedule(size_t count, const function<size_t(size_t)>& file, size_t memory,
+        const function<void(size_t)>& fn, bool lock_files, Scheduler::work_class c)
+{
+    _scheduler.expect(c, count);
+
+    // With one device, and nothing to hold back, any order will do, and `.parallel()` is cheaper.
+    if (_devices == 1 && !_jobs && memory == SIZE_MAX)
+    {
+        parallel(count, [this, &file, &fn, lock_files, c](size_t i)
+        {
+            Scheduler::job admit(_scheduler, c, _files[file(i)]->capacity());
+
+            unique_lock<mutex> file_lock(_locks[file(i)], defer_lock);
+            if (lock_files) file_lock.lock();
+            fn(i);
+        }, c);
+
+        return;
     }
 
-    // If we get here, then no entry within `_cum_cap` was greater than `byte`. Therefore, `byte`
-    // was greater than `_capacity`, (i.e., it's out of bounds), which is a bug. Tell myself off
-    // with a stern exception message.
-    out_file = nullptr;
+    // The jobs waiting for each device, in order, and how many are running on each.
+    vector<deque<size_t>> queues(_devices);
+    vector<size_t> active(_devices, 0);
+
+    for (size_t i = 0; i < count; ++i)
+        queues[_device[file(i)]].push_back(i);
+
+    // Memory used by the files in flight, how many there are, and which device goes next.
+    size_t used = 0, running = 0, turn = 0;
+    exception_ptr error;
+    mutex m;
+    condition_variable cv;
+
+    auto need = [this, &file, memory](size_t i)
+    { return memory == SIZE_MAX ? 0 : _files[file(i)]->capacity() * FOOTPRINT; };
+
+    auto work = [&]()
+    {
+        unique_lock<mutex> lock(m);
+
+        for (;;)
+        {
+            // Find the next device, from whoever's turn it is, which has a job waiting that it has
+            // room for.
+            size_t device = _devices;
+            bool waiting  = false;
+
+            for (size_t k = 0; k < _devices && device == _devices; ++k)
+            {
+                size_t d = (turn + k) % _devices;
+                if (queues[d].empty()) continue;
+
+                waiting = true;
+
+                if ((!_jobs || active[d] < _jobs)
+                        && (!running || used + need(queues[d].front()) <= memory))
+                    device = d;
+            }
+
+            // Nothing left to do at all.
+            if (!waiting) return;
+
+            // There's work, but no room for it until something that's running finishes.
+            if (device == _devices)
+            {
+                cv.wait(lock);
+                continue;
+            }
+
+            size_t i = queues[device].front();
+            size_t n = need(i);
+            queues[device].pop_front();
+
+            turn = (device + 1) % _devices;
+            ++active[device];
+            ++running;
+            used += n;
+
+            lock.unlock();
+
+            try
+            {
+                Scheduler::job admit(_scheduler, c, _files[file(i)]->capacity());
+
+                unique_lock<mutex> file_lock(_locks[file(i)], defer_lock);
+                if (lock_files) file_lock.lock();
+                fn(i);
+            }
+
+            catch (...)
+            {
+                lock_guard<mutex> error_lock(m);
+                if (!error) error = current_exception();
+            }
+
+            lock.lock();
+
+            --active[device];
+            --running;
+            used -= n;
+
+            cv.notify_all();
+        }
+    };
+
+    ThreadPool::get().crew(count ? count - 1 : 0, work, c);
 
-    stringstream ss;
-    ss << "`byte` (" << byte << ") must be < `.capacity()` (" << _capacity << ")";
-    THROW(arg, ss.str());
+    if (error) rethrow_exception(error);
 }
@@ -3,79 +3,584 @@
 
 #include <vector>
 #include <string>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <utility>
+#include <functional>
 
-#include "Shuffler.h"
-#include "StegFile.h"
+#include <pthread.h>
+
+#include "Journal.h"
+#include "Checkpoint.h"
+#include "IntervalSet.h"
+#include "ReadCache.h"
+#include "Scheduler.h"
+#include "Layout.h"
+#include "SegmentedLayout.h"
+#include "Manifest.h"
+#include "CachedFile.h"
 #include "exc.h"
 
 // This class is a specialisation of `CachedFile`. It's intended to act as a 'manager' for
 // loop-steg, which behaves like a `CachedFile` in that it buffers file contents to memory and
-// flushes them with `.sync()`, but actually has multiple `StegFile`s behind the scenes, and
+// flushes them with `.sync()`, but actually has multiple `CachedFile`s behind the scenes, (a
+// `StegFile` for every image, and a `WavFile` for every WAV file), and
 // provides an interface as if they are one big file. It also handles the complicated business of
 // reading/writing randomly across all the files, So You Don't Have To™.
 class Manager : public CachedFile
 {
     public:
-    // `Manager` constructor. Constructs from a directory full of regular files.
+    // A directory of covers, and how much of their capacity to use.
+    struct root
+    {
+        // The directory. This is searched recursively, and anything other than regular files is
+        // ignored.
+        std::string path;
+
+        // How much of the capacity of every cover under `path` the layout uses, from just above 0
+        // to 1. Bytes are spread over covers in proportion to how much they can hold, so to have
+        // a slow disk do less of the work, give it less than 1, and faster disks get more of the
+        // data.
+        //
+        // NOTE: The rest of each cover's capacity is simply wasted: the volume is that much
+        //       smaller, and the unused bits are still rewritten, (with whatever was there), every
+        //       time the cover is synced. A weight only buys less work by giving up room.
+        double weight;
+    };
+
+    // Parses the roots the user gave us. That's normally just a directory, but can be several,
+    // separated by colons, each optionally followed by '@' and its weight, e.g.
+    // '/mnt/ssd/covers:/mnt/hdd/covers@0.25'. Every path is made absolute, if it exists.
+    //
+    // spec: The roots. If this is the path of a directory which exists, colons and all, that's the
+    //       only root, with a weight of 1.
     //
-    // path: The path to a directory full of regular files to construct `StegFile`s out of. This
-    //       directory is searched recursively. Anything other than regular files are ignored.
-    // seed: String used as source of randomness when randomly scattering reads/writes. Same seed =
-    //       same read/write locations.
+    // Returns the roots, in the order they were given.
     //
-    // Throws `exc::file` if the directory at `path` contains no regular files.
+    // Throws `exc::config` if a weight isn't a number greater than 0 and at most 1.
+    static std::vector<root> roots(const std::string& spec);
+
+    // `Manager` constructor. Constructs from directories full of regular files.
+    //
+    // roots:  The directories of covers, from `.roots()`. The covers of each are listed in order,
+    //         one directory after another, so the order of the roots must be the same every time.
+    //         Directories on the same device, (going by `st_dev`), share an I/O queue, see `jobs`.
+    // seed:   String used as source of randomness when randomly scattering reads/writes. Same seed =
+    //         same read/write locations.
+    // layout: How reads/writes are scattered. See <Layout.h>. This must be the same every time for
+    //         the same covers, or you'll get garbage back.
+    // jobs:   How many covers on each device can be loaded or synced at once. 0, the default, means
+    //         as many as there are threads. Either way, the devices take turns, so they're all kept
+    //         busy at once, rather than one after another.
+    // shard:  Which shard of the covers this `Manager` has, from 0 to `shards`.
+    // shards: How many `Manager`s the covers are shared between. Each gets every `shards`th cover,
+    //         starting from the `shard`th, in the order they're listed, and a seed of its own,
+    //         derived from `seed`, so each is a separate volume. The default of 1 means all of the
+    //         covers, and `seed` as it is.
+    // manifest: Path to a manifest, or empty for none. With one, the covers are the ones it lists,
+    //           in segments, rather than whatever's in the directories, so that the volume can
+    //           `.grow()`. If it doesn't exist yet, it's made from whatever's in the directories,
+    //           and the layout is the same as without one. See <Manifest.h>.
+    //
+    // Throws `exc::file` if any of the directories contains no regular files, or can't be found.
+    // Throws `exc::config` if there are fewer covers than `shards`.
+    // Throws `exc::config` if the manifest lists a root which wasn't given.
+    // Throws `exc::arg` if `shard` isn't less than `shards`.
+    // Throws `exc::arg` if there's a manifest and `shards` > 1.
     // Throws anything `fs::list_files()` throws.
-    // Throws anything `StegFile::StegFile(const string&)` throws.
-    Manager(const std::string& path, const std::string& seed);
+    // Throws anything `Manifest::Manifest()` throws.
+    // Throws anything `.open()` throws.
+    // Throws anything `Layout::create()` throws.
+    Manager(const std::vector<root>& roots, const std::string& seed,
+            const Layout::options& layout = Layout::options(), size_t jobs = 0, size_t shard = 0,
+            size_t shards = 1, const std::string& manifest = "");
 
-    // See `CachedFile::write()`.
-    // Throws anything `.which_file()` throws.
+    Manager(const Manager& other)            = delete;
+    Manager& operator=(const Manager& other) = delete;
+
+    ~Manager();
+
+    // See `CachedFile::write()`. The bytes of a request land all over the place, so it's split up
+    // by file, and the files are written to in parallel. (Including loading them, if they aren't
+    // already.) This returns when every file is done.
+    //
+    // Throws `exc::arg` if `offset` is out of range, or this is `.read_only()`.
+    // Throws anything `CachedFile::write()` throws, after the rest of the files are done.
     size_t write(const char* buf, size_t size, off_t offset);
 
-    // See `CachedFile::read()`.
-    // Throws anything `.which_file()` throws.
+    // See `CachedFile::read()`. Split up and done in parallel like `.write()`. Anything which has
+    // been `.discard()`ed reads as zeros, without going anywhere near the files. Once this is
+    // `.read_only()`, reads don't lock anything, unless a cover needs loading.
+    //
+    // Throws `exc::arg` if `offset` is out of range.
+    // Throws anything `CachedFile::read()` throws, after the rest of the files are done.
     int read(char* buf, size_t size, off_t offset);
 
-    // See `StegFile::sync()`. Calls `.sync()` on every `StegFile` managed by this `Manager`.
+    // See `CachedFile::sync()`. Calls `.sync()` on every file managed by this `Manager`, except
+    // for files where every byte has been `.discard()`ed since it was last synced: they don't hold
+    // anything worth keeping, so any writes to them are thrown away instead, and they're left
+    // alone. Every file that's written is `fsync()`ed, so once this returns, every write which
+    // finished before it was called is on the disk. If there is a journal, and every file synced
+    // successfully, the journal is then reset, since everything in it has made it into the
+    // covers. Does nothing if this is `.read_only()`.
+    //
+    // Reads and writes carry on while this runs. Each file is `CachedFile::freeze()`ed, and synced
+    // from the snapshot, so a file is only locked for long enough to take it and put it back, not
+    // while it's encoded. Anything written to a file after its snapshot stays unsynced, for next
+    // time, and stays in the journal too. Only one sync runs at a time.
+    //
+    // Throws `exc::file` if `.keep_discards()` has been called, and they could not be saved.
+    // Throws the first exception thrown by any `CachedFile::sync()`, after waiting for the rest.
+    // Throws anything `Journal::reset()` throws.
     void sync();
 
+    // Marks a range of bytes as not being used any more, like TRIM on a disk. Until they're written
+    // to again, they read as zeros, and files which end up holding nothing but discarded bytes are
+    // left alone by `.sync()`. Unless `.keep_discards()` has been called, this is only remembered
+    // in memory: once this `Manager` is gone, whatever was last synced to the files is what you'll
+    // get back. That's all TRIM promises, (which is to say, nothing), so it's fine for a file
+    // system to discard unused blocks with, but not for zeroing anything.
+    //
+    // offset: Start of the range.
+    // size:   Length of the range. Anything past `.capacity()` is ignored.
+    //
+    // Throws `exc::arg` if `offset` is out of range, or this is `.read_only()`.
+    // Throws anything `Journal::discard()` throws, if `.keep_discards()` has been called.
+    void discard(off_t offset, size_t size);
+
+    // Makes `.discard()`s last, so discarded ranges read as zeros for good, until they're written
+    // to again. Every discarded range is kept in the file at `path`, which is loaded now, (if it
+    // exists), and saved by `.sync()` before any cover, so a cover it leaves alone is never
+    // mistaken for one holding something. With a journal, discards are journalled alongside the
+    // writes, so they're durable at `.commit()` like writes are. `.pack()` and `.format()` save it
+    // empty, so give them the same file, or delete it when the volume is refilled without it.
+    //
+    // The file looks like:
+    //
+    // "LSDSCRD1"                     8 byte magic number
+    // [start: 8 bytes][end: 8 bytes] Every discarded range, in order, little endian.
+    //
+    // path: Path to the file. Like a journal's, this must not be inside the directory of covers.
+    //
+    // Throws `exc::arg` if `.journal()` has been called already, since replaying it needs these.
+    // Throws `exc::file` if the file at `path` exists, but could not be read, isn't a list of
+    // discards, or has ranges past `.capacity()`.
+    void keep_discards(const std::string& path);
+
+    // Whether `.keep_discards()` has been called.
+    bool keeps_discards() const;
+
+    // Starts journalling writes. Anything already in the journal at `path` (i.e. we crashed last
+    // time) is replayed into the cache first, so it will make it into the covers at the next
+    // `.sync()`. See <Journal.h>.
+    //
+    // path:  Path to the journal file. This must not be inside the directory of covers.
+    // limit: Once the journal grows past this many bytes, `.commit()` does a full `.sync()` and
+    //        resets it, so it can't grow forever.
+    //
+    // Throws `exc::arg` if this is `.read_only()`.
+    // Throws anything `.discard()` throws, for discards in the journal.
+    // Throws anything `Journal::Journal(const string&)` throws.
+    // Throws anything `Journal::replay()` throws.
+    void journal(const std::string& path, size_t limit);
+
+    // Whether `.journal()` has been called.
+    bool journalled() const;
+
+    // Makes every `.write()` so far durable. With a journal this is cheap, since it only has to
+    // sync the journal, not the covers. Without a journal, this does nothing, and writes only
+    // become durable at the next `.sync()`.
+    //
+    // Throws anything `Journal::commit()` throws.
+    // Throws anything `.sync()` throws, if the journal was big enough to trigger a full sync.
+    void commit();
+
+    // Fills the entire volume from `image`, without going through `.write()`. Each file is filled
+    // in one go, synced and dropped from memory, many files at once, so every cover is encoded
+    // exactly once, and only a bounded number of them are in memory at a time. This is much faster
+    // than `.write()`ing a whole image, where every request touches every cover. Any journal is
+    // reset afterwards, since everything in it has been overwritten.
+    //
+    // image:      The contents to fill the volume with.
+    // size:       Number of bytes in `image`. If this is less than `.capacity()`, the rest is
+    //             zeros.
+    // memory:     Roughly how many bytes the files in flight are allowed to use between them,
+    //             along with where their bytes come from. See `.for_each_inverted()`.
+    // checkpoint: If not null, files it says are packed already are skipped, and every other file
+    //             is marked packed in it once it's synced, so an interrupted pack can carry on.
+    //
+    // Throws `exc::arg` if `size` > `.capacity()`, or this is `.read_only()`.
+    // Throws `exc::file` if `.keep_discards()` has been called, and they could not be saved.
+    // Throws anything `CachedFile::sync()` throws, after the rest of the files are done.
+    // Throws anything `Checkpoint::mark_packed()` throws, after the rest of the files are done.
+    // Throws anything `Journal::reset()` throws.
+    void pack(const char* image, size_t size, size_t memory, Checkpoint* checkpoint = nullptr);
+
+    // Initialises the entire volume, like `.pack()`, but with random bytes or zeros, so there's no
+    // need to go through `.write()`. This makes a fresh volume look like it's full of ciphertext
+    // (if `random`), and gets every cover encoded once up front.
+    //
+    // random: If true, fill the volume with random bytes from `getrandom()`. Otherwise, zeros.
+    // header: Written at the very start of the volume, over the top of the random bytes or zeros.
+    //         This could be a LUKS header, for example.
+    // memory: Roughly how many bytes the files in flight are allowed to use between them.
+    //
+    // Throws `exc::arg` if `header` is bigger than `.capacity()`, or this is `.read_only()`.
+    // Throws `exc::file` if `getrandom()` failed.
+    // Throws `exc::file` if `.keep_discards()` has been called, and they could not be saved.
+    // Throws anything `CachedFile::sync()` throws, after the rest of the files are done.
+    // Throws anything `Journal::reset()` throws.
+    void format(bool random, const std::string& header, size_t memory);
+
+    // The opposite of `.pack()`: copies the entire volume out to `image`, reading every cover
+    // exactly once, with a bounded number of them in memory at a time. Anything discarded is
+    // zeros, like `.read()`.
+    //
+    // image:  Buffer to copy the volume into, of `.capacity()` bytes.
+    // memory: Roughly how many bytes the files in flight are allowed to use between them, along
+    //         with where their bytes go. See `.for_each_inverted()`.
+    //
+    // Throws anything `CachedFile::read()` throws, after the rest of the files are done.
+    void unpack(char* image, size_t memory);
+
+    // Makes this `Manager` read-only, for good. From then on, reads go through a `ReadCache`, which
+    // doesn't lock anything, and can throw covers away once they use too much memory, since
+    // there's never anything to sync. Anything that would change the volume throws instead.
+    //
+    // limit: Roughly how many bytes of covers to keep in memory at once. 0 means no limit.
+    //
+    // Throws `exc::config` if there's a journal, or anything hasn't been synced yet.
+    void read_only(size_t limit);
+
+    // Whether `.read_only()` has been called.
+    bool read_only() const;
+
+    // See `Layout::block()`. Requests which are a multiple of this, and aligned to it, are split
+    // across the fewest covers.
+    size_t block() const;
+
+    // How many covers this `Manager` has.
+    size_t covers() const;
+
+    // Adds any covers in the directories which aren't in the manifest yet, as a new segment on the
+    // end of the volume, so `.capacity()` grows, and everything already in the volume stays where
+    // it is. Only the new covers are opened, and only their bytes are laid out, so this costs no
+    // more than the new covers, however many there are already. (Except that every directory is
+    // listed again, which only reads the names of the files.) Requests carry on while the new
+    // covers are opened, and only wait for them to be added at the end.
+    //
+    // What's in the new part of the volume to begin with is whatever was in the new covers, i.e.
+    // junk.
+    //
+    // Returns how many bytes the volume grew by, which is 0 if there weren't any new covers.
+    //
+    // Throws `exc::config` if there's no manifest.
+    // Throws `exc::arg` if this is `.read_only()`.
+    // Throws anything `fs::list_files()` throws.
+    // Throws anything `.open()` throws.
+    // Throws anything `Layout::create()` throws, for example if the new covers are too small to
+    // hold anything.
+    // Throws anything `Manifest::append()` throws.
+    // If anything throws, nothing has changed.
+    size_t grow();
+
+    // See `Scheduler::limit()`. Every job which loads or syncs a cover goes through one scheduler,
+    // which is how `.sync()` and `.readahead()` stay out of the way of `.read()` and `.write()`.
+    void limit(Scheduler::work_class c, size_t jobs, size_t rate);
+
+    // Turns on readahead: whenever a `.read()` starts where the last one ended, the covers behind
+    // the next `bytes` bytes start loading in the background, so they're ready when the reads get
+    // there. Off to begin with.
+    //
+    // bytes: How far to read ahead, or 0 to turn it off.
+    void readahead(size_t bytes);
+
     // See `CachedFile::synced()`.
     //
-    // Returns true if `.synced()` returned true for every `StegFile` managed by this `Manager`,
+    // Returns true if `.synced()` returned true for every file managed by this `Manager`,
     //         false otherwise.
     bool synced();
 
+    // Paths of the covers which have been quarantined, because they changed in the file system
+    // behind our back. See `CachedFile::quarantined()`. What's hidden in them can't be read any
+    // more, and anything written to them since they were last synced never makes it to them.
+    std::vector<std::string> quarantined();
+
     protected:
     // Don't want to accidentally use this.
     void prepare() { THROW(unimplemented, ""); }
 
     private:
     // The files we're managing.
-    std::vector<StegFile> _files;
+    std::vector<std::unique_ptr<CachedFile>> _files;
+
+    // One lock per file in `_files`, held by anything which uses that file, so that requests coming
+    // from different threads, (and the pieces of one request), can't trip over each other.
+    std::unique_ptr<std::mutex[]> _locks;
+
+    // Decides where every byte lives, i.e. which file in `_files`, and where in that file.
+    std::unique_ptr<Layout> _layout;
+
+    // Which device every file in `_files` is on, numbered from 0 in the order they were first seen,
+    // and how many devices there are.
+    std::vector<unsigned> _device;
+    size_t                _devices;
+
+    // See `jobs` in `Manager::Manager()`.
+    size_t _jobs;
+
+    // Every range which has been `.discard()`ed, and hasn't been written to since.
+    IntervalSet _discarded;
+
+    // How many bytes of every file in `_files` are in `_discarded`. Once that's all of its places
+    // in the layout, the file holds nothing worth syncing.
+    std::vector<size_t> _dead;
+
+    // Whether `_discarded` has changed since it was last saved. See `.keep_discards()`.
+    bool _discards_changed;
 
-    // Cumulative capacity of each of the files in `_files`. Used by `.which_file()`. See the body
-    // of `.which_file()` for an explanation.
-    std::vector<size_t> _cum_cap;
+    // Protects `_discarded`, `_dead` and `_discards_changed`.
+    std::mutex _discard_mutex;
 
-    // Shuffler used to randomise read/write locations.
-    Shuffler _shuffler;
+    // Where `_discarded` is saved, or empty if it's only kept in memory. See `.keep_discards()`.
+    std::string _discards_path;
 
-    // Given a byte location, works out which file from `_files` that byte lies in, and its offset
-    // within that file.
+    // Covers, for reading, once `.read_only()` has been called. Null before then.
+    std::unique_ptr<ReadCache> _cache;
+
+    // Journal that writes are appended to, if any. See `.journal()`.
+    std::unique_ptr<Journal> _journal;
+
+    // See `limit` in `.journal()`.
+    size_t _journal_limit;
+
+    // `.write()`s hold this for reading while they update the cache and append to the journal, and
+    // `.sync()` holds it for writing just long enough to see how big the journal is. Every record
+    // before that point is then in the snapshots `.sync()` takes, and can go once they're synced.
+    // Anything after it, `.sync()` leaves in the journal.
+    pthread_rwlock_t _checkpoint;
+
+    // Held by `.sync()` the whole time, so that only one runs at a time.
+    std::mutex _sync_mutex;
+
+    // Decides when jobs on covers run. See `.limit()`.
+    Scheduler _scheduler;
+
+    // See `.readahead()`.
+    size_t _readahead;
+
+    // Where the last `.read()` ended, to spot sequential reads.
+    std::atomic<size_t> _last_read;
+
+    // Whether a `.prefetch()` is running, so that there's only one, and so that we can wait for it
+    // when we go.
+    std::atomic<bool> _prefetching;
+
+    // The roots, as given to `Manager()`, and the device each one is on. See `_device`.
+    std::vector<root>     _roots;
+    std::vector<unsigned> _root_device;
+
+    // The layout options and seed, for the layouts of new segments.
+    Layout::options _options;
+    std::string     _seed;
+
+    // Which covers are in which segment, if there's a manifest. See `Manager()`.
+    std::unique_ptr<Manifest> _manifest;
+
+    // `_layout`, if there's a manifest, so segments can be added to it. Null otherwise.
+    SegmentedLayout* _segments;
+
+    // Held for reading by anything which uses `_files`, `_locks`, `_device`, `_dead` or `_layout`,
+    // (besides a `.read_only()` `.read()`, since then nothing can `.grow()`), and for writing by
+    // `.grow()` while it adds to them.
+    pthread_rwlock_t _growing;
+
+    // Held by `.grow()` the whole time, so that only one runs at a time.
+    std::mutex _grow_mutex;
+
+    // Opens the covers of a segment, in parallel.
+    //
+    // covers: The covers, from the manifest.
+    //
+    // Returns a `CachedFile` for every cover, in the same order.
+    //
+    // Throws `exc::config` if a cover's root wasn't given.
+    // Throws anything `.open()` throws.
+    std::vector<std::unique_ptr<CachedFile>> open_covers(
+            const std::vector<Manifest::cover>& covers);
+
+    // Makes the layout of a segment.
+    //
+    // covers: The covers of the segment, from the manifest.
+    // files:  The covers, opened, from `.open_covers()`.
+    // index:  Which segment this is. Every segment has its own seed, derived from `_seed`, except
+    //         the first, which has `_seed` itself, so it's the same as having no manifest.
+    //
+    // Throws anything `Layout::create()` throws.
+    std::unique_ptr<Layout> segment_layout(const std::vector<Manifest::cover>& covers,
+            const std::vector<std::unique_ptr<CachedFile>>& files, size_t index);
+
+    // Adds a segment on the end of the volume: its covers go on the end of `_files`, and its
+    // layout on the end of `_segments`. Hold `_growing` for writing, unless nobody else can be
+    // using this yet.
+    //
+    // covers:  The covers of the segment, from the manifest.
+    // files:   The covers, opened, from `.open_covers()`. These are moved out of.
+    // segment: The segment's layout, from `.segment_layout()`.
+    void install(const std::vector<Manifest::cover>& covers,
+            std::vector<std::unique_ptr<CachedFile>>& files, std::unique_ptr<Layout> segment);
+
+    // `.sync()`, for when `_sync_mutex` is already held.
+    //
+    // Throws anything `.sync()` throws.
+    void sync_files();
+
+    // Roughly how many times its capacity in memory a `StegFile` needs while it's being loaded or
+    // synced: the hidden bytes themselves, the decoded image, which has 8 bytes for every hidden
+    // one, and the encoded image, which could be just as big again. (A `WavFile` needs much less,
+    // but there's no harm in overestimating.)
+    static const size_t FOOTPRINT = 18;
+
+    // Makes the right kind of `CachedFile` for a cover, going by its extension: a `WavFile` for
+    // '.wav', otherwise a `StegFile`. (Not case sensitive.)
+    //
+    // path: The path to the cover.
+    //
+    // Returns the new `CachedFile`.
+    //
+    // Throws anything `StegFile::StegFile(const string&)` throws.
+    // Throws anything `WavFile::WavFile(const string&)` throws.
+    static std::unique_ptr<CachedFile> open(const std::string& path);
+
+    // Calls `fn` for every file, in parallel, with `.schedule()`, but without letting the files in
+    // flight use more than about `memory` bytes between them, going by `FOOTPRINT`.
+    //
+    // memory: Roughly how many bytes the files in flight are allowed to use between them.
+    // fn:     Called with the index of every file in `_files`.
+    //
+    // Throws the first exception thrown by `fn`, once every call to `fn` is done.
+    void for_each_file(size_t memory, const std::function<void(size_t)>& fn);
+
+    // Like `.for_each_file()`, but `fn` is also told where every byte of its file is in the volume,
+    // by `Layout::invert()`. That's another 8 bytes of memory for every byte of capacity, so files
+    // are taken a batch at a time, as many as fit in `memory` with their maps and `FOOTPRINT`,
+    // and every batch's maps are worked out in one go, then freed once its files are done.
+    //
+    // files:  Index in `_files` of every file to call `fn` for.
+    // memory: Roughly how many bytes the files in flight and their maps are allowed to use.
+    // fn:     Called with the index of every file in `files`, and where in the volume every byte of
+    //         the file is, or `Layout::NONE` if nothing's there.
+    //
+    // Throws the first exception thrown by `fn`, once every call to `fn` in its batch is done.
+    void for_each_inverted(const std::vector<size_t>& files, size_t memory,
+            const std::function<void(size_t, const size_t*)>& fn);
+
+    // Calls `fn` for every one of `count` jobs which each use one file, in parallel on
+    // `ThreadPool::get()`, with the calling thread helping out. Jobs are queued by the device their
+    // file is on, and the devices take turns, so that every device has work at once. No device has
+    // more than `_jobs` jobs running at once, (unless it's 0), and the files of the jobs running
+    // don't use more than about `memory` bytes between them, going by `FOOTPRINT`. At least one job
+    // is always running, however big its file is. Each file is locked while its job runs, unless
+    // `lock_files` is false, in which case `fn` locks it itself, if it needs to. Every job also
+    // goes through `_scheduler`, as a job of class `c`.
+    //
+    // count:      How many jobs there are.
+    // file:       Called with the number of every job, and returns the index in `_files` of its
+    //             file.
+    // memory:     Roughly how many bytes the files in flight are allowed to use between them, or
+    //             `SIZE_MAX` for no limit.
+    // fn:         Called with the number of every job, from 0 to `count`.
+    // lock_files: Whether to lock each job's file while it runs.
+    // c:          What the jobs are for.
+    //
+    // Throws the first exception thrown by `fn`, once every call to `fn` is done.
+    void schedule(size_t count, const std::function<size_t(size_t)>& file, size_t memory,
+            const std::function<void(size_t)>& fn, bool lock_files = true,
+            Scheduler::work_class c = Scheduler::FOREGROUND);
+
+    // Saves `_discarded` to `_discards_path`, if it's changed since last time, and takes note of
+    // which files held nothing but discarded bytes when it did. For `.sync()` and friends.
+    //
+    // Returns whether each file in `_files` was dead, (see `_dead`), in what was saved.
+    //
+    // Throws `exc::file` if the file could not be written.
+    std::vector<bool> save_discards();
+
+    // Replaces the entire contents of a file, syncs it, and drops it from memory. For `.pack()` and
+    // friends, from inside `.for_each_file()`.
+    //
+    // i:        Index of the file in `_files`.
+    // generate: Called with a buffer of zeros, of the file's capacity, to fill in with the file's
+    //           new contents.
     //
-    // byte:     The byte location to find.
-    // out_file: This is overwritten with a pointer to the file, in `_files`, that the byte location
-    //           given by `byte` lies in, or nullptr if an exception was thrown.
+    // Throws anything `generate` throws.
+    // Throws anything `CachedFile::sync()` throws.
+    void overwrite(size_t i, const std::function<void(char*)>& generate);
+
+    // A run of bytes which are contiguous both in a request's buffer, and within one file.
+    struct extent
+    {
+        // Offset of the run within the request's buffer.
+        size_t buf;
+
+        // Offset of the run within the file.
+        size_t offset;
+
+        // Length of the run.
+        size_t size;
+    };
+
+    // A request, split up by file: the index in `_files` of every file the request touches, along
+    // with the extents of the request which lie within that file, in order.
+    typedef std::vector<std::pair<size_t, std::vector<extent>>> split_t;
+
+    // Splits the range of bytes [`offset`, `offset` + `size`) of this `Manager` up by file.
+    //
+    // offset: Start of the range.
+    // size:   Length of the range. `offset` + `size` must be <= `.capacity()`.
     //
-    // Returns the offset, in bytes, that the byte location given by `byte` lies in within the file
-    //         pointed to by `out_file`.
+    // Returns the range, split up.
+    //
+    // Throws anything `Layout::map()` throws.
+    split_t split(off_t offset, size_t size);
+
+    // Like `.split(off_t, size_t)`, but for several ranges which make up one request, with gaps
+    // between them. Offsets of extents within the request's buffer are relative to `base`.
     //
-    // Throws `exc::arg` if `byte` >= `.capacity()`.
+    // ranges: Start and length of every range, all at or after `base`.
+    // base:   Where the request's buffer starts.
+    split_t split(const std::vector<std::pair<size_t, size_t>>& ranges, size_t base);
+
+    // Calls `fn` for every file in `pieces`, with `.schedule()`. Each file is locked while `fn` is
+    // using it.
+    //
+    // pieces: A split request, from `.split()`.
+    // fn:     Called with each file and the extents which lie within it.
+    //
+    // Throws the first exception thrown by `fn`, once every call to `fn` is done.
+    void fan_out(const split_t& pieces,
+            const std::function<void(CachedFile&, const std::vector<extent>&)>& fn);
+
+    // Calls `fn` for every number from 0 to `count`, in parallel on `ThreadPool::get()`. The
+    // calling thread helps out too, rather than sitting around waiting. There's only ever as many
+    // tasks as there are threads, so there can be millions of numbers. This returns as soon as
+    // every number is done, without waiting for tasks which never got a worker: if the pool is
+    // busy, the calling thread just does more of them itself.
+    //
+    // count:    How many times to call `fn`.
+    // fn:       Called with every number from 0 to `count`.
+    // priority: Priority of the tasks in the pool. See <Scheduler.h>.
+    //
+    // Throws the first exception thrown by `fn`, once every call to `fn` is done.
+    void parallel(size_t count, const std::function<void(size_t)>& fn,
+            Scheduler::work_class priority = Scheduler::FOREGROUND);
+
+    // Starts loading the covers behind a range in the background, with `Scheduler::PREFETCH`, if
+    // `.readahead()` is on and it isn't busy already.
     //
-    // NOTE: To explain, say you've got three files of 100 bytes in size. What file would the 250th
-    // byte lie in? The third one, of course! And it would be the 50th byte in that file.
-    // `.which_file()` is designed to work this out.
-    size_t which_file(size_t byte, StegFile*& out_file);
+    // offset: Start of the range. It's `.readahead()` bytes long, or up to `.capacity()`.
+    void prefetch(size_t offset);
 };
 
 #endif
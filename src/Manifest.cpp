@@ -0,0 +1,172 @@
+#include <string>
+#include <vector>
+#include <sstream>
+
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Manifest.h"
+#include "exc.h"
+
+using namespace std;
+
+const char Manifest::MAGIC[] = "loop-steg manifest 1\n";
+
+Manifest::Manifest(const string& path): _path(path), _fd(-1), _end(0), _segments()
+{
+    _fd = open(_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+
+    if (_fd < 0)
+    {
+        stringstream ss;
+        ss << "could not open manifest '" << _path << "': " << strerror(errno);
+        THROW(file, ss.str());
+    }
+
+    struct stat st;
+
+    if (fstat(_fd, &st) < 0)
+    {
+        stringstream ss;
+        ss << "could not get size of manifest '" << _path << "': " << strerror(errno);
+        close(_fd);
+        THROW(file, ss.str());
+    }
+
+    size_t magic = sizeof(MAGIC) - 1;
+
+    // A brand new (or empty) file becomes a brand new manifest.
+    if (st.st_size == 0)
+    {
+        if (pwrite(_fd, MAGIC, magic, 0) != (ssize_t)magic || fdatasync(_fd) < 0)
+        {
+            stringstream ss;
+            ss << "could not initialise manifest '" << _path << "': " << strerror(errno);
+            close(_fd);
+            THROW(file, ss.str());
+        }
+
+        _end = magic;
+        return;
+    }
+
+    string contents(st.st_size, '\0');
+
+    if (pread(_fd, &contents[0], contents.size(), 0) != (ssize_t)contents.size())
+    {
+        stringstream ss;
+        ss << "could not read from manifest '" << _path << "': " << strerror(errno);
+        close(_fd);
+        THROW(file, ss.str());
+    }
+
+    if (contents.compare(0, magic, MAGIC) != 0)
+    {
+        stringstream ss;
+        ss << "'" << _path << "' is not a manifest";
+        close(_fd);
+        THROW(file, ss.str());
+    }
+
+    // Everything up to the last "end" is good. Anything after it is a segment we never finished.
+    vector<cover> segment;
+    _end = magic;
+
+    for (size_t at = magic, newline; (newline = contents.find('\n', at)) != string::npos;
+         at = newline + 1)
+    {
+        string line = contents.substr(at, newline - at);
+
+        if (line == "end")
+        {
+            _segments.push_back(move(segment));
+            segment.clear();
+            _end = newline + 1;
+            continue;
+        }
+
+        size_t tab = line.find('\t');
+        char* number_end;
+        unsigned long root = strtoul(line.c_str(), &number_end, 10);
+
+        if (tab == string::npos || tab == 0 || number_end != line.c_str() + tab)
+        {
+            stringstream ss;
+            ss << "manifest '" << _path << "' is corrupt at byte " << at;
+            close(_fd);
+            THROW(file, ss.str());
+        }
+
+        segment.push_back({ root, line.substr(tab + 1) });
+    }
+
+    if (_end != contents.size() && (ftruncate(_fd, _end) < 0 || fdatasync(_fd) < 0))
+    {
+        stringstream ss;
+        ss << "could not truncate manifest '" << _path << "': " << strerror(errno);
+        close(_fd);
+        THROW(file, ss.str());
+    }
+}
+
+Manifest::~Manifest() { close(_fd); }
+
+const string& Manifest::path() const { return _path; }
+
+bool Manifest::empty() const { return _segments.empty(); }
+
+size_t Manifest::segments() const { return _segments.size(); }
+
+const vector<Manifest::cover>& Manifest::segment(size_t i) const { return _segments[i]; }
+
+void Manifest::append(const vector<cover>& covers)
+{
+    stringstream out;
+
+    for (const cover& c : covers)
+    {
+        if (c.path.find_first_of("\t\n") != string::npos)
+        {
+            stringstream ss;
+            ss << "cover '" << c.path << "' has a tab or newline in its name, so it can't go in a "
+                "manifest";
+            THROW(config, ss.str());
+        }
+
+        out << c.root << '\t' << c.path << '\n';
+    }
+
+    out << "end\n";
+    string text = out.str();
+
+    for (size_t done = 0; done < text.size();)
+    {
+        ssize_t result = pwrite(_fd, text.data() + done, text.size() - done, _end + done);
+
+        if (result < 0 && errno == EINTR) continue;
+
+        if (result <= 0)
+        {
+            stringstream ss;
+            ss << "could not write to manifest '" << _path << "': " << strerror(errno);
+            THROW(file, ss.str());
+        }
+
+        done += result;
+    }
+
+    if (fdatasync(_fd) < 0)
+    {
+        stringstream ss;
+        ss << "could not sync manifest '" << _path << "': " << strerror(errno);
+        THROW(file, ss.str());
+    }
+
+    _end += text.size();
+    _segments.push_back(covers);
+}
@@ -0,0 +1,91 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <string>
+#include <vector>
+
+#include <cstddef>
+
+// Which covers make up a growable volume, and in which segments. See <SegmentedLayout.h>.
+//
+// Without a manifest, the covers are whatever's in the directories, in order, so adding one moves
+// everything. With one, the covers are only ever the ones it lists, in the order it lists them, so
+// a new file in a directory changes nothing until it's added, as a new segment, on the end.
+//
+// The manifest lives in a text file of its own, which must NOT be inside the directories of covers.
+// It looks like:
+//
+// "loop-steg manifest 1"           The first line.
+// "<root>\t<path>"                 One line for every cover of the first segment: the index of its
+// ...                              root, (see `Manager::roots()`), and its path within the root.
+// "end"                            The end of the segment. Then the next segment, and so on.
+//
+// Segments are only ever appended, and made durable before they're used, so a segment which was
+// only partly written when we crashed has no "end", and is ignored and chopped off.
+class Manifest
+{
+    public:
+    // A cover in the manifest.
+    struct cover
+    {
+        // Index of the root it's under.
+        size_t root;
+
+        // Its path within the root.
+        std::string path;
+    };
+
+    // Opens the manifest at `path`, creating it if it doesn't exist. A new manifest is `.empty()`.
+    //
+    // path: The path to the manifest file.
+    //
+    // Throws `exc::file` if the file at `path` could not be opened, created, read or truncated.
+    // Throws `exc::file` if the file at `path` exists, is not empty, and is not a manifest.
+    Manifest(const std::string& path);
+
+    // There should only be one `Manifest` per file, for the same reasons as `Journal`.
+    Manifest(const Manifest& other)            = delete;
+    Manifest& operator=(const Manifest& other) = delete;
+
+    ~Manifest();
+
+    // The path to the manifest file, as given to `Manifest()`.
+    const std::string& path() const;
+
+    // Whether there are no segments yet.
+    bool empty() const;
+
+    // How many segments there are.
+    size_t segments() const;
+
+    // The covers of a segment, in order.
+    //
+    // i: Index of the segment.
+    const std::vector<cover>& segment(size_t i) const;
+
+    // Adds a segment on the end, and makes it durable.
+    //
+    // covers: The covers of the new segment, in order.
+    //
+    // Throws `exc::config` if the path of a cover has a tab or a newline in it.
+    // Throws `exc::file` if the segment could not be written or synced.
+    void append(const std::vector<cover>& covers);
+
+    private:
+    // The first line of every manifest.
+    static const char MAGIC[];
+
+    // Same as `path` given to `Manifest()`.
+    std::string _path;
+
+    // File descriptor of the open manifest file.
+    int _fd;
+
+    // Size of the manifest file. New segments go at the end.
+    size_t _end;
+
+    // The covers of every segment.
+    std::vector<std::vector<cover>> _segments;
+};
+
+#endif
@@ -0,0 +1,605 @@
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <sstream>
+#include <algorithm>
+#include <map>
+
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+
+#include <endian.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "NbdServer.h"
+#include "exc.h"
+#include "util.h"
+
+using namespace std;
+
+namespace
+{
+
+// Magic numbers, option and command numbers and so on, from the NBD protocol. Names are as in the
+// protocol document, minus the 'NBD_' at the front.
+const uint64_t NBDMAGIC             = 0x4e42444d41474943ULL;
+const uint64_t IHAVEOPT             = 0x49484156454f5054ULL;
+const uint64_t OPTION_REPLY_MAGIC   = 0x0003e889045565a9ULL;
+const uint32_t REQUEST_MAGIC        = 0x25609513;
+const uint32_t SIMPLE_REPLY_MAGIC   = 0x67446698;
+
+const uint16_t FLAG_FIXED_NEWSTYLE  = 1 << 0;
+const uint16_t FLAG_NO_ZEROES       = 1 << 1;
+
+const uint32_t OPT_EXPORT_NAME      = 1;
+const uint32_t OPT_ABORT            = 2;
+const uint32_t OPT_LIST             = 3;
+const uint32_t OPT_INFO             = 6;
+const uint32_t OPT_GO               = 7;
+
+const uint32_t REP_ACK              = 1;
+const uint32_t REP_SERVER           = 2;
+const uint32_t REP_INFO             = 3;
+const uint32_t REP_ERR_UNSUP        = (1U << 31) + 1;
+const uint32_t REP_ERR_INVALID      = (1U << 31) + 3;
+const uint32_t REP_ERR_UNKNOWN      = (1U << 31) + 6;
+
+const uint16_t INFO_EXPORT          = 0;
+const uint16_t INFO_BLOCK_SIZE      = 3;
+
+const uint16_t FLAG_HAS_FLAGS       = 1 << 0;
+const uint16_t FLAG_READ_ONLY       = 1 << 1;
+const uint16_t FLAG_SEND_FLUSH      = 1 << 2;
+const uint16_t FLAG_SEND_FUA        = 1 << 3;
+const uint16_t FLAG_SEND_TRIM       = 1 << 5;
+const uint16_t FLAG_CAN_MULTI_CONN  = 1 << 8;
+
+const uint16_t CMD_READ             = 0;
+const uint16_t CMD_WRITE            = 1;
+const uint16_t CMD_DISC             = 2;
+const uint16_t CMD_FLUSH            = 3;
+const uint16_t CMD_TRIM             = 4;
+
+const uint16_t CMD_FLAG_FUA         = 1 << 0;
+
+// Error numbers to send to clients. These are the protocol's, which happen to be Linux's too.
+const uint32_t ERR_EPERM            = 1;
+const uint32_t ERR_EIO              = 5;
+const uint32_t ERR_EINVAL           = 22;
+const uint32_t ERR_ENOSPC           = 28;
+
+// Options longer than this are rejected. None of the ones we understand come anywhere close.
+const uint32_t MAX_OPTION = 64 << 10;
+
+// Reads exactly `size` bytes from `fd`.
+//
+// Returns false on EOF or error.
+bool recv_all(int fd, void* buf, size_t size)
+{
+    for (char* p = static_cast<char*>(buf); size;)
+    {
+        ssize_t result = recv(fd, p, size, 0);
+
+        if (result < 0 && errno == EINTR) continue;
+        if (result <= 0) return false;
+
+        p    += result;
+        size -= result;
+    }
+
+    return true;
+}
+
+// Writes `count` buffers to `fd`, all of them, in one go if possible.
+//
+// Returns false on error.
+bool send_all(int fd, struct iovec* iov, size_t count)
+{
+    while (count)
+    {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov    = iov;
+        msg.msg_iovlen = count;
+
+        // MSG_NOSIGNAL, so a client going away is an error, not a SIGPIPE.
+        ssize_t result = sendmsg(fd, &msg, MSG_NOSIGNAL);
+
+        if (result < 0 && errno == EINTR) continue;
+        if (result < 0) return false;
+
+        // Skip over whatever was sent.
+        size_t sent = result;
+
+        while (count && sent >= iov->iov_len)
+        {
+            sent -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+
+        if (count)
+        {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + sent;
+            iov->iov_len -= sent;
+        }
+    }
+
+    return true;
+}
+
+bool send_all(int fd, const void* buf, size_t size)
+{
+    struct iovec iov = { const_cast<void*>(buf), size };
+    return send_all(fd, &iov, 1);
+}
+
+// Appends a big endian integer to a buffer.
+void put(vector<char>& out, uint64_t value, size_t bytes)
+{
+    for (size_t i = bytes; i--;) out.push_back((char)(value >> (i * 8)));
+}
+
+void put16(vector<char>& out, uint16_t value) { put(out, value, 2); }
+void put32(vector<char>& out, uint32_t value) { put(out, value, 4); }
+void put64(vector<char>& out, uint64_t value) { put(out, value, 8); }
+
+// Sends a reply to an option during the handshake.
+bool option_reply(int fd, uint32_t option, uint32_t type, const vector<char>& data = {})
+{
+    vector<char> out;
+    put64(out, OPTION_REPLY_MAGIC);
+    put32(out, option);
+    put32(out, type);
+    put32(out, data.size());
+    out.insert(out.end(), data.begin(), data.end());
+    return send_all(fd, out.data(), out.size());
+}
+
+}
+
+NbdServer::NbdServer(Manager& manager, const string& path, size_t inflight):
+    NbdServer(vector<volume>(1, { "", &manager }), path, inflight)
+{ }
+
+NbdServer::NbdServer(const vector<volume>& volumes, const string& path, size_t inflight):
+    _volumes(volumes),
+    _path(path),
+    _fd(-1),
+    _inflight(max<size_t>(inflight, 1)),
+    _stopping(false),
+    _workers(),
+    _clients(),
+    _finished(),
+    _clients_mutex(),
+    _buffered(0),
+    _buffered_mutex(),
+    _buffered_cv()
+{
+    if (_volumes.empty()) THROW(arg, "there must be at least one volume to serve");
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if (_path.size() >= sizeof(addr.sun_path))
+    {
+        stringstream ss;
+        ss << "socket path '" << _path << "' is too long";
+        THROW(file, ss.str());
+    }
+
+    strcpy(addr.sun_path, _path.c_str());
+
+    _fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    // Get rid of any socket left lying around from last time.
+    unlink(_path.c_str());
+
+    if (_fd < 0 || bind(_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(_fd, 16) < 0)
+    {
+        stringstream ss;
+        ss << "could not listen on '" << _path << "': " << strerror(errno);
+        if (_fd >= 0) close(_fd);
+        THROW(file, ss.str());
+    }
+}
+
+NbdServer::~NbdServer()
+{
+    close(_fd);
+    unlink(_path.c_str());
+}
+
+void NbdServer::serve()
+{
+    map<thread::id, thread> threads;
+
+    while (!_stopping)
+    {
+        int fd = accept4(_fd, nullptr, nullptr, SOCK_CLOEXEC);
+
+        // Join the threads of everyone who's gone since last time, so that they don't pile up
+        // over a long run of clients coming and going.
+        vector<thread::id> finished;
+
+        {
+            lock_guard<mutex> lock(_clients_mutex);
+            finished.swap(_finished);
+        }
+
+        for (thread::id id : finished)
+        {
+            threads[id].join();
+            threads.erase(id);
+        }
+
+        if (fd < 0)
+        {
+            // `.stop()` shuts the socket down, which makes `accept4()` fail, so we end up here.
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;
+        }
+
+        shared_ptr<client> c = make_shared<client>(fd);
+
+        {
+            lock_guard<mutex> lock(_clients_mutex);
+            _clients.push_back(c);
+        }
+
+        thread t([this, c]()
+        {
+            if (handshake(*c)) transmission(c);
+
+            lock_guard<mutex> lock(_clients_mutex);
+            _clients.erase(find(_clients.begin(), _clients.end(), c));
+            _finished.push_back(this_thread::get_id());
+            close(c->fd);
+        });
+
+        thread::id id = t.get_id();
+        threads.emplace(id, move(t));
+    }
+
+    // Stop reading from everyone. Whatever they've already sent still gets run and replied to.
+    {
+        lock_guard<mutex> lock(_clients_mutex);
+        for (auto& c : _clients) shutdown(c->fd, SHUT_RD);
+    }
+
+    for (auto& t : threads) t.second.join();
+}
+
+void NbdServer::stop()
+{
+    _stopping = true;
+    shutdown(_fd, SHUT_RDWR);
+}
+
+bool NbdServer::handshake(client& c)
+{
+    {
+        vector<char> out;
+        put64(out, NBDMAGIC);
+        put64(out, IHAVEOPT);
+        put16(out, FLAG_FIXED_NEWSTYLE | FLAG_NO_ZEROES);
+        if (!send_all(c.fd, out.data(), out.size())) return false;
+    }
+
+    uint32_t client_flags;
+    if (!recv_all(c.fd, &client_flags, 4)) return false;
+    client_flags = be32toh(client_flags);
+
+    // Old clients which don't speak fixed newstyle could get confused by our replies. Not worth it.
+    if (!(client_flags & FLAG_FIXED_NEWSTYLE)) return false;
+
+    auto flags = [](Manager& manager) -> uint16_t
+    {
+        return FLAG_HAS_FLAGS | FLAG_SEND_FLUSH | FLAG_SEND_FUA | FLAG_SEND_TRIM
+            | FLAG_CAN_MULTI_CONN | (manager.read_only() ? FLAG_READ_ONLY : 0);
+    };
+
+    for (;;)
+    {
+        uint64_t magic;
+        uint32_t option, size;
+
+        if (!recv_all(c.fd, &magic, 8) || !recv_all(c.fd, &option, 4) || !recv_all(c.fd, &size, 4))
+            return false;
+
+        option = be32toh(option);
+        size   = be32toh(size);
+
+        if (be64toh(magic) != IHAVEOPT || size > MAX_OPTION) return false;
+
+        vector<char> data(size);
+        if (!recv_all(c.fd, data.data(), size)) return false;
+
+        switch (option)
+        {
+            // The old way of picking an export. No reply, just the export's details, and we're in.
+            // There's no way to say there's no such export, other than hanging up.
+            case OPT_EXPORT_NAME:
+            {
+                c.manager = lookup(string(data.begin(), data.end()));
+                if (!c.manager) return false;
+
+                vector<char> out;
+                put64(out, c.manager->capacity());
+                put16(out, flags(*c.manager));
+                if (!(client_flags & FLAG_NO_ZEROES)) out.resize(out.size() + 124, 0);
+                return send_all(c.fd, out.data(), out.size());
+            }
+
+            case OPT_ABORT:
+                option_reply(c.fd, option, REP_ACK);
+                return false;
+
+            case OPT_LIST:
+            {
+                if (size)
+                {
+                    if (!option_reply(c.fd, option, REP_ERR_INVALID)) return false;
+                    break;
+                }
+
+                for (const volume& v : _volumes)
+                {
+                    vector<char> name;
+                    put32(name, v.name.size());
+                    name.insert(name.end(), v.name.begin(), v.name.end());
+
+                    if (!option_reply(c.fd, option, REP_SERVER, name)) return false;
+                }
+
+                if (!option_reply(c.fd, option, REP_ACK)) return false;
+                break;
+            }
+
+            // The new way of picking an export. The name comes first, after its length, then the
+            // information they'd like, which they get anyway.
+            case OPT_INFO:
+            case OPT_GO:
+            {
+                uint32_t length = 0;
+
+                if (size >= 4)
+                {
+                    memcpy(&length, data.data(), 4);
+                    length = be32toh(length);
+                }
+
+                if (size < 6 || length > size - 6)
+                {
+                    if (!option_reply(c.fd, option, REP_ERR_INVALID)) return false;
+                    break;
+                }
+
+                Manager* manager = lookup(string(data.begin() + 4, data.begin() + 4 + length));
+
+                if (!manager)
+                {
+                    if (!option_reply(c.fd, option, REP_ERR_UNKNOWN)) return false;
+                    break;
+                }
+
+                vector<char> exp, block;
+
+                put16(exp, INFO_EXPORT);
+                put64(exp, manager->capacity());
+                put16(exp, flags(*manager));
+
+                // The preferred block size has to be a power of 2, so the closest we can get to the
+                // layout's blocks is the smallest one they fit in.
+                uint32_t preferred = 4096;
+                while (preferred < manager->block() && preferred < MAX_REQUEST) preferred <<= 1;
+
+                put16(block, INFO_BLOCK_SIZE);
+                put32(block, 1);
+                put32(block, preferred);
+                put32(block, MAX_REQUEST);
+
+                if (!option_reply(c.fd, option, REP_INFO, exp)
+                        || !option_reply(c.fd, option, REP_INFO, block)
+                        || !option_reply(c.fd, option, REP_ACK))
+                    return false;
+
+                if (option != OPT_GO) break;
+
+                c.manager = manager;
+                return true;
+            }
+
+            default:
+                if (!option_reply(c.fd, option, REP_ERR_UNSUP)) return false;
+                break;
+        }
+    }
+}
+
+void NbdServer::transmission(const shared_ptr<client>& c)
+{
+    for (;;)
+    {
+        char header[28];
+        if (!recv_all(c->fd, header, sizeof(header))) break;
+
+        uint32_t magic;
+        uint16_t flags, type;
+        uint64_t cookie, offset;
+        uint32_t length;
+
+        memcpy(&magic,  header,      4);
+        memcpy(&flags,  header + 4,  2);
+        memcpy(&type,   header + 6,  2);
+        memcpy(&cookie, header + 8,  8);
+        memcpy(&offset, header + 16, 8);
+        memcpy(&length, header + 24, 4);
+
+        // The cookie is opaque; it goes back exactly as it came, so it isn't byte swapped.
+        magic  = be32toh(magic);
+        flags  = be16toh(flags);
+        type   = be16toh(type);
+        offset = be64toh(offset);
+        length = be32toh(length);
+
+        if (magic != REQUEST_MAGIC || type == CMD_DISC) break;
+
+        // If we can't read a write's payload, we've lost track of where the requests are.
+        if (type == CMD_WRITE && length > MAX_REQUEST)
+        {
+            reply(*c, cookie, ERR_EINVAL);
+            break;
+        }
+
+        // Wait for room, both among this client's requests and in memory, before holding on to
+        // anything.
+        size_t size = type == CMD_READ || type == CMD_WRITE ? min(length, MAX_REQUEST) : 0;
+
+        {
+            unique_lock<mutex> lock(c->mutex);
+            c->cv.wait(lock, [this, &c]() { return c->inflight < _inflight; });
+            ++c->inflight;
+        }
+
+        reserve(size);
+
+        // Gives the room back, once the request is done with.
+        auto done = [this, c, size]()
+        {
+            release(size);
+
+            lock_guard<mutex> lock(c->mutex);
+            --c->inflight;
+            c->cv.notify_all();
+        };
+
+        // `std::function` has to be copyable, so the buffer goes in a `shared_ptr`.
+        shared_ptr<vector<char>> buf = make_shared<vector<char>>(size);
+
+        if (type == CMD_WRITE && !recv_all(c->fd, buf->data(), length))
+        {
+            done();
+            break;
+        }
+
+        uint32_t error = 0;
+
+        if (type != CMD_READ && type != CMD_WRITE && type != CMD_FLUSH && type != CMD_TRIM)
+            error = ERR_EINVAL;
+        else if (length > MAX_REQUEST && type != CMD_TRIM)
+            error = ERR_EINVAL;
+        else if ((type == CMD_WRITE || type == CMD_TRIM) && c->manager->read_only())
+            error = ERR_EPERM;
+        else if (offset > c->manager->capacity() || length > c->manager->capacity() - offset)
+            error = type == CMD_WRITE ? ERR_ENOSPC : ERR_EINVAL;
+
+        if (error)
+        {
+            done();
+            if (!reply(*c, cookie, error)) break;
+            continue;
+        }
+
+        // Run it in the background and go and get the next one.
+        _workers.submit([this, c, type, flags, cookie, offset, length, buf, done]()
+        {
+            run(*c, type, flags, cookie, offset, length, *buf);
+
+            // Free it before saying there's room for more.
+            vector<char>().swap(*buf);
+            done();
+        });
+    }
+
+    // Anything still running needs `c` to stay open until it's replied.
+    unique_lock<mutex> lock(c->mutex);
+    c->cv.wait(lock, [&c]() { return c->inflight == 0; });
+}
+
+void NbdServer::run(client& c, uint16_t type, uint16_t flags, uint64_t cookie, uint64_t offset,
+        uint32_t length, vector<char>& data)
+{
+    Manager& manager = *c.manager;
+    uint32_t error   = 0;
+
+    try
+    {
+        if (type == CMD_READ && !data.empty())
+            manager.read(data.data(), data.size(), offset);
+
+        else if (type == CMD_WRITE && !data.empty())
+            manager.write(data.data(), data.size(), offset);
+
+        else if (type == CMD_TRIM && length)
+            manager.discard(offset, length);
+
+        if (type == CMD_FLUSH || (type == CMD_WRITE && (flags & CMD_FLAG_FUA)))
+            flush(manager);
+    }
+
+    catch (const exc::exception& e)
+    {
+        e.print(program_invocation_short_name);
+        error = ERR_EIO;
+    }
+
+    if (type == CMD_READ && !error) reply(c, cookie, 0, data.data(), data.size());
+    else                            reply(c, cookie, error);
+}
+
+void NbdServer::reserve(size_t size)
+{
+    unique_lock<mutex> lock(_buffered_mutex);
+    _buffered_cv.wait(lock, [this, size]()
+    { return !_buffered || _buffered + size <= MAX_BUFFERED; });
+    _buffered += size;
+}
+
+void NbdServer::release(size_t size)
+{
+    lock_guard<mutex> lock(_buffered_mutex);
+    _buffered -= size;
+    _buffered_cv.notify_all();
+}
+
+void NbdServer::flush(Manager& manager)
+{
+    if (manager.journalled()) manager.commit();
+    else                      manager.sync();
+}
+
+Manager* NbdServer::lookup(const string& name) const
+{
+    if (_volumes.size() == 1) return _volumes[0].manager;
+
+    for (const volume& v : _volumes)
+        if (v.name == name) return v.manager;
+
+    return nullptr;
+}
+
+bool NbdServer::reply(client& c, uint64_t cookie, uint32_t error, const char* data, size_t size)
+{
+    char header[16];
+    uint32_t magic = htobe32(SIMPLE_REPLY_MAGIC);
+    error = htobe32(error);
+
+    memcpy(header,     &magic,  4);
+    memcpy(header + 4, &error,  4);
+    memcpy(header + 8, &cookie, 8);
+
+    struct iovec iov[2] = { { header, sizeof(header) }, { const_cast<char*>(data), size } };
+
+    lock_guard<mutex> lock(c.send);
+    return send_all(c.fd, iov, size ? 2 : 1);
+}
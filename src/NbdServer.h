@@ -0,0 +1,175 @@
+#ifndef NBDSERVER_H
+#define NBDSERVER_H
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+
+#include "Manager.h"
+#include "ThreadPool.h"
+
+// Serves a `Manager` as an NBD (Network Block Device) export on a Unix socket. This is an
+// alternative to the usual FUSE file + loop device: every request goes straight from the socket
+// to the `Manager`, without crossing FUSE and the loop driver, or being cached in the page cache
+// twice on the way. The kernel's NBD client can attach it as `/dev/nbdX`, or any userspace client
+// can talk to it directly, e.g. `nbdinfo`, `nbdcopy` or `qemu-img` with
+// 'nbd+unix:///?socket=/path/to/socket', which is handy for testing without a kernel module.
+//
+// Only the 'fixed newstyle' handshake is supported, which every client in the last decade speaks,
+// with simple (not structured) replies. There can be several exports, (say, one per shard), which
+// clients pick by name. If there's only one, its name is ignored, and whatever name a client asks
+// for, it gets that one. Commands supported are READ, WRITE, FLUSH, TRIM and DISC, and any number
+// of clients can be connected at once. Each client can have many requests in flight at once:
+// requests are read off the socket one after another, but run in parallel, and replied to in
+// whatever order they finish. Between them, every client's requests hold at most `MAX_BUFFERED`
+// bytes of payload in memory at once; past that, clients are read from only as requests finish. If
+// a `Manager` is `.read_only()`, its export is too, and WRITEs and TRIMs get EPERM.
+//
+// See <https://github.com/NetworkBlockDevice/nbd/blob/master/doc/proto.md> for the protocol.
+class NbdServer
+{
+    public:
+    // One export: a `Manager`, and the name clients ask for it by.
+    struct volume
+    {
+        std::string name;
+        Manager*    manager;
+    };
+
+    // Creates the socket and starts listening on it. Doesn't accept anyone until `.serve()`.
+    //
+    // volumes:  The exports. Every `Manager` must outlive this `NbdServer`, and there must be at
+    //           least one.
+    // path:     Path to create the Unix socket at. If something's already there, it's replaced.
+    // inflight: Maximum number of requests each client can have running at once. Further requests
+    //           wait until one finishes.
+    //
+    // Throws `exc::arg` if `volumes` is empty.
+    // Throws `exc::file` if the socket could not be created.
+    NbdServer(const std::vector<volume>& volumes, const std::string& path, size_t inflight = 64);
+
+    // Same as above, with just the one export, with an empty name.
+    NbdServer(Manager& manager, const std::string& path, size_t inflight = 64);
+
+    NbdServer(const NbdServer& other)            = delete;
+    NbdServer& operator=(const NbdServer& other) = delete;
+
+    // Closes the socket and removes it from the file system.
+    ~NbdServer();
+
+    // Accepts clients and serves them, until `.stop()` is called. Once it has been, waits for
+    // every client's requests to finish, disconnects them, and returns.
+    void serve();
+
+    // Makes `.serve()` return. This is safe to call from a signal handler.
+    void stop();
+
+    private:
+    // Biggest request we'll accept. Anything bigger gets EINVAL, except a TRIM, which has no
+    // payload to hold in memory.
+    static const uint32_t MAX_REQUEST = 32 << 20;
+
+    // Most bytes of READ and WRITE payloads to hold in memory at once, for every client between
+    // them. Without this, `MAX_REQUEST` times `inflight` could be gigabytes for every client.
+    static const size_t MAX_BUFFERED = 256 << 20;
+
+    // One connected client.
+    struct client
+    {
+        int fd;
+
+        // The export it picked, once the handshake is done.
+        Manager* manager;
+
+        // Held while sending a reply, so replies from different requests don't get mixed up.
+        std::mutex send;
+
+        // Number of requests running, and a way to wait for that to change.
+        size_t inflight;
+        std::mutex mutex;
+        std::condition_variable cv;
+
+        client(int fd): fd(fd), manager(nullptr), send(), inflight(0), mutex(), cv() { }
+
+        client(const client& other)            = delete;
+        client& operator=(const client& other) = delete;
+    };
+
+    std::vector<volume> _volumes;
+
+    // Same as `path` given to `NbdServer(const vector<volume>&, const string&, size_t)`.
+    std::string _path;
+
+    // The listening socket.
+    int _fd;
+
+    // See `inflight` in `NbdServer(const vector<volume>&, const string&, size_t)`.
+    size_t _inflight;
+
+    // Set by `.stop()`.
+    std::atomic<bool> _stopping;
+
+    // Threads which run requests. These wait on `Manager`, which uses `ThreadPool::get()` itself,
+    // so they can't come from there, see `ThreadPool::submit()`.
+    ThreadPool _workers;
+
+    // Every client which is connected, so `.serve()` can disconnect them when it's stopping, and
+    // the threads of clients which have gone, for `.serve()` to join. Both use `_clients_mutex`.
+    std::vector<std::shared_ptr<client>> _clients;
+    std::vector<std::thread::id>         _finished;
+    std::mutex _clients_mutex;
+
+    // Bytes of payload held by every client's requests, see `MAX_BUFFERED`, and a way to wait for
+    // that to go down.
+    size_t _buffered;
+    std::mutex _buffered_mutex;
+    std::condition_variable _buffered_cv;
+
+    // Does the handshake with a newly connected client, and sets its `manager`.
+    //
+    // Returns true if the client is ready for requests, false if it went away or gave up.
+    bool handshake(client& c);
+
+    // The export a client asked for by name, or null if there isn't one by that name.
+    Manager* lookup(const std::string& name) const;
+
+    // Reads requests from a client until it disconnects, and runs them.
+    void transmission(const std::shared_ptr<client>& c);
+
+    // Runs one request and replies to it.
+    //
+    // type:   The command. Either READ, WRITE or TRIM.
+    // flags:  Command flags from the request.
+    // cookie: The request's cookie, (aka handle), to send back in the reply.
+    // offset: Offset of the request in the export.
+    // length: Length of the request. For a TRIM, this is all there is to go on.
+    // data:   The payload of a WRITE, or space for the result of a READ.
+    void run(client& c, uint16_t type, uint16_t flags, uint64_t cookie, uint64_t offset,
+            uint32_t length, std::vector<char>& data);
+
+    // Waits until `size` more bytes of payload fit within `MAX_BUFFERED`, then takes them. A
+    // request always fits if nothing else is buffered, however big it is.
+    void reserve(size_t size);
+
+    // Gives back `size` bytes taken by `.reserve()`.
+    void release(size_t size);
+
+    // Makes every write so far durable. With a journal, that's `Manager::commit()`, but without
+    // one, the only way is a full `Manager::sync()`, (which `fsync()`s every cover it writes),
+    // since NBD clients really do rely on this.
+    //
+    // manager: The export to flush.
+    void flush(Manager& manager);
+
+    // Sends a simple reply, followed by `size` bytes of `data`.
+    //
+    // Returns false if the client has gone away.
+    bool reply(client& c, uint64_t cookie, uint32_t error, const char* data = nullptr,
+            size_t size = 0);
+};
+
+#endif
@@ -0,0 +1,76 @@
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <cstring>
+
+#include "PathTable.h"
+
+using namespace std;
+
+PathTable::PathTable(): _dirs(), _names(), _entries() { }
+
+size_t PathTable::add_dir(const string& path)
+{
+    _dirs.push_back(path);
+    return _dirs.size() - 1;
+}
+
+const string& PathTable::dir(size_t i) const { return _dirs[i]; }
+
+void PathTable::add(size_t dir, const char* name, size_t size)
+{
+    _entries.push_back({ (uint32_t)dir, _names.size() });
+    _names.insert(_names.end(), name, name + size + 1);
+}
+
+void PathTable::sort()
+{
+    std::sort(_entries.begin(), _entries.end(), [this](const entry& a, const entry& b)
+    { return compare(a, b) < 0; });
+
+    _entries.shrink_to_fit();
+    _names.shrink_to_fit();
+}
+
+size_t PathTable::size() const { return _entries.size(); }
+
+string PathTable::operator[](size_t i) const
+{ return _dirs[_entries[i].dir] + (_names.data() + _entries[i].name); }
+
+int PathTable::compare(const entry& a, const entry& b) const
+{
+    // Each path is in two pieces: the directory, then the name. Walk along both paths at once,
+    // moving on to the name once we've run out of directory, without sticking them together.
+    const string& a_dir = _dirs[a.dir];
+    const string& b_dir = _dirs[b.dir];
+
+    // Most of the time, both files are in the same directory, so just compare the names.
+    if (a.dir == b.dir) return strcmp(_names.data() + a.name, _names.data() + b.name);
+
+    const unsigned char* a_at = (const unsigned char*)a_dir.c_str();
+    const unsigned char* b_at = (const unsigned char*)b_dir.c_str();
+    bool a_dir_done = false, b_dir_done = false;
+
+    for (;;)
+    {
+        if (!*a_at && !a_dir_done)
+        {
+            a_at       = (const unsigned char*)_names.data() + a.name;
+            a_dir_done = true;
+            continue;
+        }
+
+        if (!*b_at && !b_dir_done)
+        {
+            b_at       = (const unsigned char*)_names.data() + b.name;
+            b_dir_done = true;
+            continue;
+        }
+
+        if (*a_at != *b_at || !*a_at) return (int)*a_at - (int)*b_at;
+
+        ++a_at;
+        ++b_at;
+    }
+}
@@ -0,0 +1,86 @@
+#ifndef PATHTABLE_H
+#define PATHTABLE_H
+
+#include <string>
+#include <vector>
+
+#include <cstdint>
+
+// A list of file paths which doesn't take up much room, for when there are millions of them. Every
+// directory is only stored once, and every file is just the index of its directory, plus its name,
+// which lives in one big buffer along with every other name. So no `std::string` per file, and no
+// allocation per file either.
+//
+// PathTable t;
+// size_t dir = t.add_dir("/some/dir/");
+// t.add(dir, "file.png");
+// t.sort();
+// cout << t[0] << endl; // "/some/dir/file.png"
+//
+// NOTE: Nothing in here is thread safe. Lock it yourself.
+class PathTable
+{
+    public:
+    PathTable();
+
+    // Adds a directory.
+    //
+    // path: Path to the directory. This should end in a '/', since it's just stuck on the front of
+    //       the name of every file in it.
+    //
+    // Returns the index of the directory, for `.add()` and `.dir()`.
+    size_t add_dir(const std::string& path);
+
+    // Gets a directory added by `.add_dir()`.
+    //
+    // i: Index of the directory, as returned by `.add_dir()`.
+    //
+    // Returns the path of the directory, as given to `.add_dir()`.
+    const std::string& dir(size_t i) const;
+
+    // Adds a file.
+    //
+    // dir:  Index of the directory the file is in, as returned by `.add_dir()`.
+    // name: Name of the file within the directory, null terminated.
+    // size: Length of `name`, not counting the null.
+    void add(size_t dir, const char* name, size_t size);
+
+    // Sorts the files by their full paths, the same as sorting `std::string`s of them would, so that
+    // the order is the same every time.
+    void sort();
+
+    // Number of files.
+    size_t size() const;
+
+    // Gets a file.
+    //
+    // i: Index of the file, from 0 to `.size()`.
+    //
+    // Returns the full path of the file: its directory, followed by its name.
+    std::string operator[](size_t i) const;
+
+    private:
+    // A file.
+    struct entry
+    {
+        // Index of its directory in `_dirs`.
+        uint32_t dir;
+
+        // Offset of its name in `_names`.
+        uint64_t name;
+    };
+
+    // Every directory, from `.add_dir()`.
+    std::vector<std::string> _dirs;
+
+    // The name of every file, one after the other, null terminated.
+    std::vector<char> _names;
+
+    // Every file.
+    std::vector<entry> _entries;
+
+    // Compares the full paths of two files, like `strcmp()`.
+    int compare(const entry& a, const entry& b) const;
+};
+
+#endif
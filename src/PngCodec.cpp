@@ -0,0 +1,386 @@
+#include <string>
+#include <vector>
+#include <memory>
+#include <sstream>
+#include <algorithm>
+
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+
+#include <zlib.h>
+
+#include "PngCodec.h"
+#include "ThreadPool.h"
+#include "fs.h"
+#include "exc.h"
+
+using namespace std;
+
+namespace
+{
+
+const unsigned char SIGNATURE[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+
+// How much deflated data goes in each IDAT chunk we write.
+const size_t IDAT_SIZE = 1 << 16;
+
+uint32_t get32(const unsigned char* in)
+{ return (uint32_t)in[0] << 24 | (uint32_t)in[1] << 16 | (uint32_t)in[2] << 8 | in[3]; }
+
+void put32(unsigned char* out, uint32_t value)
+{
+    out[0] = value >> 24;
+    out[1] = value >> 16;
+    out[2] = value >> 8;
+    out[3] = value;
+}
+
+unsigned char paeth(int a, int b, int c)
+{
+    int p  = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+
+    if (pa <= pb && pa <= pc) return a;
+    if (pb <= pc)             return b;
+    return c;
+}
+
+}
+
+unique_ptr<RowCodec> PngCodec::open(const string& path, int fd)
+{
+    unsigned char signature[8];
+
+    if (!fs::pread_all(fd, signature, sizeof(signature), 0) || memcmp(signature, SIGNATURE, 8))
+        return nullptr;
+
+    unsigned char ihdr[13];
+    bool found_ihdr = false;
+
+    // Look through the chunks up to the image data, for anything that would make stb_image give us
+    // something other than what's in the file.
+    for (off_t at = sizeof(SIGNATURE);;)
+    {
+        unsigned char header[8];
+        if (!fs::pread_all(fd, header, sizeof(header), at)) return nullptr;
+
+        uint32_t size = get32(header);
+
+        if (!memcmp(header + 4, "IHDR", 4))
+        {
+            if (size != sizeof(ihdr) || !fs::pread_all(fd, ihdr, sizeof(ihdr), at + 8))
+                return nullptr;
+
+            found_ihdr = true;
+        }
+
+        else if (!memcmp(header + 4, "tRNS", 4) || !memcmp(header + 4, "CgBI", 4)
+                || !memcmp(header + 4, "IEND", 4))
+            return nullptr;
+
+        else if (!memcmp(header + 4, "IDAT", 4))
+        {
+            if (!found_ihdr) return nullptr;
+
+            uint32_t x = get32(ihdr), y = get32(ihdr + 4);
+
+            // 8 bits, no palette, standard compression and filtering, not interlaced.
+            if (ihdr[8] != 8 || ihdr[10] || ihdr[11] || ihdr[12]) return nullptr;
+            if (!x || !y || x > (1 << 24) || y > (1 << 24))       return nullptr;
+
+            int n;
+
+            switch (ihdr[9])
+            {
+                case 0:  n = 1; break;
+                case 2:  n = 3; break;
+                case 4:  n = 2; break;
+                case 6:  n = 4; break;
+                default: return nullptr;
+            }
+
+            return unique_ptr<RowCodec>(new PngCodec(path, fd, x, y, n, ihdr[9], at));
+        }
+
+        at += 12 + (off_t)size;
+    }
+}
+
+PngCodec::PngCodec(const string& path, int fd, int x, int y, int n, unsigned char colour,
+        off_t idat):
+    RowCodec(path, fd),
+    _colour(colour),
+    _idat(idat)
+{
+    _x = x;
+    _y = y;
+    _n = n;
+}
+
+void PngCodec::read(const row_fn& fn) { decode(fn); }
+
+void PngCodec::rewrite(const row_fn& fn)
+{
+    begin();
+    emit(SIGNATURE, sizeof(SIGNATURE));
+
+    unsigned char ihdr[13] = { 0 };
+    put32(ihdr,     _x);
+    put32(ihdr + 4, _y);
+    ihdr[8] = 8;
+    ihdr[9] = _colour;
+    chunk("IHDR", ihdr, sizeof(ihdr));
+
+    // Deflated rows go in here, and out into an IDAT chunk whenever it fills up.
+    vector<unsigned char> idat;
+    idat.reserve(IDAT_SIZE);
+
+    auto out = [&](const unsigned char* data, size_t size)
+    {
+        while (size)
+        {
+            size_t n = min(size, IDAT_SIZE - idat.size());
+            idat.insert(idat.end(), data, data + n);
+            data += n;
+            size -= n;
+
+            if (idat.size() == IDAT_SIZE)
+            {
+                chunk("IDAT", idat.data(), idat.size());
+                idat.clear();
+            }
+        }
+    };
+
+    // The rows are deflated a piece at a time, each piece on its own, so that they can all be
+    // deflated at once on different threads. A piece ends by flushing to a byte boundary without
+    // finishing the stream, so the pieces can just be put one after the other, and whoever inflates
+    // them sees one stream, like any other. The zlib header and Adler-32 around them are ours.
+    size_t stride = 1 + (size_t)_x * _n;
+    size_t rows   = max<size_t>(1, PIECE / stride);
+
+    // A batch of pieces is decoded, then deflated, then written out, and so on, so there's only
+    // ever one for every thread in memory.
+    vector<piece> pieces(min<size_t>(ThreadPool::get().size() + 1, (_y + rows - 1) / rows));
+    for (piece& p : pieces) p.raw.resize(rows * stride);
+
+    uLong adler = adler32(0, nullptr, 0);
+    size_t start = 0;
+
+    // Deflates the rows from `start` to `end`, and writes them out.
+    auto flush = [&](size_t end)
+    {
+        size_t count = (end - start + rows - 1) / rows;
+
+        ThreadPool::get().parallel(count, [&](size_t i)
+        {
+            size_t first = start + i * rows, last = min(end, first + rows);
+
+            for (size_t row = first; row < last; ++row)
+                fn(row, pieces[i].raw.data() + (row - first) * stride + 1);
+
+            deflate_piece(pieces[i], (last - first) * stride, last == (size_t)_y);
+        }, ThreadPool::PRIORITIES - 1);
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            adler = adler32_combine(adler, pieces[i].adler, pieces[i].size);
+            out(pieces[i].deflated.data(), pieces[i].deflated.size());
+        }
+
+        start = end;
+    };
+
+    // FCHECK makes it a multiple of 31, and FLEVEL 0 says it was deflated as fast as possible.
+    const unsigned char header[2] = { 0x78, 0x01 };
+    out(header, sizeof(header));
+
+    decode([&](size_t i, unsigned char* pixels)
+    {
+        // Every row gets filter type 0, (none), in front of it, like
+        // `stbi_write_force_png_filter = 0`.
+        unsigned char* row = pieces[(i - start) / rows].raw.data() + (i - start) % rows * stride;
+        row[0] = 0;
+        memcpy(row + 1, pixels, stride - 1);
+
+        if (i + 1 == (size_t)_y || i + 1 - start == rows * pieces.size()) flush(i + 1);
+    });
+
+    unsigned char trailer[4];
+    put32(trailer, adler);
+    out(trailer, sizeof(trailer));
+
+    if (!idat.empty()) chunk("IDAT", idat.data(), idat.size());
+
+    chunk("IEND", nullptr, 0);
+    commit();
+}
+
+void PngCodec::deflate_piece(piece& p, size_t size, bool last)
+{
+    p.size  = size;
+    p.adler = adler32(adler32(0, nullptr, 0), p.raw.data(), size);
+
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+
+    // Raw deflate, without a zlib header or trailer, since there's only one of each for them all.
+    if (deflateInit2(&z, Z_BEST_SPEED, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        THROW(too_big, "could not start deflating");
+
+    p.deflated.resize(deflateBound(&z, size) + 16);
+
+    z.next_in   = p.raw.data();
+    z.avail_in  = size;
+    z.next_out  = p.deflated.data();
+    z.avail_out = p.deflated.size();
+
+    int flush = last ? Z_FINISH : Z_SYNC_FLUSH;
+
+    for (;;)
+    {
+        int result = deflate(&z, flush);
+
+        if (result == Z_STREAM_ERROR)
+        {
+            deflateEnd(&z);
+            THROW(file, "could not deflate image");
+        }
+
+        // A flush is only done once there's room left over, (see zlib.h), and a finish once it
+        // says so.
+        if (last ? result == Z_STREAM_END : !z.avail_in && z.avail_out) break;
+
+        size_t used = p.deflated.size() - z.avail_out;
+        p.deflated.resize(p.deflated.size() * 2);
+
+        z.next_out  = p.deflated.data() + used;
+        z.avail_out = p.deflated.size() - used;
+    }
+
+    p.deflated.resize(p.deflated.size() - z.avail_out);
+    deflateEnd(&z);
+}
+
+void PngCodec::decode(const row_fn& fn)
+{
+    size_t stride = (size_t)_x * _n;
+
+    // The row before, unfiltered, which the filters refer to, and the one we're on, with its filter
+    // type in front. The row before the first is all zeros.
+    vector<unsigned char> prev(stride, 0), cur(1 + stride), out(stride);
+    vector<unsigned char> in(1 << 16);
+
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+
+    if (inflateInit(&z) != Z_OK) THROW(too_big, "could not start inflating");
+
+    // Bytes left in the IDAT chunk we're on.
+    uint32_t left = 0;
+    seek(_idat);
+
+    try
+    {
+        for (size_t i = 0; i < (size_t)_y; ++i)
+        {
+            z.next_out  = cur.data();
+            z.avail_out = cur.size();
+
+            while (z.avail_out)
+            {
+                if (!z.avail_in)
+                {
+                    // On to the next IDAT chunk, skipping the CRC of the last one.
+                    while (!left)
+                    {
+                        unsigned char header[8];
+
+                        if (z.next_in) { unsigned char crc[4]; next(crc, sizeof(crc)); }
+                        next(header, sizeof(header));
+
+                        if (memcmp(header + 4, "IDAT", 4))
+                        {
+                            stringstream ss;
+                            ss << "image at '" << _path << "' ends too soon";
+                            THROW(file, ss.str());
+                        }
+
+                        left = get32(header);
+                        z.next_in = in.data();
+                    }
+
+                    size_t n = min<size_t>(left, in.size());
+                    next(in.data(), n);
+
+                    z.next_in  = in.data();
+                    z.avail_in = n;
+                    left      -= n;
+                }
+
+                int result = inflate(&z, Z_NO_FLUSH);
+
+                if (result != Z_OK && !(result == Z_STREAM_END && !z.avail_out))
+                {
+                    stringstream ss;
+                    ss << "image at '" << _path << "' is corrupt";
+                    THROW(file, ss.str());
+                }
+            }
+
+            // Undo the filter.
+            const unsigned char* x = cur.data() + 1;
+            size_t bpp = _n;
+
+            for (size_t j = 0; j < stride; ++j)
+            {
+                int a = j >= bpp ? out[j - bpp]  : 0;
+                int b = prev[j];
+                int c = j >= bpp ? prev[j - bpp] : 0;
+
+                switch (cur[0])
+                {
+                    case 0:  out[j] = x[j];                  break;
+                    case 1:  out[j] = x[j] + a;              break;
+                    case 2:  out[j] = x[j] + b;              break;
+                    case 3:  out[j] = x[j] + ((a + b) >> 1); break;
+                    case 4:  out[j] = x[j] + paeth(a, b, c); break;
+
+                    default:
+                    {
+                        stringstream ss;
+                        ss << "image at '" << _path << "' is corrupt";
+                        THROW(file, ss.str());
+                    }
+                }
+            }
+
+            prev = out;
+            fn(i, out.data());
+        }
+    }
+
+    catch (...)
+    {
+        inflateEnd(&z);
+        throw;
+    }
+
+    inflateEnd(&z);
+}
+
+void PngCodec::chunk(const char* type, const unsigned char* data, size_t size)
+{
+    unsigned char header[8], crc[4];
+    put32(header, size);
+    memcpy(header + 4, type, 4);
+
+    uLong check = crc32(0, (const Bytef*)type, 4);
+    if (size) check = crc32(check, data, size);
+    put32(crc, check);
+
+    emit(header, sizeof(header));
+    if (size) emit(data, size);
+    emit(crc, sizeof(crc));
+}
@@ -0,0 +1,98 @@
+#ifndef PNGCODEC_H
+#define PNGCODEC_H
+
+#include <string>
+#include <vector>
+#include <memory>
+
+#include <sys/types.h>
+
+#include "RowCodec.h"
+
+// Reads PNGs a row at a time, inflating the image data as it goes, and writes them a row at a time
+// to a new file, deflating as it goes. See <RowCodec.h>.
+//
+// Only 8-bit, non-interlaced images, which are greyscale, greyscale with alpha, RGB or RGBA, and
+// have no tRNS chunk. Anything else, stb_image would give back in some other form than what's in
+// the file, (say, with the palette applied), which we'd have no way to write back the same.
+//
+// The new file only has the image: any other chunks are dropped, like `stbi_write_png()` does.
+// Rewriting hides the bits and deflates the rows on every free thread of `ThreadPool::get()`, a
+// piece of the image each, so one enormous cover doesn't take one core all the time it takes.
+// Reading can't be split up like that, since every row's filter depends on the row before.
+class PngCodec : public RowCodec
+{
+    public:
+    // Opens a PNG, if it's one we can do.
+    //
+    // path: Path to the image.
+    // fd:   The image, open for reading. Belongs to the codec, if one is returned.
+    //
+    // Returns the codec, or null if it's not a PNG we can do.
+    //
+    // Throws `exc::file` if the image could not be read.
+    static std::unique_ptr<RowCodec> open(const std::string& path, int fd);
+
+    // See `RowCodec::read()`.
+    void read(const row_fn& fn);
+
+    // See `RowCodec::rewrite()`.
+    void rewrite(const row_fn& fn);
+
+    private:
+    // path, fd:  See `.open()`.
+    // x, y, n:   Dimensions of the image.
+    // colour:    See `_colour`.
+    // idat:      See `_idat`.
+    PngCodec(const std::string& path, int fd, int x, int y, int n, unsigned char colour,
+            off_t idat);
+
+    // PNG colour type, from the IHDR chunk.
+    unsigned char _colour;
+
+    // Offset of the first IDAT chunk.
+    off_t _idat;
+
+    // Rows of the image, filtered and deflated on their own for `.rewrite()`.
+    struct piece
+    {
+        piece(): raw(), size(0), adler(0), deflated() { }
+
+        // The rows, each with its filter type in front.
+        std::vector<unsigned char> raw;
+
+        // How much of `raw` is rows, and its Adler-32.
+        size_t size;
+        unsigned long adler;
+
+        // The rows, deflated.
+        std::vector<unsigned char> deflated;
+    };
+
+    // Bytes of rows in each piece, or one row, if that's bigger.
+    static const size_t PIECE = 1 << 20;
+
+    // Deflates a piece, without a zlib header or trailer.
+    //
+    // p:    The piece. `.raw` is deflated into `.deflated`.
+    // size: Bytes of `.raw` which are rows.
+    // last: Whether it's the last piece, so it should finish the stream, rather than just flushing.
+    //
+    // Throws `exc::too_big` if deflating could not start.
+    // Throws `exc::file` if the piece could not be deflated.
+    static void deflate_piece(piece& p, size_t size, bool last);
+
+    // Inflates every row, and unfilters it.
+    //
+    // fn: Called with every row, in order.
+    void decode(const row_fn& fn);
+
+    // Writes a chunk to the new file.
+    //
+    // type: Chunk type, e.g. "IDAT".
+    // data: The chunk's data.
+    // size: Size of `data`.
+    void chunk(const char* type, const unsigned char* data, size_t size);
+};
+
+#endif
@@ -0,0 +1,179 @@
+#include <string>
+#include <vector>
+#include <memory>
+#include <sstream>
+#include <algorithm>
+
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "RawCodec.h"
+#include "fs.h"
+#include "exc.h"
+
+using namespace std;
+
+namespace
+{
+
+// Roughly how many bytes of rows to go through at once.
+const size_t CHUNK = 4 << 20;
+
+uint32_t get(const unsigned char* in, size_t bytes)
+{
+    uint32_t value = 0;
+    for (size_t i = 0; i < bytes; ++i) value |= (uint32_t)in[i] << (i * 8);
+    return value;
+}
+
+// Size of a file, or 0 if we can't tell.
+off_t size_of(int fd)
+{
+    struct stat st;
+    return fstat(fd, &st) == 0 ? st.st_size : 0;
+}
+
+}
+
+unique_ptr<RowCodec> RawCodec::open_bmp(const string& path, int fd)
+{
+    unsigned char header[54];
+    if (!fs::pread_all(fd, header, sizeof(header), 0) || memcmp(header, "BM", 2)) return nullptr;
+
+    uint32_t data        = get(header + 10, 4);
+    uint32_t info        = get(header + 14, 4);
+    int32_t  x           = get(header + 18, 4);
+    int32_t  y           = get(header + 22, 4);
+    uint32_t planes      = get(header + 26, 2);
+    uint32_t bits        = get(header + 28, 2);
+    uint32_t compression = get(header + 30, 4);
+
+    // BITMAPINFOHEADER, or V4/V5, which stb_image reads the same for 24 bits.
+    if (info != 40 && info != 108 && info != 124)                return nullptr;
+    if (planes != 1 || bits != 24 || compression != 0)           return nullptr;
+    if (x <= 0 || y == 0 || x > (1 << 24) || abs(y) > (1 << 24)) return nullptr;
+
+    // Rows are padded to 4 bytes, and stored bottom to top, unless the height is negative.
+    size_t stride = ((size_t)x * 3 + 3) & ~(size_t)3;
+
+    if (size_of(fd) < (off_t)(data + stride * abs(y))) return nullptr;
+
+    return unique_ptr<RowCodec>(new RawCodec(path, fd, x, abs(y), 3, data, stride, y > 0));
+}
+
+unique_ptr<RowCodec> RawCodec::open_tga(const string& path, int fd)
+{
+    unsigned char header[18];
+    if (!fs::pread_all(fd, header, sizeof(header), 0)) return nullptr;
+
+    uint32_t id         = header[0];
+    uint32_t map        = header[1];
+    uint32_t type       = header[2];
+    uint32_t x          = get(header + 12, 2);
+    uint32_t y          = get(header + 14, 2);
+    uint32_t bits       = header[16];
+    uint32_t descriptor = header[17];
+
+    // True colour, no colour map, not stored right to left.
+    if (map || type != 2 || (bits != 24 && bits != 32) || (descriptor & 0x10)) return nullptr;
+    if (!x || !y)                                                              return nullptr;
+
+    size_t stride = (size_t)x * bits / 8;
+    off_t  data   = sizeof(header) + id;
+
+    if (size_of(fd) < (off_t)(data + stride * y)) return nullptr;
+
+    // Stored bottom to top, unless bit 5 of the descriptor is set.
+    return unique_ptr<RowCodec>
+        (new RawCodec(path, fd, x, y, bits / 8, data, stride, !(descriptor & 0x20)));
+}
+
+RawCodec::RawCodec(const string& path, int fd, int x, int y, int n, off_t data, size_t stride,
+        bool flipped):
+    RowCodec(path, fd),
+    _data(data),
+    _stride(stride),
+    _flipped(flipped)
+{
+    _x = x;
+    _y = y;
+    _n = n;
+}
+
+void RawCodec::read(const row_fn& fn) { process(fn, false, _fd); }
+
+void RawCodec::rewrite(const row_fn& fn)
+{
+    int fd = ::open(_path.c_str(), O_RDWR | O_CLOEXEC);
+
+    if (fd < 0)
+    {
+        stringstream ss;
+        ss << "could not open image at '" << _path << "' for writing: " << strerror(errno);
+        THROW(file, ss.str());
+    }
+
+    fs::fd_guard guard(fd);
+    process(fn, true, fd);
+
+    // Like `.commit()`, it has to be on the disk before anyone counts on it being there.
+    if (fsync(fd) < 0)
+    {
+        stringstream ss;
+        ss << "could not write image to '" << _path << "': " << strerror(errno);
+        THROW(file, ss.str());
+    }
+}
+
+void RawCodec::process(const row_fn& fn, bool write, int fd)
+{
+    size_t rows = max<size_t>(1, CHUNK / _stride);
+    size_t size = (size_t)_x * _n;
+
+    // The chunk as it was in the file, and as it is after `fn` has been at it.
+    vector<unsigned char> before, after;
+
+    for (size_t first = 0; first < (size_t)_y; first += rows)
+    {
+        size_t count = min(rows, (size_t)_y - first);
+        off_t  at    = _data + (off_t)(first * _stride);
+
+        after.resize(count * _stride);
+
+        if (!fs::pread_all(fd, after.data(), after.size(), at))
+        {
+            stringstream ss;
+            ss << "could not read image at '" << _path << "': " << strerror(errno);
+            THROW(file, ss.str());
+        }
+
+        if (write) before = after;
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            unsigned char* row = after.data() + i * _stride;
+
+            // The file has BGR(A), and stb_image gives RGB(A).
+            for (size_t j = 0; j < size; j += _n) swap(row[j], row[j + 2]);
+
+            fn(_flipped ? _y - 1 - (first + i) : first + i, row);
+
+            if (write) for (size_t j = 0; j < size; j += _n) swap(row[j], row[j + 2]);
+        }
+
+        // Leave chunks nobody changed well alone.
+        if (write && after != before && !fs::pwrite_all(fd, after.data(), after.size(), at))
+        {
+            stringstream ss;
+            ss << "could not write image to '" << _path << "': " << strerror(errno);
+            THROW(file, ss.str());
+        }
+    }
+}
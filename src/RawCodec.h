@@ -0,0 +1,62 @@
+#ifndef RAWCODEC_H
+#define RAWCODEC_H
+
+#include <string>
+#include <memory>
+
+#include <sys/types.h>
+
+#include "RowCodec.h"
+
+// Reads and rewrites uncompressed images, where every row is just sitting there in the file at a
+// fixed offset: 24-bit BMPs, and 24/32-bit TGAs. Rewriting is done in place, a big chunk of rows at
+// a time, and only chunks which actually changed are written back. See <RowCodec.h>.
+class RawCodec : public RowCodec
+{
+    public:
+    // Opens a BMP, if it's one we can do: uncompressed (`BI_RGB`), 24 bits per pixel.
+    //
+    // path: Path to the image.
+    // fd:   The image, open for reading. Belongs to the codec, if one is returned.
+    //
+    // Returns the codec, or null if it's not a BMP we can do.
+    //
+    // Throws `exc::file` if the image could not be read.
+    static std::unique_ptr<RowCodec> open_bmp(const std::string& path, int fd);
+
+    // Same as `.open_bmp()`, for a TGA: uncompressed, true colour, 24 or 32 bits per pixel.
+    static std::unique_ptr<RowCodec> open_tga(const std::string& path, int fd);
+
+    // See `RowCodec::read()`.
+    void read(const row_fn& fn);
+
+    // See `RowCodec::rewrite()`.
+    void rewrite(const row_fn& fn);
+
+    private:
+    // path, fd: See `.open_bmp()`.
+    // x, y, n:  Dimensions of the image.
+    // data:     See `_data`.
+    // stride:   See `_stride`.
+    // flipped:  See `_flipped`.
+    RawCodec(const std::string& path, int fd, int x, int y, int n, off_t data, size_t stride,
+            bool flipped);
+
+    // Offset of the first row in the file.
+    off_t _data;
+
+    // Bytes from the start of one row to the start of the next, including any padding.
+    size_t _stride;
+
+    // Whether the rows are stored bottom to top.
+    bool _flipped;
+
+    // Goes through every row, a chunk at a time.
+    //
+    // fn:    Called with every row.
+    // write: Whether to write back chunks which `fn` changed. If so, `fd` must be open for writing.
+    // fd:    The image.
+    void process(const row_fn& fn, bool write, int fd);
+};
+
+#endif
@@ -0,0 +1,165 @@
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <sstream>
+#include <algorithm>
+
+#include <cstring>
+#include <cerrno>
+
+#include <sys/mman.h>
+
+#include "ReadCache.h"
+#include "exc.h"
+
+using namespace std;
+
+ReadCache::ReadCache(const vector<unique_ptr<CachedFile>>& files, mutex* locks, size_t limit):
+    _files(files),
+    _locks(locks),
+    _limit(limit),
+    _buffers(new atomic<char*>[files.size()]),
+    _readers(new atomic<unsigned>[files.size()]),
+    _referenced(new atomic<bool>[files.size()]),
+    _clock(),
+    _used(0),
+    _clock_mutex()
+{
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        _buffers[i]    = nullptr;
+        _readers[i]    = 0;
+        _referenced[i] = false;
+    }
+}
+
+ReadCache::~ReadCache()
+{
+    for (size_t i = 0; i < _files.size(); ++i)
+        unmap(_buffers[i], _files[i]->capacity());
+}
+
+void ReadCache::read(size_t file, char* buf, size_t size, size_t offset)
+{
+    for (;;)
+    {
+        // Count ourselves in before looking at the buffer. `.evict()` takes the buffer away before
+        // it looks at the count, so either it sees us, and waits for us, or we see that it's gone.
+        ++_readers[file];
+        char* bytes = _buffers[file];
+
+        if (bytes)
+        {
+            memcpy(buf, bytes + offset, size);
+            _referenced[file].store(true, memory_order_relaxed);
+            --_readers[file];
+            return;
+        }
+
+        --_readers[file];
+
+        // It could be evicted again before we get back round, but that's very unlikely.
+        load(file);
+    }
+}
+
+void ReadCache::fetch(size_t file)
+{
+    if (!_buffers[file]) load(file);
+}
+
+size_t ReadCache::used() const { return _used; }
+
+void ReadCache::load(size_t file)
+{
+    {
+        lock_guard<mutex> lock(_locks[file]);
+
+        if (_buffers[file]) return;
+
+        size_t capacity = _files[file]->capacity();
+        char* bytes = map(capacity);
+
+        try { _files[file]->load(bytes); }
+
+        catch (...)
+        {
+            unmap(bytes, capacity);
+            throw;
+        }
+
+        // Whoever wanted it is about to read it, so don't let it be evicted before then.
+        _referenced[file] = true;
+        _buffers[file]    = bytes;
+        _used += capacity;
+    }
+
+    {
+        lock_guard<mutex> lock(_clock_mutex);
+        _clock.push_back(file);
+    }
+
+    if (_limit && _used > _limit) evict();
+}
+
+void ReadCache::evict()
+{
+    unique_lock<mutex> lock(_clock_mutex, try_to_lock);
+    if (!lock) return;
+
+    // Every cover gets at most one second chance, so this always comes to an end. The cover that
+    // was just loaded is at the back, so it's the last to go.
+    for (size_t turns = 2 * _clock.size(); _used > _limit && _clock.size() > 1 && turns; --turns)
+    {
+        size_t file = _clock.front();
+        _clock.pop_front();
+
+        if (_referenced[file].exchange(false, memory_order_relaxed))
+        {
+            _clock.push_back(file);
+            continue;
+        }
+
+        // Nobody new can start reading it now, but anyone who already has needs to finish.
+        char* bytes = _buffers[file].exchange(nullptr);
+        while (_readers[file]) this_thread::yield();
+
+        unmap(bytes, _files[file]->capacity());
+        _used -= _files[file]->capacity();
+    }
+}
+
+char* ReadCache::map(size_t size)
+{
+    // `mmap()` won't take 0, but a cover with no room still gets a buffer, so it counts as loaded.
+    size = max<size_t>(size, 1);
+
+    void* bytes = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (bytes == MAP_FAILED)
+    {
+        stringstream ss;
+        ss << "could not map " << size << " bytes for a cover: " << strerror(errno);
+        THROW(too_big, ss.str());
+    }
+
+    // See `Arena::grow()`. Neither of these are fatal if they fail.
+    mlock(bytes, size);
+    madvise(bytes, size, MADV_DONTDUMP);
+
+    return static_cast<char*>(bytes);
+}
+
+void ReadCache::unmap(char* bytes, size_t size)
+{
+    if (!bytes) return;
+
+    size = max<size_t>(size, 1);
+
+    explicit_bzero(bytes, size);
+    munlock(bytes, size);
+    munmap(bytes, size);
+}
@@ -0,0 +1,115 @@
+#ifndef READ_CACHE_H
+#define READ_CACHE_H
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <atomic>
+
+#include <cstddef>
+
+#include "CachedFile.h"
+
+// The hidden contents of covers, for a `Manager` which is only ever read from. With nothing to
+// write, there's nothing to keep track of: no dirty covers, nothing to sync, and nothing that can't
+// be thrown away and loaded again later. So reads don't have to lock anything, and covers don't
+// have to stay in memory once they've been loaded.
+//
+// A read of a cover which is already loaded is wait-free. It bumps the cover's count of readers,
+// copies straight out of the cover's buffer, and drops the count again. Loading a cover takes the
+// cover's lock, so that it's only loaded once, however many threads want it at the same time.
+//
+// Once the loaded covers use more than the limit, covers are evicted with the CLOCK algorithm:
+// loaded covers take turns, and each one is evicted on its turn, unless it's been read since its
+// last turn, in which case it gets another go. An evicted cover's buffer isn't freed until everyone
+// who was already reading it has finished.
+//
+// Buffers come straight from `mmap()`, not from `Arena::get()`, and are `munmap()`ed when they're
+// evicted. The arena never gives memory back to the OS, so with it, the limit would only ever stop
+// the cache from growing, never make it shrink.
+class ReadCache
+{
+    public:
+    // files: The covers. These must outlive the cache, and must all be synced.
+    // locks: One lock per cover in `files`, held while loading it.
+    // limit: Roughly how many bytes of covers to keep in memory at once. 0 means no limit.
+    ReadCache(const std::vector<std::unique_ptr<CachedFile>>& files, std::mutex* locks,
+              size_t limit);
+
+    // Frees every cover still loaded. Nobody can still be reading.
+    ~ReadCache();
+
+    ReadCache(const ReadCache& other)            = delete;
+    ReadCache& operator=(const ReadCache& other) = delete;
+
+    // Reads from one cover, loading it first if it isn't already.
+    //
+    // file:   Index of the cover.
+    // buf:    Where to copy the bytes to.
+    // size:   How many bytes to copy.
+    // offset: Where in the cover to copy from. `offset` + `size` must be <= its capacity.
+    //
+    // Throws anything `CachedFile::load()` throws.
+    // Throws anything `.map()` throws.
+    void read(size_t file, char* buf, size_t size, size_t offset);
+
+    // Loads a cover, if it isn't already, without reading from it.
+    //
+    // file: Index of the cover.
+    //
+    // Throws anything `CachedFile::load()` throws.
+    // Throws anything `.map()` throws.
+    void fetch(size_t file);
+
+    // How many bytes of covers are loaded right now.
+    size_t used() const;
+
+    private:
+    // Loads a cover, unless someone else already has.
+    void load(size_t file);
+
+    // Evicts covers until they fit within the limit again. If another thread is already at it,
+    // leaves it to them.
+    void evict();
+
+    // Gets a buffer for a cover from the OS, `mlock()`ed if we can, like the arena's slabs. Its
+    // contents are all zero.
+    //
+    // size: Size of the buffer in bytes.
+    //
+    // Returns the buffer. Give it back with `.unmap()`.
+    //
+    // Throws `exc::too_big` if we couldn't get the memory from the OS.
+    static char* map(size_t size);
+
+    // Wipes a buffer from `.map()` and gives it back to the OS.
+    //
+    // bytes: The buffer. If null, does nothing.
+    // size:  Exactly the `size` that was given to `.map()`.
+    static void unmap(char* bytes, size_t size);
+
+    const std::vector<std::unique_ptr<CachedFile>>& _files;
+    std::mutex* _locks;
+    size_t      _limit;
+
+    // The hidden contents of every cover, or null if it isn't loaded.
+    std::unique_ptr<std::atomic<char*>[]> _buffers;
+
+    // How many threads are copying out of each cover's buffer right now.
+    std::unique_ptr<std::atomic<unsigned>[]> _readers;
+
+    // Whether each cover has been read since its last turn on the clock.
+    std::unique_ptr<std::atomic<bool>[]> _referenced;
+
+    // Every loaded cover, in the order they take turns on the clock.
+    std::deque<size_t> _clock;
+
+    // Bytes of covers loaded.
+    std::atomic<size_t> _used;
+
+    // Protects `_clock`.
+    std::mutex _clock_mutex;
+};
+
+#endif
@@ -0,0 +1,190 @@
+#include <string>
+#include <vector>
+#include <memory>
+#include <sstream>
+#include <algorithm>
+
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "RowCodec.h"
+#include "PngCodec.h"
+#include "RawCodec.h"
+#include "TgaCodec.h"
+#include "fs.h"
+#include "exc.h"
+
+using namespace std;
+
+namespace
+{
+
+// Size of the buffers for `.next()` and `.emit()`.
+const size_t BUFFER = 1 << 20;
+
+}
+
+unique_ptr<RowCodec> RowCodec::open(const string& path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+    {
+        stringstream ss;
+        ss << "could not open image at '" << path << "': " << strerror(errno);
+        THROW(file, ss.str());
+    }
+
+    // Enough to recognise any of them. They each look at the rest themselves.
+    unsigned char header[18] = { 0 };
+
+    if (!fs::pread_all(fd, header, sizeof(header), 0))
+    {
+        close(fd);
+        return nullptr;
+    }
+
+    unique_ptr<RowCodec> codec;
+
+    // Same order as stb_image tries them in, for the ones we know about, so that we'd recognise an
+    // image as the same thing as it would.
+    try
+    {
+        if      (!memcmp(header, "\x89PNG\r\n\x1a\n", 8)) codec = PngCodec::open(path, fd);
+        else if (!memcmp(header, "BM", 2))                codec = RawCodec::open_bmp(path, fd);
+        else if (header[2] == 2)                          codec = RawCodec::open_tga(path, fd);
+        else if (header[2] == 10)                         codec = TgaCodec::open(path, fd);
+    }
+
+    catch (...)
+    {
+        if (!codec) close(fd);
+        throw;
+    }
+
+    if (!codec) close(fd);
+    return codec;
+}
+
+RowCodec::RowCodec(const string& path, int fd):
+    _path(path),
+    _fd(fd),
+    _x(0),
+    _y(0),
+    _n(0),
+    _in(),
+    _in_offset(0),
+    _in_pos(0),
+    _out_file(),
+    _out(),
+    _out_offset(0)
+{ }
+
+RowCodec::~RowCodec()
+{
+    abandon();
+    close(_fd);
+}
+
+int RowCodec::width()    const { return _x; }
+int RowCodec::height()   const { return _y; }
+int RowCodec::channels() const { return _n; }
+
+int RowCodec::fd() const { return _fd; }
+
+void RowCodec::seek(off_t offset)
+{
+    _in.clear();
+    _in_offset = offset;
+    _in_pos    = 0;
+}
+
+void RowCodec::next(void* buf, size_t size)
+{
+    for (size_t done = 0; done < size;)
+    {
+        if (_in_pos == _in.size())
+        {
+            _in.resize(BUFFER);
+
+            ssize_t result;
+            while ((result = pread(_fd, _in.data(), _in.size(), _in_offset)) < 0 && errno == EINTR);
+
+            if (result <= 0)
+            {
+                stringstream ss;
+                ss << "could not read image at '" << _path << "': "
+                    << (result ? strerror(errno) : "it ends too soon");
+                THROW(file, ss.str());
+            }
+
+            _in.resize(result);
+            _in_offset += result;
+            _in_pos     = 0;
+        }
+
+        size_t n = min(size - done, _in.size() - _in_pos);
+        memcpy((char*)buf + done, _in.data() + _in_pos, n);
+
+        _in_pos += n;
+        done    += n;
+    }
+}
+
+void RowCodec::begin()
+{
+    abandon();
+
+    struct stat st;
+    mode_t mode = fstat(_fd, &st) == 0 ? st.st_mode & 07777 : 0600;
+
+    _out_file.reset(new fs::replacement(_path, mode));
+
+    _out.clear();
+    _out.reserve(BUFFER);
+    _out_offset = 0;
+}
+
+void RowCodec::emit(const void* buf, size_t size)
+{
+    const unsigned char* bytes = (const unsigned char*)buf;
+
+    while (size)
+    {
+        size_t n = min(size, BUFFER - _out.size());
+        _out.insert(_out.end(), bytes, bytes + n);
+
+        bytes += n;
+        size  -= n;
+
+        if (_out.size() == BUFFER) flush();
+    }
+}
+
+void RowCodec::flush()
+{
+    if (!fs::pwrite_all(_out_file->fd(), _out.data(), _out.size(), _out_offset))
+    {
+        stringstream ss;
+        ss << "could not write image to '" << _path << "': " << strerror(errno);
+        THROW(file, ss.str());
+    }
+
+    _out_offset += _out.size();
+    _out.clear();
+}
+
+void RowCodec::commit()
+{
+    flush();
+    _out_file->commit();
+    abandon();
+}
+
+void RowCodec::abandon() { _out_file.reset(); }
@@ -0,0 +1,137 @@
+#ifndef ROWCODEC_H
+#define ROWCODEC_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+
+#include <sys/types.h>
+
+#include "fs.h"
+
+// Reads and rewrites an image one row at a time, so that only a few rows are ever in memory rather
+// than the whole decoded image. This is an abstract base class; the formats are the subclasses:
+//
+// <PngCodec.h>: 8-bit, non-interlaced PNG, without a palette. Rewritten to a new file.
+// <RawCodec.h>: Uncompressed 24-bit BMP, and uncompressed 24/32-bit TGA. Rewritten in place.
+// <TgaCodec.h>: Run-length encoded 24/32-bit TGA. Rewritten to a new file.
+//
+// Rows are handed over exactly as `stbi_load()` would have given them, (top to bottom, channels in
+// RGB(A) order, one byte each), so it doesn't matter to anyone whether an image went through here
+// or through stb_image. Anything else, `.open()` turns down, and it's up to stb_image.
+class RowCodec
+{
+    public:
+    // Called with the index of a row, (0 is the top), and the row, which is `.width()` *
+    // `.channels()` bytes, and may be changed if we're rewriting. Rows aren't necessarily in order,
+    // and when rewriting, different rows may be done on different threads at the same time.
+    typedef std::function<void(size_t, unsigned char*)> row_fn;
+
+    // Opens an image, if it's in a form that can be read and written a row at a time. The format is
+    // worked out from the contents of the file, like stb_image does, not its extension.
+    //
+    // path: Path to the image.
+    //
+    // Returns the codec, or null if the image can't be done a row at a time.
+    //
+    // Throws `exc::file` if the image at `path` could not be opened.
+    static std::unique_ptr<RowCodec> open(const std::string& path);
+
+    virtual ~RowCodec();
+
+    RowCodec(const RowCodec& other)            = delete;
+    RowCodec& operator=(const RowCodec& other) = delete;
+
+    // Dimensions of the image, as `stbi_load()` would give them.
+    int width()    const;
+    int height()   const;
+    int channels() const;
+
+    // The image, open for reading.
+    int fd() const;
+
+    // Reads every row of the image.
+    //
+    // fn: Called with every row. Changes to the row are ignored.
+    //
+    // Throws `exc::file` if the image could not be read, or is corrupt.
+    virtual void read(const row_fn& fn) = 0;
+
+    // Rewrites the image, one row at a time.
+    //
+    // fn: Called with every row, to change however it likes.
+    //
+    // Throws `exc::file` if the image could not be read, or is corrupt.
+    // Throws `exc::file` if the image could not be written.
+    virtual void rewrite(const row_fn& fn) = 0;
+
+    protected:
+    // path: Path to the image.
+    // fd:   The image, open for reading. Closed by the destructor.
+    RowCodec(const std::string& path, int fd);
+
+    // Path to the image.
+    std::string _path;
+
+    // The image, open for reading.
+    int _fd;
+
+    // Set by subclasses, see `.width()` and friends.
+    int _x, _y, _n;
+
+    // Reads the image from the start of a file, rather than from wherever `.next()` is up to.
+    //
+    // offset: Where to start from.
+    void seek(off_t offset);
+
+    // Reads the next bytes of the image, from wherever the last call left off, (or `.seek()`), a big
+    // buffer at a time.
+    //
+    // buf:  Filled with the next `size` bytes.
+    // size: How many bytes to read.
+    //
+    // Throws `exc::file` if the bytes could not be read, or the file ends first.
+    void next(void* buf, size_t size);
+
+    // Starts writing a new copy of the image, which is put in place of the old one by `.commit()`.
+    // Until then, nobody can see it.
+    //
+    // Throws `exc::file` if the new file could not be created.
+    void begin();
+
+    // Writes the next bytes of the new copy of the image, from `.begin()`, a big buffer at a time.
+    //
+    // buf:  The bytes to write.
+    // size: How many bytes to write.
+    //
+    // Throws `exc::file` if the bytes could not be written.
+    void emit(const void* buf, size_t size);
+
+    // Puts the new copy of the image from `.begin()` in place of the old one.
+    //
+    // Throws `exc::file` if the new file could not be written, or put in place.
+    void commit();
+
+    private:
+    // Buffer for `.next()`, the offset in the file of the next byte to go into it, and how far
+    // `.next()` has got through it.
+    std::vector<unsigned char> _in;
+    off_t  _in_offset;
+    size_t _in_pos;
+
+    // The new file from `.begin()`, or null.
+    std::unique_ptr<fs::replacement> _out_file;
+
+    // Buffer for `.emit()`, and the offset in the new file to write it to.
+    std::vector<unsigned char> _out;
+    off_t _out_offset;
+
+    // Writes out whatever's in `_out`.
+    void flush();
+
+    // Gets rid of the new file from `.begin()`, if there is one.
+    void abandon();
+};
+
+#endif
@@ -0,0 +1,100 @@
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <algorithm>
+
+#include "Scheduler.h"
+#include "ThreadPool.h"
+
+using namespace std;
+
+Scheduler::job::job(Scheduler& scheduler, work_class c, size_t bytes):
+    _scheduler(scheduler),
+    _class(c)
+{
+    _scheduler.begin(c, bytes);
+}
+
+Scheduler::job::~job() { _scheduler.end(_class); }
+
+Scheduler::Scheduler(): _classes(), _mutex(), _cv() { }
+
+void Scheduler::limit(work_class c, size_t jobs, size_t rate)
+{
+    {
+        lock_guard<mutex> lock(_mutex);
+        _classes[c].jobs = jobs;
+        _classes[c].rate = rate;
+    }
+
+    _cv.notify_all();
+}
+
+void Scheduler::expect(work_class c, size_t count)
+{
+    lock_guard<mutex> lock(_mutex);
+    _classes[c].waiting += count;
+}
+
+void Scheduler::begin(work_class c, size_t bytes)
+{
+    unique_lock<mutex> lock(_mutex);
+
+    for (;;)
+    {
+        clock::time_point until = clock::time_point::max();
+        if (ready(c, until)) break;
+
+        // Rather than sit on a thread that something more important could be using, lend a hand.
+        lock.unlock();
+        bool ran = c != FOREGROUND && ThreadPool::get().run_one(c);
+        lock.lock();
+
+        if (ran) continue;
+
+        if (until == clock::time_point::max()) _cv.wait(lock);
+        else                                   _cv.wait_until(lock, until);
+    }
+
+    state& s = _classes[c];
+    --s.waiting;
+    ++s.running;
+
+    // Charge the class for the job's bytes up front, so its next job waits until they're paid for.
+    if (s.rate)
+    {
+        chrono::duration<double> cost((double)bytes / s.rate);
+        s.next = max(clock::now(), s.next) + chrono::duration_cast<clock::duration>(cost);
+    }
+
+    // One less job waiting might be what someone less important was waiting for.
+    _cv.notify_all();
+}
+
+void Scheduler::end(work_class c)
+{
+    {
+        lock_guard<mutex> lock(_mutex);
+        --_classes[c].running;
+    }
+
+    _cv.notify_all();
+}
+
+bool Scheduler::ready(work_class c, clock::time_point& until) const
+{
+    const state& s = _classes[c];
+
+    if (s.jobs && s.running >= s.jobs) return false;
+
+    for (size_t more = 0; more < (size_t)c; ++more)
+        if (_classes[more].waiting) return false;
+
+    if (s.rate && clock::now() < s.next)
+    {
+        until = s.next;
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,111 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+#include <cstddef>
+
+// Decides when each job a `Manager` has for its covers gets to run, so that background work can't
+// get in the way of the user. Every job belongs to a class:
+//
+// FOREGROUND: Reading and writing covers for a request, including loading them first. Someone's
+//             waiting on this.
+// SYNC:       Syncing covers, which nobody's waiting on, (unless they're unmounting).
+// PREFETCH:   Loading covers before they're asked for, in case they're about to be. Nobody's
+//             waiting on this at all.
+//
+// A class can be limited in how many of its jobs run at once, and how many bytes of covers per
+// second it gets through. On top of that, a job doesn't start while a job of a more important class
+// is waiting to, so a request never queues up behind a flush. While a job waits, its thread runs
+// any more important tasks waiting in `ThreadPool::get()`, whose priorities are the classes, so
+// that a pool busy with background work still has threads for the foreground.
+//
+// Jobs which have already started aren't stopped, so the longest a foreground job waits for the
+// background is however long it takes to sync one cover.
+class Scheduler
+{
+    public:
+    // What a job is for. Also its priority in `ThreadPool::get()`.
+    enum work_class { FOREGROUND, SYNC, PREFETCH, CLASSES };
+
+    // Starts a job on construction, (waiting until it's allowed to), and ends it on destruction.
+    class job
+    {
+        public:
+        // See `Scheduler::begin()`.
+        job(Scheduler& scheduler, work_class c, size_t bytes);
+        ~job();
+
+        job(const job& other)            = delete;
+        job& operator=(const job& other) = delete;
+
+        private:
+        Scheduler& _scheduler;
+        work_class _class;
+    };
+
+    Scheduler();
+
+    Scheduler(const Scheduler& other)            = delete;
+    Scheduler& operator=(const Scheduler& other) = delete;
+
+    // Limits a class of jobs. There are no limits to start with.
+    //
+    // c:    The class.
+    // jobs: How many of its jobs can run at once, or 0 for no limit.
+    // rate: How many bytes of covers per second its jobs can get through between them, or 0 for no
+    //       limit.
+    void limit(work_class c, size_t jobs, size_t rate);
+
+    // Says that some jobs are about to `.begin()`, so that less important ones wait for them, even
+    // if they haven't got as far as `.begin()` yet. Every one of them has to `.begin()` eventually.
+    //
+    // c:     The class of the jobs.
+    // count: How many there are.
+    void expect(work_class c, size_t count);
+
+    // Waits until a job is allowed to start, then starts it. It had better be `.end()`ed.
+    //
+    // c:     The class of the job.
+    // bytes: How many bytes of covers it'll get through, which count against the class's rate.
+    void begin(work_class c, size_t bytes);
+
+    // Ends a job started by `.begin()`.
+    //
+    // c: The class of the job.
+    void end(work_class c);
+
+    private:
+    typedef std::chrono::steady_clock clock;
+
+    // Everything about one class.
+    struct state
+    {
+        state(): jobs(0), rate(0), running(0), waiting(0), next() { }
+
+        // See `.limit()`.
+        size_t jobs;
+        size_t rate;
+
+        // Jobs running right now, and jobs which have been `.expect()`ed or are in `.begin()`.
+        size_t running;
+        size_t waiting;
+
+        // When the class has got through its last job's bytes, going by its rate, and so when the
+        // next one can start.
+        clock::time_point next;
+    };
+
+    state _classes[CLASSES];
+
+    std::mutex _mutex;
+    std::condition_variable _cv;
+
+    // Whether a job can start right now. If it can't only because of its class's rate, sets
+    // `until` to when it can. `_mutex` must be held.
+    bool ready(work_class c, clock::time_point& until) const;
+};
+
+#endif
@@ -0,0 +1,98 @@
+#include <vector>
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include <sstream>
+
+#include "SegmentedLayout.h"
+#include "exc.h"
+
+using namespace std;
+
+SegmentedLayout::SegmentedLayout(): _segments(), _starts(1, 0), _files(1, 0) { }
+
+void SegmentedLayout::add(unique_ptr<Layout> segment, size_t files)
+{
+    _capacity += segment->capacity();
+    _starts.push_back(_capacity);
+    _files.push_back(_files.back() + files);
+    _segments.push_back(move(segment));
+}
+
+size_t SegmentedLayout::segments() const { return _segments.size(); }
+
+void SegmentedLayout::map(size_t offset, size_t size,
+        const function<void(size_t, size_t, size_t, size_t)>& fn)
+{
+    if (offset > _capacity || size > _capacity - offset)
+    {
+        stringstream ss;
+        ss << "range [" << offset << ", " << offset + size << ") must lie within `.capacity()` ("
+            << _capacity << ")";
+        THROW(arg, ss.str());
+    }
+
+    size_t s = upper_bound(_starts.begin(), _starts.end(), offset) - _starts.begin() - 1;
+
+    for (size_t done = 0; done < size; ++s)
+    {
+        size_t at  = offset + done - _starts[s];
+        size_t len = min(size - done, _starts[s + 1] - _starts[s] - at);
+        size_t first = _files[s];
+
+        _segments[s]->map(at, len, [&fn, done, first](size_t buf, size_t file, size_t file_offs,
+                size_t run)
+        { fn(done + buf, first + file, file_offs, run); });
+
+        done += len;
+    }
+}
+
+void SegmentedLayout::invert(const vector<size_t>& files, const vector<size_t*>& out)
+{
+    // Each segment is asked for all of its files at once, so it only goes over its layout once.
+    vector<vector<size_t>>  local(_segments.size());
+    vector<vector<size_t*>> local_out(_segments.size());
+
+    for (size_t k = 0; k < files.size(); ++k)
+    {
+        size_t s = segment_of(files[k]);
+        local[s].push_back(files[k] - _files[s]);
+        local_out[s].push_back(out[k]);
+    }
+
+    for (size_t s = 0; s < _segments.size(); ++s)
+    {
+        if (local[s].empty()) continue;
+
+        _segments[s]->invert(local[s], local_out[s]);
+
+        for (size_t k = 0; k < local[s].size(); ++k)
+        {
+            size_t size = _segments[s]->places(local[s][k]);
+
+            // Only the places the segment uses are filled in, but they might not all be at the
+            // start.
+            for (size_t i = 0, found = 0; found < size; ++i)
+            {
+                if (local_out[s][k][i] == NONE) continue;
+
+                local_out[s][k][i] += _starts[s];
+                ++found;
+            }
+        }
+    }
+}
+
+size_t SegmentedLayout::places(size_t file)
+{
+    size_t s = segment_of(file);
+    return _segments[s]->places(file - _files[s]);
+}
+
+size_t SegmentedLayout::block() const { return _segments.empty() ? 1 : _segments[0]->block(); }
+
+size_t SegmentedLayout::segment_of(size_t file) const
+{
+    return upper_bound(_files.begin(), _files.end(), file) - _files.begin() - 1;
+}
@@ -0,0 +1,59 @@
+#ifndef SEGMENTED_LAYOUT_H
+#define SEGMENTED_LAYOUT_H
+
+#include <vector>
+#include <memory>
+#include <functional>
+
+#include "Layout.h"
+
+// A layout made of other layouts, one after another, so that a volume can grow without anything
+// already in it moving. See <Layout.h>.
+//
+// Each segment is a layout of its own over a run of files, numbered on from the files of the
+// segment before, and holds the bytes of the volume from where the segment before left off. Adding
+// covers adds a segment on the end, with a permutation of its own, so the bytes of the segments
+// before stay exactly where they were. With just the one segment, this is the same as that segment
+// on its own.
+class SegmentedLayout : public Layout
+{
+    public:
+    SegmentedLayout();
+
+    // Adds a segment on the end.
+    //
+    // segment: The segment's layout, over the `files` files after the last segment's.
+    // files:   How many files the segment is over.
+    void add(std::unique_ptr<Layout> segment, size_t files);
+
+    // How many segments there are.
+    size_t segments() const;
+
+    // See `Layout::map()`. A range which crosses from one segment into the next is split between
+    // them.
+    void map(size_t offset, size_t size,
+            const std::function<void(size_t, size_t, size_t, size_t)>& fn);
+
+    // See `Layout::invert()`.
+    void invert(const std::vector<size_t>& files, const std::vector<size_t*>& out);
+
+    // See `Layout::places()`.
+    size_t places(size_t file);
+
+    // See `Layout::block()`. The first segment's, since they're all made with the same options.
+    size_t block() const;
+
+    private:
+    // The layout of every segment.
+    std::vector<std::unique_ptr<Layout>> _segments;
+
+    // Where each segment starts in the volume, and its first file, plus one more of each for where
+    // the last segment ends.
+    std::vector<size_t> _starts;
+    std::vector<size_t> _files;
+
+    // Which segment a file is in.
+    size_t segment_of(size_t file) const;
+};
+
+#endif
@@ -39,3 +39,10 @@ size_t Shuffler::operator[](size_t i)
 
 vector<size_t> Shuffler::get(size_t i, size_t n)
 { return vector<size_t>(_v.cbegin() + i, min(_v.cbegin() + i + n, _v.cend())); }
+
+vector<size_t> Shuffler::invert()
+{
+    vector<size_t> result(_v.size());
+    for (size_t i = 0; i < _v.size(); ++i) result[_v[i] - _min] = i;
+    return result;
+}
@@ -48,6 +48,11 @@ class Shuffler
     // Returns a `vector` of the desired values.
     std::vector<size_t> get(size_t i, size_t n);
 
+    // Works out the inverse of this `Shuffler`, i.e. for every value, the index it's at.
+    //
+    // Returns a `vector` where element `v` - (the lower bound) is the index of the value `v`.
+    std::vector<size_t> invert();
+
     private:
     // `a` or `b` from `Shuffler(size_t, size_t, size_t)`, whichever was lesser.
     size_t _min;
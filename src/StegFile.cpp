@@ -1,182 +1,415 @@
 #include <sstream>
 #include <memory>
 #include <exception>
+#include <atomic>
+#include <algorithm>
+#include <vector>
+#include <functional>
+
+#include <cstring>
+#include <cerrno>
+#include <climits>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <stb/stb_image.h>
 #include <stb/stb_image_write.h>
 
 #include "StegFile.h"
+#include "Arena.h"
+#include "RowCodec.h"
+#include "ThreadPool.h"
+#include "fs.h"
 #include "exc.h"
 #include "util.h"
 
 using namespace std;
 
-StegFile::StegFile(const std::string& path): _x(0), _y(0), _n(0), _extension()
+atomic<size_t> StegFile::_pixels_used(0);
+atomic<size_t> StegFile::_pixels_limit(0);
+
+namespace
 {
-    // TODO 3 Kind of stupid to decode the entire image just to get its size. Change this to
-    //        something more efficient?
 
-    _path  = path;
+void free_pixels(unsigned char* image) { stbi_image_free(image); }
+
+}
+
+StegFile::StegFile(const std::string& path):
+    _x(0),
+    _y(0),
+    _n(0),
+    _format(PNG),
+    _pixels(nullptr, free_pixels)
+{
+    _path  = intern(path);
     _bytes = nullptr;
 
     {
-        // Set `_extension` to everything after the dot. If there's no dot, or there's nothing after
-        // the dot, it will be empty. In which case, loading the image will fail anyway in a moment.
+        // Work out the format from everything after the dot. If there's no dot, or there's nothing
+        // after the dot, it won't match anything.
         auto dot = path.rfind(".");
-        _extension = dot == string::npos ? "" : util::upper(path.substr(dot + 1));
+        string extension = dot == string::npos ? "" : util::upper(path.substr(dot + 1));
+
+        // Check the extension now, otherwise it will only fail when we come to write. Be nice and
+        // do it sooner.
+        if      (extension == "PNG") _format = PNG;
+        else if (extension == "BMP") _format = BMP;
+        else if (extension == "TGA") _format = TGA;
+        else THROW(file, "only PNG, BMP and TGA images are supported, for now");
     }
 
-    // Check the extension now, otherwise it will only fail when we come to write. Be nice and do it
-    // sooner.
-    if (!(_extension == "PNG" || _extension == "BMP" || _extension == "TGA"))
-        THROW(file, "only PNG, BMP and TGA images are supported, for now");
+    remember();
 
-    unique_ptr<unsigned char, void(*)(unsigned char*)> image
-    (
-        stbi_load(path.c_str(), &_x, &_y, &_n, 0),
-        [](unsigned char* image){ stbi_image_free(image); }
-    );
+    // Only read the header, not the whole image. That's all we need to know the capacity, and
+    // there might be millions of these to get through before we can mount.
+    if (!stbi_info(path.c_str(), &_x, &_y, &_n))
+    {
+        stringstream ss;
+        ss << "could not open image at '" << path << "': " << stbi_failure_reason();
+        THROW(file, ss.str());
+    }
 
     // smb_image_write doesn't output the fourth channel, but smb_image will read it (but ignore
     // it.) So what happens is, when we `.sync()` once, it will be written with 3 channels, and when
     // we go to `.sync()` again, it will complain that the file has changed, because it has. To fix
     // this, I could use a different image library, but not today.
-    if (_extension == "BMP" && _n == 4)
+    if (_format == BMP && _n == 4)
         THROW(file, "4-channel BMP is not supported");
 
-    if (!image)
+    _capacity = ((size_t)_x * _y * _n) / 8;
+}
+
+StegFile::~StegFile() { forget_pixels(); }
+
+void StegFile::prepare()
+{
+    // Allocate `_bytes` if it isn't already allocated.
+    if (!_bytes) _bytes = Arena::get().allocate(_capacity);
+
+    // If we can, go through the image a row at a time, rather than decoding the whole thing.
+    if (unique_ptr<RowCodec> codec = stream())
     {
-        stringstream ss;
-        ss << "could not open image at '" << path << "': " << stbi_failure_reason();
-        THROW(file, ss.str());
+        memset(_bytes, 0, _capacity);
+        codec->read([this](size_t row, unsigned char* pixels) { extract(row, pixels); });
+        return;
     }
 
-    _capacity = (_x * _y * _n) / 8;
+    // Otherwise, load the image so we can read its bits and store them in `_bytes`. Yes, I know:
+    // the image consists of unsigned chars, but we're reading into a buffer of chars. This doesn't
+    // matter.
+    pixels_t image = load();
+
+    const unsigned char* pixels = image.get();
+
+    // For each byte in `_bytes`, look at 8 bytes in `image`, construct the resulting byte from the
+    // last bits of these, and store it in `_bytes`. A big image is split up between threads.
+    split([this, pixels](size_t start, size_t end)
+    {
+        for (size_t i = start; i < end; ++i)
+        {
+            // Location of the 8 bytes in `image` we're going to look at.
+            size_t loc = i * 8;
+
+            // Byte we're building up, to add to `_bytes` when we're done with it.
+            unsigned char byte = 0;
+
+            // For each byte in the 8 bytes starting at image[loc]...
+            for (short bit = 0; bit < 8; ++bit)
+            {
+                // If the last bit is set, add it in the right place in the byte we're building.
+                if (pixels[loc + bit] & 1)
+                    byte += 1 << bit;
+            }
+
+            // Now set the byte we built.
+            _bytes[i] = byte;
+        }
+    });
+
+    // Hang on to the image for `.sync()`, if there's room. Otherwise it's freed here, and `.sync()`
+    // has to decode it again.
+    keep_pixels(image);
 }
 
-void StegFile::prepare()
+void StegFile::sync()
 {
-    // Allocate `_bytes` if it isn't already allocated.
-    if (!_bytes)
+    // Check if we're already synced. Nothing was written, so we won't be needing the image.
+    if (synced())
     {
-        try { _bytes = new char[_capacity]; }
+        forget_pixels();
+        return;
+    }
+
+    // Likewise if everything written since put back what was there, which saves decoding and
+    // encoding the whole image just to write it out the same.
+    uint64_t hash;
+
+    if (unchanged(&hash))
+    {
+        _synced = true;
+        forget_pixels();
+        return;
+    }
+
+    // If it goes wrong part of the way, there's no knowing what's in there.
+    _hashed = false;
+
+    // If we can, go through the image a row at a time, hiding `_bytes` in each row and writing it
+    // out as we go, rather than decoding and encoding the whole thing at once.
+    unique_ptr<RowCodec> codec;
+
+    if (!_pixels && (codec = stream()))
+    {
+        // Some formats are rewritten in place, so even if it fails part of the way, whatever's in
+        // there now is ours. Others are a whole new file, so look it up again by its path.
+        try { codec->rewrite([this](size_t row, unsigned char* pixels) { embed(row, pixels); }); }
 
-        catch (const bad_alloc& e)
+        catch (...)
         {
-            stringstream ss;
-            ss << "could not allocate memory to cache '" << _path << "': " << e.what();
-            THROW(too_big, ss.str());
+            remember();
+            throw;
         }
+
+        remember();
+        _hash   = hash;
+        _hashed = true;
+        _synced = true;
+        return;
     }
 
-    // Load the image so we can read its bits and store them in `_bytes`.
-    int x, y, n;
+    // Otherwise, we load the image from the file system, unless we kept it from `.prepare()`. Then
+    // we hide `_bytes` in it and write the result.
+    pixels_t image(nullptr, free_pixels);
+
+    if (_pixels)
+    {
+        image = move(_pixels);
+        _pixels_used -= (size_t)_x * _y * _n;
+    }
 
-    // Yes, I know: the image consists of unsigned chars, but we're reading into a buffer of chars.
-    // This doesn't matter.
+    else image = load();
 
-    unique_ptr<unsigned char, void(*)(unsigned char*)> image
-    (
-        stbi_load(_path.c_str(), &x, &y, &n, 0),
-        [](unsigned char* image){ stbi_image_free(image); }
-    );
+    unsigned char* pixels = image.get();
 
-    if (!image)
+    // For every byte in `_bytes`...
+    split([this, pixels](size_t start, size_t end)
+    {
+        for (size_t i = start; i < end; ++i)
+        {
+            size_t loc = i * 8;
+
+            // ...iterate through every bit.
+            for (short bit = 0; bit < 8; ++bit)
+            {
+                // Set the last bit of the corresponding byte in `image` to the same value as this
+                // bit.
+                if (_bytes[i] & (1 << bit)) pixels[loc + bit] |= 1;
+                else                        pixels[loc + bit] &= ~1;
+            }
+        }
+    });
+
+    // Now it comes time to write this bad boy.
+    save(image.get());
+
+    _hash   = hash;
+    _hashed = true;
+    _synced = true;
+
+    // The image we just wrote is exactly what's in the file now, so if this cover gets written to
+    // again before the next `.sync()`, there's no need to decode it again then either. If it
+    // doesn't, the next `.sync()` gets rid of it.
+    keep_pixels(image);
+}
+
+void StegFile::drop()
+{
+    if (_frozen || !_synced) return;
+
+    forget_pixels();
+    CachedFile::drop();
+}
+
+void StegFile::cache_pixels(size_t limit) { _pixels_limit = limit; }
+
+StegFile::pixels_t StegFile::load()
+{
+    int fd = open_checked(O_RDONLY);
+    fs::fd_guard guard(fd);
+
+    struct stat st;
+
+    if (fstat(fd, &st) != 0)
     {
         stringstream ss;
-        ss << "could not open image at '" << _path << "': " << stbi_failure_reason();
+        ss << "could not open image at '" << path() << "': " << strerror(errno);
         THROW(file, ss.str());
     }
 
-    // Strictly speaking, the image could change as long as it stays the same size, but if that
-    // happens your whole file system is ruined anyway. Don't do that, you imbecile.
-    if (x != _x || y != _y || n != _n)
+    // stb_image can only decode from memory of up to `INT_MAX` bytes.
+    if (st.st_size > INT_MAX)
     {
         stringstream ss;
-        ss << "image at '" << _path << "' has changed";
+        ss << "image at '" << path() << "' is too big";
         THROW(file, ss.str());
     }
 
-    // For each byte in `_bytes`, look at 8 bytes in `image`, construct the resulting byte from the
-    // last bits of these, and store it in `_bytes`.
-    for (size_t i = 0; i < _capacity; ++i)
+    unique_ptr<unsigned char[]> file(new unsigned char[st.st_size]);
+
+    if (!fs::pread_all(fd, file.get(), st.st_size, 0))
     {
-        // Location of the 8 bytes in `image` we're going to look at.
-        size_t loc = i * 8;
+        stringstream ss;
+        ss << "could not read image at '" << path() << "': " << strerror(errno);
+        THROW(file, ss.str());
+    }
 
-        // Byte we're building up, to add to `_bytes` when we're done with it.
-        unsigned char byte = 0;
+    int x, y, n;
+    pixels_t image(stbi_load_from_memory(file.get(), st.st_size, &x, &y, &n, 0), free_pixels);
 
-        // For each byte in the 8 bytes starting at image[loc]...
-        for (short bit = 0; bit < 8; ++bit)
-        {
-            // If the last bit is set, add it in the right place in the byte we're building.
-            if (image.get()[loc + bit] & 1)
-                byte += 1 << bit;
-        }
+    if (!image)
+    {
+        stringstream ss;
+        ss << "could not open image at '" << path() << "': " << stbi_failure_reason();
+        THROW(file, ss.str());
+    }
 
-        // Now set the byte we built.
-        _bytes[i] = byte;
+    // The fingerprint already says it hasn't changed, but if the dimensions are wrong, something
+    // has gone very wrong, so don't make it any worse.
+    if (x != _x || y != _y || n != _n)
+    {
+        stringstream ss;
+        ss << "image at '" << path() << "' has changed";
+        THROW(file, ss.str());
     }
+
+    return image;
 }
 
-void StegFile::sync()
+void StegFile::save(const unsigned char* image)
 {
-    // Check if we're already synced.
-    if (synced()) return;
+    // stb_image_write hands us the encoded image a bit at a time. Collect it all up.
+    vector<char> encoded;
 
-    // First, we load the image from the file system. Then we hide `_bytes` in it and write the
-    // result.
-    int x, y, n;
+    stbi_write_func* append = [](void* context, void* data, int size)
+    {
+        vector<char>& encoded = *(vector<char>*)context;
+        encoded.insert(encoded.end(), (char*)data, (char*)data + size);
+    };
+
+    int result = 0;
 
-    unique_ptr<unsigned char, void(*)(unsigned char*)> image
-    (
-        stbi_load(_path.c_str(), &x, &y, &n, 0),
-        [](unsigned char* image){ stbi_image_free(image); }
-    );
+    if (_format == PNG)
+        result = stbi_write_png_to_func(append, &encoded, _x, _y, _n, image, _x * _n);
+    else if (_format == BMP)
+        result = stbi_write_bmp_to_func(append, &encoded, _x, _y, _n, image);
+    else if (_format == TGA)
+        result = stbi_write_tga_to_func(append, &encoded, _x, _y, _n, image);
 
-    if (!image)
+    if (!result)
     {
         stringstream ss;
-        ss << "could not open image at '" << _path << "': " << stbi_failure_reason();
+        ss << "could not write image to '" << path() << "'";
         THROW(file, ss.str());
     }
 
-    if (x != _x || y != _y || n != _n)
+    // Only replace it once we know it's still the one we read, so that if it's changed, we
+    // haven't touched it.
+    int fd = open_checked(O_RDONLY);
+    fs::fd_guard guard(fd);
+
+    struct stat st;
+    mode_t mode = fstat(fd, &st) == 0 ? st.st_mode & 07777 : 0600;
+
+    // Never rewrite it in place: if we died half way through, the image couldn't be decoded, and
+    // every other byte hidden in it would be gone, which no journal could bring back. Like
+    // `RowCodec`, write a whole new copy, and swap it in once it's on the disk.
+    fs::replacement copy(path(), mode);
+
+    if (!fs::pwrite_all(copy.fd(), encoded.data(), encoded.size(), 0))
     {
         stringstream ss;
-        ss << "image at '" << _path << "' has changed";
+        ss << "could not write image to '" << path() << "': " << strerror(errno);
         THROW(file, ss.str());
     }
 
-    // For every byte in `_bytes`...
-    for (size_t i = 0; i < _capacity; ++i)
-    {
-        size_t loc = i * 8;
+    // If it got as far as the rename, the new image is ours, even if something failed after.
+    try { copy.commit(); }
 
-        // ...iterate through every bit.
-        for (short bit = 0; bit < 8; ++bit)
-        {
-            // Set the last bit of the corresponding byte in `image` to the same value as this bit.
-            if (_bytes[i] & (1 << bit)) image.get()[loc + bit] |= 1;
-            else                        image.get()[loc + bit] &= ~1;
-        }
+    catch (...)
+    {
+        remember();
+        throw;
     }
 
-    // Now it comes time to write this bad boy.
-    int result = 0;
+    remember();
+}
+
+unique_ptr<RowCodec> StegFile::stream()
+{
+    // If there's room to keep the decoded image for later, it's worth decoding it all at once.
+    if (_pixels_used + (size_t)_x * _y * _n <= _pixels_limit) return nullptr;
 
-    if (_extension == "PNG")
-        result = stbi_write_png(_path.c_str(), _x, _y, _n, image.get(), _x * _n);
-    else if (_extension == "BMP")
-        result = stbi_write_bmp(_path.c_str(), _x, _y, _n, image.get());
-    else if (_extension == "TGA")
-        result = stbi_write_tga(_path.c_str(), _x, _y, _n, image.get());
+    unique_ptr<RowCodec> codec = RowCodec::open(path());
 
-    if (!result)
+    if (codec) check(codec->fd());
+
+    if (codec && (codec->width() != _x || codec->height() != _y || codec->channels() != _n))
     {
         stringstream ss;
-        ss << "could not write image to '" << _path << "'";
+        ss << "image at '" << path() << "' has changed";
         THROW(file, ss.str());
     }
+
+    return codec;
+}
+
+void StegFile::extract(size_t row, const unsigned char* pixels)
+{
+    // Bit `i` of `_bytes` is in the last bit of byte `i` of the image, same as in `.prepare()`.
+    size_t first = row * _x * _n;
+    size_t last  = min(first + (size_t)_x * _n, _capacity * 8);
+
+    for (size_t bit = first; bit < last; ++bit)
+        _bytes[bit / 8] |= (pixels[bit - first] & 1) << (bit % 8);
+}
+
+void StegFile::embed(size_t row, unsigned char* pixels)
+{
+    size_t first = row * _x * _n;
+    size_t last  = min(first + (size_t)_x * _n, _capacity * 8);
+
+    for (size_t bit = first; bit < last; ++bit)
+        pixels[bit - first] = (pixels[bit - first] & ~1) | ((_bytes[bit / 8] >> (bit % 8)) & 1);
+}
+
+void StegFile::split(const function<void(size_t, size_t)>& fn) const
+{
+    size_t pieces = (_capacity + PIECE - 1) / PIECE;
+
+    // Spare workers only: whoever called us is busy with something, and keeps going on its own if
+    // nobody's free to help.
+    ThreadPool::get().parallel(pieces, [this, &fn](size_t i)
+    { fn(i * PIECE, min(_capacity, (i + 1) * PIECE)); }, ThreadPool::PRIORITIES - 1);
+}
+
+void StegFile::keep_pixels(pixels_t& image)
+{
+    size_t size = (size_t)_x * _y * _n;
+
+    for (size_t used = _pixels_used; !_pixels && used + size <= _pixels_limit;)
+    {
+        if (_pixels_used.compare_exchange_weak(used, used + size))
+            _pixels = move(image);
+    }
+}
+
+void StegFile::forget_pixels()
+{
+    if (!_pixels) return;
+
+    _pixels.reset();
+    _pixels_used -= (size_t)_x * _y * _n;
 }
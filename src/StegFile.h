@@ -3,8 +3,12 @@
 
 #include <string>
 #include <vector>
+#include <memory>
+#include <atomic>
+#include <functional>
 
 #include "CachedFile.h"
+#include "RowCodec.h"
 
 // This is where the magic happens. Introducing `StegFile`: where the steganography actually goes
 // down. Like `CachedFile`, which it derives from, it caches file contents in memory upon calling
@@ -29,12 +33,15 @@ class StegFile : public CachedFile
     // Throws `exc::file` if the image at `path` could not be read.
     StegFile(const std::string& path);
 
-    // Move constructors, so we can push `StegFile`s back to a vector without shenanigans.
-    StegFile(StegFile&& other)      = default;
-    StegFile& operator=(StegFile&&) = default;
+    // Frees the decoded image, if we kept one, and gives its room back to the budget of
+    // `.cache_pixels()`, so that covers which go away don't use it up for good.
+    ~StegFile();
 
     // Delete these just in case. We deleted them in `CachedFile`, but g++ complains if we don't do
-    // it again, thanks to -Weffc++.
+    // it again, thanks to -Weffc++. (A move would also hand the decoded image's share of
+    // `.cache_pixels()` back twice, once for each `StegFile`.)
+    StegFile(StegFile&& other)                 = delete;
+    StegFile& operator=(StegFile&& other)      = delete;
     StegFile(const StegFile& other)            = delete;
     StegFile& operator=(const StegFile& other) = delete;
 
@@ -46,7 +53,85 @@ class StegFile : public CachedFile
     //        `StegFile` was created.
     void sync();
 
+    // See `CachedFile::drop()`. Also gets rid of the decoded image, if we kept it.
+    void drop();
+
+    // Lets `StegFile`s keep the decoded image from `.prepare()` around until `.sync()`, so it
+    // doesn't have to be decoded all over again there, and after `.sync()`, in case the cover is
+    // written to again. A cover which isn't written to between two `.sync()`s loses its image.
+    // Every `StegFile` shares the same budget; once it's used up, `.sync()` just decodes the image
+    // again, like it does by default.
+    //
+    // limit: How many bytes of decoded images all the `StegFile`s can keep between them. 0, the
+    //        default, means none.
+    static void cache_pixels(size_t limit);
+
     private:
+    // A decoded image, from `stbi_load_from_memory()`.
+    typedef std::unique_ptr<unsigned char, void(*)(unsigned char*)> pixels_t;
+
+    // Decodes the image at `.path()`. The whole file is read into memory through `IoEngine::get()`
+    // first, and decoded from there, rather than letting stb_image read it with stdio.
+    //
+    // Returns the decoded image.
+    //
+    // Throws `exc::file` if the image at `.path()` could not be read.
+    // Throws `exc::file` if the image at `.path()` has changed in the file system since the
+    //        `StegFile` was created.
+    pixels_t load();
+
+    // Encodes an image into memory, and writes it through `IoEngine::get()`, rather than letting
+    // stb_image_write write it with stdio, to a new copy that replaces the one at `.path()`. See
+    // `fs::replacement`.
+    //
+    // image: The image to write. Must be `_x` by `_y` with `_n` channels.
+    //
+    // Throws `exc::file` if the image could not be encoded, or written to `.path()`.
+    void save(const unsigned char* image);
+
+    // Opens the image to go through a row at a time, if it's in a format where we can, and there
+    // isn't room to keep the whole decoded image for later anyway. See <RowCodec.h>.
+    //
+    // Returns the codec, or null if the whole image should be decoded with stb_image instead.
+    //
+    // Throws anything `RowCodec::open()` throws.
+    // Throws anything `CachedFile::check()` throws.
+    // Throws `exc::file` if the image at `.path()` has changed in the file system since the
+    //        `StegFile` was created.
+    std::unique_ptr<RowCodec> stream();
+
+    // Extracts the hidden bits from one row of the image into `_bytes`, which must start off as
+    // zeros.
+    //
+    // row:    Index of the row, 0 being the top.
+    // pixels: The row, `_x` * `_n` bytes.
+    void extract(size_t row, const unsigned char* pixels);
+
+    // Hides the bits of `_bytes` which belong in one row of the image.
+    //
+    // row:    Index of the row, 0 being the top.
+    // pixels: The row, `_x` * `_n` bytes.
+    void embed(size_t row, unsigned char* pixels);
+
+    // Bytes of `_bytes` in each piece for `.split()`, (so eight times as many bytes of image).
+    static const size_t PIECE = 1 << 20;
+
+    // Splits `_bytes` into pieces of `PIECE` bytes, and calls `fn` with each, on as many threads
+    // from `ThreadPool::get()` as are free, so that one huge image doesn't take one core all the
+    // time it takes. An image of less than a piece is done on the calling thread.
+    //
+    // fn: Called with the start and end of every piece, in no particular order.
+    void split(const std::function<void(size_t, size_t)>& fn) const;
+
+    // Keeps a decoded image as `_pixels`, if there's room left in the budget. Otherwise, leaves it
+    // alone.
+    //
+    // image: The decoded image. Moved from if it was kept.
+    void keep_pixels(pixels_t& image);
+
+    // Gets rid of `_pixels`, if we have it, and gives its share of the budget back.
+    void forget_pixels();
+
     // Loads the contents of the image from the file system and extracts the hidden data from it,
     // saving it in `_bytes`. See `CachedFile::prepare()`. This method does NOT call
     // `CachedFile::prepare()`, but it behaves similarly.
@@ -56,13 +141,21 @@ class StegFile : public CachedFile
     //        `StegFile` was created.
     void prepare();
 
-    // Image dimensions when reading the image, sued to determine whether image has been changed in
-    // the file system by something other than ourselves. (And to know what size to write the image
-    // at, since the image data is just stored as a 1-dimensional block.)
+    // Image dimensions when reading the image, to know what size to write the image at, since the
+    // image data is just stored as a 1-dimensional block. (Also a last line of defence against the
+    // image changing behind our back, if the fingerprint somehow missed it. See <CachedFile.h>.)
     int _x, _y, _n;
 
-    // File extension of the input image, so we know what format to save it as.
-    std::string _extension;
+    // Format of the input image, going by its extension, so we know what format to save it as.
+    enum : char { PNG, BMP, TGA } _format;
+
+    // The decoded image, kept from `.prepare()` for `.sync()` if there was room in the budget, or
+    // null. See `.cache_pixels()`.
+    pixels_t _pixels;
+
+    // Bytes of decoded images kept by every `StegFile`, and how many they're allowed.
+    static std::atomic<size_t> _pixels_used;
+    static std::atomic<size_t> _pixels_limit;
 };
 
 #endif
@@ -0,0 +1,105 @@
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <sstream>
+
+#include "StripeLayout.h"
+#include "exc.h"
+
+using namespace std;
+
+StripeLayout::StripeLayout(const vector<size_t>& capacities, const string& seed, size_t block,
+        size_t covers):
+    _block(block),
+    _chunk(0),
+    _capacities(capacities),
+    _cum_chunks(),
+    _search(),
+    _shuffler(0, 0, ""),
+    _places()
+{
+    if (!block || !covers || block % covers)
+    {
+        stringstream ss;
+        ss << "block size (" << block << ") must be a non-zero multiple of the number of covers "
+            "per block (" << covers << ")";
+        THROW(config, ss.str());
+    }
+
+    _chunk = block / covers;
+
+    for (size_t capacity : capacities)
+        _cum_chunks.push_back((_cum_chunks.empty() ? 0 : _cum_chunks.back()) + capacity / _chunk);
+
+    size_t chunks = _cum_chunks.empty() ? 0 : _cum_chunks.back();
+    _search = Eytzinger(_cum_chunks);
+
+    _capacity = chunks / covers * block;
+    _shuffler = Shuffler(0, chunks, seed);
+
+    // Only the chunks at the positions which make whole blocks are used.
+    _places.assign(_cum_chunks.size(), 0);
+
+    for (size_t pos = 0; pos < _capacity / _chunk; ++pos)
+        _places[file_of(_shuffler[pos])] += _chunk;
+}
+
+void StripeLayout::map(size_t offset, size_t size,
+        const function<void(size_t, size_t, size_t, size_t)>& fn)
+{
+    if (offset > _capacity || size > _capacity - offset)
+    {
+        stringstream ss;
+        ss << "range [" << offset << ", " << offset + size << ") must lie within `.capacity()` ("
+            << _capacity << ")";
+        THROW(arg, ss.str());
+    }
+
+    for (size_t done = 0; done < size;)
+    {
+        size_t pos   = (offset + done) / _chunk;
+        size_t skip  = (offset + done) % _chunk;
+        size_t chunk = _shuffler[pos];
+        size_t file  = file_of(chunk);
+        size_t len   = min(_chunk - skip, size - done);
+
+        fn(done, file, start_of(file, chunk) + skip, len);
+        done += len;
+    }
+}
+
+void StripeLayout::invert(const vector<size_t>& files, const vector<size_t*>& out)
+{
+    // Where each file's places go, or null if it isn't wanted. Anything no used position lands
+    // on, (including the bytes after the last whole chunk), stays `NONE`.
+    vector<size_t*> dest(_cum_chunks.size(), nullptr);
+
+    for (size_t k = 0; k < files.size(); ++k)
+    {
+        dest[files[k]] = out[k];
+        fill(out[k], out[k] + _capacities[files[k]], NONE);
+    }
+
+    for (size_t pos = 0; pos < _capacity / _chunk; ++pos)
+    {
+        size_t chunk = _shuffler[pos];
+        size_t file  = file_of(chunk);
+
+        if (!dest[file]) continue;
+
+        size_t* at = dest[file] + start_of(file, chunk);
+        for (size_t j = 0; j < _chunk; ++j) at[j] = pos * _chunk + j;
+    }
+}
+
+size_t StripeLayout::places(size_t file) { return _places[file]; }
+
+size_t StripeLayout::block() const { return _block; }
+
+size_t StripeLayout::file_of(size_t chunk) const { return _search.upper_bound(chunk); }
+
+size_t StripeLayout::start_of(size_t file, size_t chunk) const
+{
+    return (chunk - (file ? _cum_chunks[file - 1] : 0)) * _chunk;
+}
@@ -0,0 +1,77 @@
+#ifndef STRIPE_LAYOUT_H
+#define STRIPE_LAYOUT_H
+
+#include <string>
+#include <vector>
+#include <functional>
+
+#include "Layout.h"
+#include "Shuffler.h"
+#include "Eytzinger.h"
+
+// A layout which keeps each block of the volume within a few covers. See <Layout.h>.
+//
+// Every file is cut up into chunks of `block` / `covers` bytes, and all the chunks of all the files
+// are shuffled together, by seed. Block `n` of the volume is then the `covers` chunks at positions
+// `n` * `covers` onwards in the shuffled order. So a block still lands somewhere random, but in at
+// most `covers` covers, rather than one per byte, and a small write dirties only that many. Sync
+// then only has to re-encode covers which actually had something written to them.
+//
+// Any bytes at the end of a file which don't make a whole chunk are left unused, as are the last
+// few chunks if there aren't enough to make a whole block.
+class StripeLayout : public Layout
+{
+    public:
+    // `StripeLayout` constructor.
+    //
+    // capacities: Capacity of each file.
+    // seed:       Source of randomness. Same seed = same layout.
+    // block:      Size of a block in bytes.
+    // covers:     Most covers any one block is spread across. Must divide `block`.
+    //
+    // Throws `exc::config` if `block` or `covers` is 0, or `covers` doesn't divide `block`.
+    StripeLayout(const std::vector<size_t>& capacities, const std::string& seed, size_t block,
+            size_t covers);
+
+    // See `Layout::map()`.
+    void map(size_t offset, size_t size,
+            const std::function<void(size_t, size_t, size_t, size_t)>& fn);
+
+    // See `Layout::invert()`. Like `ByteLayout`'s, every chunk is looked up, however few files
+    // there are.
+    void invert(const std::vector<size_t>& files, const std::vector<size_t*>& out);
+
+    // See `Layout::places()`.
+    size_t places(size_t file);
+
+    // See `Layout::block()`.
+    size_t block() const;
+
+    private:
+    // Size of a block, and of a chunk, in bytes.
+    size_t _block;
+    size_t _chunk;
+
+    // Capacity of each file.
+    std::vector<size_t> _capacities;
+
+    // Cumulative number of chunks in each file, so the first chunk of file `i` is chunk
+    // `_cum_chunks[i - 1]`.
+    std::vector<size_t> _cum_chunks;
+
+    // `_cum_chunks`, for finding which file a chunk is in.
+    Eytzinger _search;
+
+    // Shuffles the chunks. Position `i` in the volume is chunk `_shuffler[i]`.
+    Shuffler _shuffler;
+
+    // See `.places()`. Worked out up front, since leftover chunks which don't make a whole block
+    // could be anywhere.
+    std::vector<size_t> _places;
+
+    // Which file a chunk is in, and where it starts in that file.
+    size_t file_of(size_t chunk) const;
+    size_t start_of(size_t file, size_t chunk) const;
+};
+
+#endif
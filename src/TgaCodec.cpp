@@ -0,0 +1,167 @@
+#include <string>
+#include <vector>
+#include <memory>
+#include <sstream>
+#include <algorithm>
+
+#include <cstring>
+#include <cstdint>
+
+#include "TgaCodec.h"
+#include "fs.h"
+#include "exc.h"
+
+using namespace std;
+
+namespace
+{
+
+// Most pixels in one packet.
+const size_t PACKET = 128;
+
+}
+
+unique_ptr<RowCodec> TgaCodec::open(const string& path, int fd)
+{
+    unsigned char header[18];
+    if (!fs::pread_all(fd, header, sizeof(header), 0)) return nullptr;
+
+    size_t id         = header[0];
+    size_t map        = header[1];
+    size_t type       = header[2];
+    size_t x          = header[12] | header[13] << 8;
+    size_t y          = header[14] | header[15] << 8;
+    size_t bits       = header[16];
+    size_t descriptor = header[17];
+
+    // True colour, run-length encoded, no colour map, not stored right to left.
+    if (map || type != 10 || (bits != 24 && bits != 32) || (descriptor & 0x10)) return nullptr;
+    if (!x || !y)                                                               return nullptr;
+
+    return unique_ptr<RowCodec>
+        (new TgaCodec(path, fd, x, y, bits / 8, sizeof(header) + id, descriptor));
+}
+
+TgaCodec::TgaCodec(const string& path, int fd, int x, int y, int n, off_t data,
+        unsigned char descriptor):
+    RowCodec(path, fd),
+    _data(data),
+    _descriptor(descriptor)
+{
+    _x = x;
+    _y = y;
+    _n = n;
+}
+
+void TgaCodec::read(const row_fn& fn) { decode(fn); }
+
+void TgaCodec::rewrite(const row_fn& fn)
+{
+    begin();
+
+    // Same as the original header, but with no image ID, and nothing in the descriptor other than
+    // which way up it is and how many bits of alpha there are.
+    unsigned char header[18] = { 0 };
+    header[2]  = 10;
+    header[12] = _x;
+    header[13] = _x >> 8;
+    header[14] = _y;
+    header[15] = _y >> 8;
+    header[16] = _n * 8;
+    header[17] = _descriptor & 0x2f;
+    emit(header, sizeof(header));
+
+    size_t n = _n;
+    vector<unsigned char> out;
+
+    decode([&](size_t i, unsigned char* row)
+    {
+        fn(i, row);
+
+        // Back to BGR(A).
+        for (size_t j = 0; j < (size_t)_x * n; j += n) swap(row[j], row[j + 2]);
+
+        // Packets never cross rows, same as `stbi_write_tga()`. A run of 2 or more of the same pixel
+        // goes in a run-length packet, and anything else in a raw packet.
+        out.clear();
+
+        for (size_t j = 0; j < (size_t)_x;)
+        {
+            size_t run = 1;
+
+            while (j + run < (size_t)_x && run < PACKET
+                    && !memcmp(row + j * n, row + (j + run) * n, n))
+                ++run;
+
+            if (run > 1)
+            {
+                out.push_back(0x80 | (run - 1));
+                out.insert(out.end(), row + j * n, row + (j + 1) * n);
+                j += run;
+                continue;
+            }
+
+            // Raw until the next run starts.
+            size_t raw = 1;
+
+            while (j + raw < (size_t)_x && raw < PACKET
+                    && !(j + raw + 1 < (size_t)_x
+                        && !memcmp(row + (j + raw) * n, row + (j + raw + 1) * n, n)))
+                ++raw;
+
+            out.push_back(raw - 1);
+            out.insert(out.end(), row + j * n, row + (j + raw) * n);
+            j += raw;
+        }
+
+        emit(out.data(), out.size());
+    });
+
+    commit();
+}
+
+void TgaCodec::decode(const row_fn& fn)
+{
+    size_t n = _n;
+    vector<unsigned char> row((size_t)_x * n);
+
+    // What's left of the packet we're on, since they can carry on from one row to the next: how
+    // many pixels, whether they're all the same pixel, and that pixel.
+    size_t left = 0;
+    bool   same = false;
+    unsigned char pixel[4];
+
+    seek(_data);
+
+    for (size_t i = 0; i < (size_t)_y; ++i)
+    {
+        for (size_t j = 0; j < (size_t)_x;)
+        {
+            if (!left)
+            {
+                unsigned char header;
+                next(&header, 1);
+
+                left = (header & 0x7f) + 1;
+                same = header & 0x80;
+
+                if (same) next(pixel, n);
+            }
+
+            size_t count = min(left, (size_t)_x - j);
+
+            if (same)
+                for (size_t k = 0; k < count; ++k) memcpy(row.data() + (j + k) * n, pixel, n);
+            else
+                next(row.data() + j * n, count * n);
+
+            left -= count;
+            j    += count;
+        }
+
+        // The file has BGR(A), and stb_image gives RGB(A).
+        for (size_t j = 0; j < row.size(); j += n) swap(row[j], row[j + 2]);
+
+        fn(_descriptor & 0x20 ? i : _y - 1 - i, row.data());
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef TGACODEC_H
+#define TGACODEC_H
+
+#include <string>
+#include <memory>
+
+#include <sys/types.h>
+
+#include "RowCodec.h"
+
+// Reads run-length encoded TGAs a row at a time, and writes them a row at a time to a new file,
+// run-length encoding them again. Only true colour, 24 or 32 bits per pixel. This is what
+// `stbi_write_tga()` writes, so it's what TGA covers end up as after their first sync, whatever
+// they started as. See <RowCodec.h>.
+class TgaCodec : public RowCodec
+{
+    public:
+    // Opens a TGA, if it's one we can do.
+    //
+    // path: Path to the image.
+    // fd:   The image, open for reading. Belongs to the codec, if one is returned.
+    //
+    // Returns the codec, or null if it's not a TGA we can do.
+    //
+    // Throws `exc::file` if the image could not be read.
+    static std::unique_ptr<RowCodec> open(const std::string& path, int fd);
+
+    // See `RowCodec::read()`.
+    void read(const row_fn& fn);
+
+    // See `RowCodec::rewrite()`.
+    void rewrite(const row_fn& fn);
+
+    private:
+    // path, fd:   See `.open()`.
+    // x, y, n:    Dimensions of the image.
+    // data:       See `_data`.
+    // descriptor: See `_descriptor`.
+    TgaCodec(const std::string& path, int fd, int x, int y, int n, off_t data,
+            unsigned char descriptor);
+
+    // Offset of the first packet in the file.
+    off_t _data;
+
+    // Image descriptor byte from the header. Bit 5 is set if the rows are stored top to bottom.
+    unsigned char _descriptor;
+
+    // Decodes every row, in the order they're stored.
+    //
+    // fn: Called with every row.
+    void decode(const row_fn& fn);
+};
+
+#endif
@@ -0,0 +1,262 @@
+#include <vector>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <algorithm>
+#include <memory>
+#include <atomic>
+#include <exception>
+
+#include <pthread.h>
+
+#include "ThreadPool.h"
+
+using namespace std;
+
+ThreadPool& ThreadPool::get()
+{
+    static ThreadPool pool;
+    return pool;
+}
+
+ThreadPool::ThreadPool(size_t threads):
+    _size(threads ? threads : max(thread::hardware_concurrency(), 1u)),
+    _threads(),
+    _tasks(),
+    _stop(false),
+    _mutex(),
+    _cv()
+{
+    lock_guard<mutex> lock(pools_mutex());
+    pools().push_back(this);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        lock_guard<mutex> lock(pools_mutex());
+        pools().erase(find(pools().begin(), pools().end(), this));
+    }
+
+    stop();
+}
+
+size_t ThreadPool::size() const { return _size; }
+
+future<void> ThreadPool::submit(function<void()> task, size_t priority)
+{
+    packaged_task<void()> packaged(move(task));
+    future<void> result = packaged.get_future();
+
+    {
+        lock_guard<mutex> lock(_mutex);
+        if (_threads.empty()) start();
+        _tasks[min(priority, PRIORITIES - 1)].push(move(packaged));
+    }
+
+    _cv.notify_one();
+    return result;
+}
+
+bool ThreadPool::run_one(size_t priority)
+{
+    packaged_task<void()> task;
+
+    {
+        lock_guard<mutex> lock(_mutex);
+
+        size_t queue = next();
+        if (queue >= priority) return false;
+
+        task = move(_tasks[queue].front());
+        _tasks[queue].pop();
+    }
+
+    task();
+    return true;
+}
+
+void ThreadPool::crew(size_t helpers, const function<void()>& work, size_t priority)
+{
+    struct state
+    {
+        state(): m(), cv(), active(0), closed(false) { }
+
+        mutex m;
+        condition_variable cv;
+
+        // Helpers running `work`, and whether it's too late for any more to start.
+        size_t active;
+        bool   closed;
+    };
+
+    auto s = make_shared<state>();
+
+    for (size_t i = 0; i < min(helpers, _size); ++i)
+        submit([s, &work]()
+        {
+            {
+                lock_guard<mutex> lock(s->m);
+                if (s->closed) return;
+                ++s->active;
+            }
+
+            work();
+
+            lock_guard<mutex> lock(s->m);
+            --s->active;
+            s->cv.notify_all();
+        }, priority);
+
+    work();
+
+    unique_lock<mutex> lock(s->m);
+    s->closed = true;
+    s->cv.wait(lock, [&s]() { return !s->active; });
+}
+
+void ThreadPool::parallel(size_t count, const function<void(size_t)>& fn, size_t priority)
+{
+    // Next index for somebody to pick up. Every thread keeps taking indices until there are none
+    // left, so that one slow one doesn't hold up the others.
+    atomic<size_t> next(0);
+    exception_ptr error;
+    mutex m;
+
+    auto work = [&fn, &next, &error, &m, count]()
+    {
+        for (size_t i; (i = next++) < count;)
+        {
+            try { fn(i); }
+
+            catch (...)
+            {
+                lock_guard<mutex> lock(m);
+                if (!error) error = current_exception();
+            }
+        }
+    };
+
+    if (!count) return;
+
+    // Not worth the bother for just one.
+    crew(count == 1 ? 0 : count - 1, work, priority);
+
+    if (error) rethrow_exception(error);
+}
+
+void ThreadPool::start()
+{
+    _stop = false;
+
+    for (size_t i = 0; i < _size; ++i)
+        _threads.emplace_back(&ThreadPool::work, this);
+}
+
+void ThreadPool::stop()
+{
+    vector<thread> threads;
+
+    {
+        lock_guard<mutex> lock(_mutex);
+        _stop = true;
+        threads.swap(_threads);
+    }
+
+    _cv.notify_all();
+    for (thread& t : threads) t.join();
+}
+
+void ThreadPool::work()
+{
+    for (;;)
+    {
+        packaged_task<void()> task;
+
+        {
+            unique_lock<mutex> lock(_mutex);
+            _cv.wait(lock, [this]() { return _stop || next() < PRIORITIES; });
+
+            size_t queue = next();
+            if (queue == PRIORITIES) return;
+
+            task = move(_tasks[queue].front());
+            _tasks[queue].pop();
+        }
+
+        task();
+    }
+}
+
+size_t ThreadPool::next() const
+{
+    size_t queue = 0;
+    while (queue < PRIORITIES && _tasks[queue].empty()) ++queue;
+    return queue;
+}
+
+void ThreadPool::handle_forks()
+{
+    static once_flag once;
+    call_once(once, []() { pthread_atfork(&before_fork, &after_fork_parent, &after_fork_child); });
+}
+
+void ThreadPool::at_fork(void (*before)(), void (*parent)(), void (*child)())
+{
+    lock_guard<mutex> lock(pools_mutex());
+    handlers().push_back({ before, parent, child });
+}
+
+void ThreadPool::before_fork()
+{
+    pools_mutex().lock();
+
+    // The workers have to be done before anything they might be using is locked, or they'd never
+    // finish.
+    for (ThreadPool* pool : pools()) pool->stop();
+    for (const fork_handlers& h : handlers()) h.before();
+}
+
+void ThreadPool::after_fork_parent()
+{
+    for (auto h = handlers().rbegin(); h != handlers().rend(); ++h) h->parent();
+    restart();
+}
+
+void ThreadPool::after_fork_child()
+{
+    for (auto h = handlers().rbegin(); h != handlers().rend(); ++h) h->child();
+    restart();
+}
+
+void ThreadPool::restart()
+{
+    for (ThreadPool* pool : pools())
+    {
+        lock_guard<mutex> lock(pool->_mutex);
+        if (pool->next() < PRIORITIES) pool->start();
+    }
+
+    pools_mutex().unlock();
+}
+
+vector<ThreadPool*>& ThreadPool::pools()
+{
+    static vector<ThreadPool*> pools;
+    return pools;
+}
+
+vector<ThreadPool::fork_handlers>& ThreadPool::handlers()
+{
+    static vector<fork_handlers> handlers;
+    return handlers;
+}
+
+mutex& ThreadPool::pools_mutex()
+{
+    static mutex m;
+    return m;
+}
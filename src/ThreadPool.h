@@ -0,0 +1,158 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <vector>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+
+// A fixed number of worker threads which run tasks from a queue. Used to spread the work of a
+// single request across all the covers it touches, rather than starting a thread for each one.
+//
+// Tasks have a priority, from 0, the most urgent, to `PRIORITIES` - 1. A worker always takes the
+// most urgent task waiting, and tasks of the same priority run in the order they were submitted.
+// See <Scheduler.h> for what the priorities are used for.
+//
+// Threads are started by the first `.submit()`, not by the constructor, and, after
+// `.handle_forks()`, are stopped just before the process `fork()`s, then started again when
+// there's work to do. That's because FUSE forks into the background after we've already been set
+// up, and threads don't survive a `fork()`: if we didn't do this, the child would be left waiting
+// on workers which don't exist.
+class ThreadPool
+{
+    public:
+    // The pool that everything shares, with one thread per core.
+    static ThreadPool& get();
+
+    // threads: Number of worker threads. If 0, uses one per core.
+    ThreadPool(size_t threads = 0);
+
+    // Runs whatever's left in the queue, then stops the workers.
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool& other)            = delete;
+    ThreadPool& operator=(const ThreadPool& other) = delete;
+
+    // How many priorities there are.
+    static const size_t PRIORITIES = 3;
+
+    // The number of worker threads.
+    size_t size() const;
+
+    // Queues a task to be run by one of the workers.
+    //
+    // task:     The task.
+    // priority: How urgent it is, from 0, the most urgent, to `PRIORITIES` - 1.
+    //
+    // Returns a future which becomes ready when `task` has run, and rethrows anything it threw.
+    //
+    // NOTE: Don't wait on a task's future from inside another task in the same pool. If every
+    //       worker does that at once, nothing is left to run the tasks they're waiting for.
+    std::future<void> submit(std::function<void()> task, size_t priority = 0);
+
+    // Takes the most urgent task waiting, if it's more urgent than `priority`, and runs it on the
+    // calling thread. For a thread with nothing better to do while it waits, so that urgent tasks
+    // don't have to wait for a worker.
+    //
+    // priority: Only tasks with a lower number than this are run.
+    //
+    // Returns whether a task was run.
+    bool run_one(size_t priority);
+
+    // Runs `work` on the calling thread, and on up to `helpers` workers as well, with the given
+    // priority. Returns once the calling thread's `work` is done, and so is everyone else's who
+    // started. Helpers which haven't got a worker by then don't start at all, so that a pool which
+    // is busy with something else doesn't hold us up: `work` has to keep going until there's
+    // nothing left for anybody to do. Unlike waiting on `.submit()`, this is safe from inside a
+    // task.
+    //
+    // helpers:  How many workers to ask for. No more than `.size()` are.
+    // work:     What every thread runs.
+    // priority: How urgent the helpers are. See `.submit()`.
+    void crew(size_t helpers, const std::function<void()>& work, size_t priority);
+
+    // Calls `fn` for every number from 0 to `count`, with `.crew()`. There's only ever as many
+    // helpers as there are threads, so there can be millions of numbers.
+    //
+    // count:    How many times to call `fn`.
+    // fn:       Called with every number from 0 to `count`.
+    // priority: How urgent the helpers are. See `.submit()`.
+    //
+    // Throws the first exception thrown by `fn`, once every call to `fn` is done.
+    void parallel(size_t count, const std::function<void(size_t)>& fn, size_t priority);
+
+    // Registers `pthread_atfork()` handlers which stop every pool before a `fork()`, and start
+    // them again afterwards, along with the handlers from `.at_fork()`. Only for programs which
+    // `fork()` once they've used a pool, and need it in the child, like the FUSE frontend: the
+    // handlers are for the whole process, and can't be taken back, so nobody else has them forced
+    // on them, (say, a program using `libloopsteg.a`). Does nothing after the first call.
+    static void handle_forks();
+
+    // Adds handlers to run around a `fork()`, like `pthread_atfork()`, but in step with the pools:
+    // `before` runs once every pool has stopped, and `parent` or `child` before any of them start
+    // again. For anything workers use, (like <IoEngine.h>), which has to be locked for the `fork()`:
+    // handlers given to `pthread_atfork()` itself would lock it while workers still needed it.
+    // Handlers are run in the order they were added, and the ones afterwards in reverse. None of
+    // them run at all without `.handle_forks()`.
+    //
+    // before, parent, child: As for `pthread_atfork()`. None of them may be null.
+    static void at_fork(void (*before)(), void (*parent)(), void (*child)());
+
+    private:
+    // Same as `threads` given to `ThreadPool(size_t)`.
+    size_t _size;
+
+    // The workers, or empty if they aren't running right now.
+    std::vector<std::thread> _threads;
+
+    // Tasks waiting for a worker, by priority.
+    std::queue<std::packaged_task<void()>> _tasks[PRIORITIES];
+
+    // Set to tell the workers to finish up.
+    bool _stop;
+
+    std::mutex _mutex;
+    std::condition_variable _cv;
+
+    // Starts the workers. `_mutex` must be held.
+    void start();
+
+    // Runs what's left in the queue, then stops and joins the workers.
+    void stop();
+
+    // What each worker runs.
+    void work();
+
+    // The most urgent queue in `_tasks` with anything in it, or `PRIORITIES` if they're all empty.
+    // `_mutex` must be held.
+    size_t next() const;
+
+    // Handlers from `.at_fork()`.
+    struct fork_handlers
+    {
+        void (*before)();
+        void (*parent)();
+        void (*child)();
+    };
+
+    // The `pthread_atfork()` handlers from `.handle_forks()`, which `.stop()` every pool before a
+    // `fork()`, and `.start()` the ones with work waiting afterwards, with the handlers from
+    // `.at_fork()` in between.
+    static void before_fork();
+    static void after_fork_parent();
+    static void after_fork_child();
+
+    // Starts every pool with work waiting again. For after a `fork()`.
+    static void restart();
+
+    // Every pool in existence, for `before_fork()` and friends, and every handler from
+    // `.at_fork()`. Both are guarded by `pools_mutex()`.
+    static std::vector<ThreadPool*>& pools();
+    static std::vector<fork_handlers>& handlers();
+    static std::mutex& pools_mutex();
+};
+
+#endif
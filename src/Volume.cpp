@@ -0,0 +1,211 @@
+#include <string>
+#include <vector>
+#include <memory>
+#include <utility>
+#include <algorithm>
+#include <sstream>
+
+#include "Volume.h"
+#include "Manager.h"
+#include "Layout.h"
+#include "Scheduler.h"
+#include "ThreadPool.h"
+#include "exc.h"
+
+using namespace std;
+
+// What a `Volume` hides, so that its header doesn't need any of ours but <exc.h>.
+class Volume::impl
+{
+    public:
+    impl(): manager() { }
+
+    unique_ptr<Manager> manager;
+
+    // Makes sure every range lies within the volume.
+    //
+    // ranges: The offset and size of every range.
+    //
+    // Throws `exc::arg` if one doesn't.
+    void check(const vector<pair<size_t, size_t>>& ranges) const
+    {
+        size_t capacity = manager->capacity();
+
+        for (const pair<size_t, size_t>& r : ranges)
+        {
+            if (r.first > capacity || r.second > capacity - r.first)
+            {
+                stringstream ss;
+                ss << "range [" << r.first << ", " << r.first + r.second << ") must lie within "
+                    "`.capacity()` (" << capacity << ")";
+                THROW(arg, ss.str());
+            }
+        }
+    }
+};
+
+// What `Volume::options` hides. The members are as for the setters of the same names.
+class Volume::options::impl
+{
+    public:
+    impl():
+        layout(),
+        jobs(0),
+        journal(),
+        journal_size(64 << 20),
+        manifest(),
+        read_only(false),
+        cache_limit(0)
+    { }
+
+    Layout::options layout;
+    size_t jobs;
+
+    string journal;
+    size_t journal_size;
+
+    string manifest;
+
+    bool   read_only;
+    size_t cache_limit;
+};
+
+Volume::options::options(): _impl(new impl()) { }
+
+Volume::options::~options() { }
+
+Volume::options::options(const options& other): _impl(new impl(*other._impl)) { }
+
+Volume::options& Volume::options::operator=(const options& other)
+{
+    *_impl = *other._impl;
+    return *this;
+}
+
+Volume::options& Volume::options::layout(const string& policy, size_t block_size,
+                                         size_t block_covers)
+{
+    _impl->layout.policy = policy;
+    _impl->layout.block  = block_size;
+    _impl->layout.covers = block_covers;
+    return *this;
+}
+
+Volume::options& Volume::options::jobs(size_t jobs)
+{
+    _impl->jobs = jobs;
+    return *this;
+}
+
+Volume::options& Volume::options::journal(const string& path, size_t size)
+{
+    _impl->journal      = path;
+    _impl->journal_size = size;
+    return *this;
+}
+
+Volume::options& Volume::options::manifest(const string& path)
+{
+    _impl->manifest = path;
+    return *this;
+}
+
+Volume::options& Volume::options::read_only(size_t cache_limit)
+{
+    _impl->read_only   = true;
+    _impl->cache_limit = cache_limit;
+    return *this;
+}
+
+Volume::Volume(const string& seed, const string& dirs, const options& opts): _impl(new impl())
+{
+    const options::impl& o = *opts._impl;
+
+    if (o.read_only && !o.journal.empty())
+        THROW(config, "a read-only volume can't have a journal");
+
+    _impl->manager.reset(new Manager(Manager::roots(dirs), seed, o.layout, o.jobs, 0, 1,
+                                     o.manifest));
+
+    if (!o.journal.empty()) _impl->manager->journal(o.journal, o.journal_size);
+
+    if (o.read_only) _impl->manager->read_only(o.cache_limit);
+}
+
+Volume::~Volume() { }
+
+size_t Volume::capacity() const { return get().manager->capacity(); }
+size_t Volume::block()    const { return get().manager->block();    }
+bool   Volume::read_only() const { return get().manager->read_only(); }
+
+size_t Volume::read(char* buf, size_t size, size_t offset)
+{
+    if (!size) return 0;
+    return get().manager->read(buf, size, offset);
+}
+
+size_t Volume::write(const char* buf, size_t size, size_t offset)
+{
+    if (!size) return 0;
+    return get().manager->write(buf, size, offset);
+}
+
+void Volume::readv(const read_request* requests, size_t count)
+{
+    impl& volume = get();
+
+    vector<pair<size_t, size_t>> ranges;
+    for (size_t i = 0; i < count; ++i) ranges.emplace_back(requests[i].offset, requests[i].size);
+
+    volume.check(ranges);
+
+    // Every read is split between covers on the pool anyway, so the reads themselves go on it too,
+    // and the covers behind all of them load at once.
+    ThreadPool::get().parallel(count, [this, requests](size_t i)
+    { read(requests[i].buf, requests[i].size, requests[i].offset); }, Scheduler::FOREGROUND);
+}
+
+void Volume::writev(const write_request* requests, size_t count)
+{
+    impl& volume = get();
+    if (volume.manager->read_only()) THROW(arg, "can't write to a read-only `Volume`");
+
+    vector<pair<size_t, size_t>> ranges;
+    for (size_t i = 0; i < count; ++i) ranges.emplace_back(requests[i].offset, requests[i].size);
+
+    volume.check(ranges);
+
+    // Writes which overlap have to happen in order, so that the last one wins.
+    sort(ranges.begin(), ranges.end());
+    bool overlap = false;
+
+    for (size_t i = 1; i < ranges.size() && !overlap; ++i)
+        overlap = ranges[i].first < ranges[i - 1].first + ranges[i - 1].second;
+
+    if (overlap)
+    {
+        for (size_t i = 0; i < count; ++i)
+            write(requests[i].buf, requests[i].size, requests[i].offset);
+
+        return;
+    }
+
+    ThreadPool::get().parallel(count, [this, requests](size_t i)
+    { write(requests[i].buf, requests[i].size, requests[i].offset); }, Scheduler::FOREGROUND);
+}
+
+void Volume::sync() { get().manager->sync(); }
+
+void Volume::close()
+{
+    if (!_impl) return;
+
+    sync();
+    _impl.reset();
+}
+
+Volume::impl& Volume::get() const
+{
+    if (!_impl) THROW(arg, "the `Volume` has been closed");
+    return *_impl;
+}
@@ -0,0 +1,200 @@
+#ifndef VOLUME_H
+#define VOLUME_H
+
+#include <string>
+#include <memory>
+
+#include <cstddef>
+
+#include "exc.h"
+
+// A hidden volume, for programs which want to read and write one themselves, in their own process,
+// rather than through FUSE or NBD. This is the API of `libloopsteg.a`, (see the Makefile): it's the
+// only header you need besides <exc.h>, for the exceptions, and since everything else is hidden
+// behind a pointer, it doesn't change when the rest of loop-steg does.
+//
+// A `Volume` is the same volume `loop-steg` mounts from the same seed, directories and options, so
+// a program can fill a volume that's mounted later, or the other way around. Just not both at
+// once, for the same reasons as two mounts at once.
+//
+// Every method may be called from many threads at once, except `.close()`.
+//
+// NOTE: Like `CachedFile`, writes are only cached in memory until `.sync()`, and the destructor
+// doesn't sync, since that might throw. Call `.close()` when you're done.
+// NOTE: No `pthread_atfork()` handlers are installed behind your back, (see
+// `ThreadPool::handle_forks()`), so a child process can't use a `Volume` its parent opened.
+class Volume
+{
+    public:
+    // How to open a volume. The defaults are the same as `loop-steg`'s. Like `Volume` itself, the
+    // options are behind a pointer, so that there can be more of them without the header changing.
+    // Every setter returns the options, so they can be chained:
+    //
+    // Volume volume(seed, dirs, Volume::options().journal("/path/to/journal").jobs(4));
+    class options
+    {
+        public:
+        options();
+        ~options();
+
+        options(const options& other);
+        options& operator=(const options& other);
+
+        // The layout, see `-o layout`, `-o block_size` and `-o block_covers`. These have to be the
+        // same every time, like the seed. Defaults to "bytes", 4096 and 8.
+        options& layout(const std::string& policy, size_t block_size, size_t block_covers);
+
+        // See `-o device_jobs`. Defaults to 0, which means the default.
+        options& jobs(size_t jobs);
+
+        // Path of the journal, see `-o journal`, and its size in bytes, see `-o journal_size`.
+        // Defaults to none.
+        options& journal(const std::string& path, size_t size = 64 << 20);
+
+        // Path of the manifest, see `-o manifest`. Defaults to none.
+        options& manifest(const std::string& path);
+
+        // Opens it read-only, see `-o ro`, keeping about `cache_limit` bytes of covers in memory,
+        // see `-o cache_limit`. 0 means no limit. Defaults to read-write.
+        options& read_only(size_t cache_limit = 0);
+
+        private:
+        friend class Volume;
+
+        // The options themselves. See <Volume.cpp>.
+        class impl;
+        std::unique_ptr<impl> _impl;
+    };
+
+    // One range of a `.readv()`.
+    struct read_request
+    {
+        // Where in the volume to read from.
+        size_t offset;
+
+        // Where to put the bytes. Must have room for `size` of them.
+        char* buf;
+
+        // How many bytes to read.
+        size_t size;
+    };
+
+    // One range of a `.writev()`.
+    struct write_request
+    {
+        // Where in the volume to write to.
+        size_t offset;
+
+        // The bytes to write.
+        const char* buf;
+
+        // How many bytes to write.
+        size_t size;
+    };
+
+    // Opens a volume. This takes as long as mounting it does: every cover is looked at, and with
+    // a journal, anything in it is replayed.
+    //
+    // seed: The seed itself, i.e. the contents of the seed file, not its path.
+    // dirs: The directories of covers, the same as `loop-steg` takes, e.g. '/path/to/images/', or
+    //       '/mnt/ssd/covers:/mnt/hdd/covers@0.25'.
+    // opts: How to open it.
+    //
+    // Throws `exc::config` if `opts` doesn't make sense, e.g. a journal with `.read_only()`.
+    // Throws `exc::file` if the covers, journal or manifest could not be read.
+    // Throws `exc::exception`, one of the others in <exc.h>, for anything else that goes wrong.
+    Volume(const std::string& seed, const std::string& dirs, const options& opts = options());
+
+    // Closes the volume WITHOUT syncing it first. Anything written since the last `.sync()` is
+    // lost, (unless there's a journal, which has it). See `.close()`.
+    ~Volume();
+
+    // There should only be one `Volume` per volume, since each has its own cache.
+    Volume(const Volume& other)            = delete;
+    Volume& operator=(const Volume& other) = delete;
+
+    // Size of the volume, in bytes.
+    //
+    // Throws `exc::arg` if the volume has been `.close()`d.
+    size_t capacity() const;
+
+    // Requests which are a multiple of this many bytes, and aligned to it, touch the fewest covers.
+    //
+    // Throws `exc::arg` if the volume has been `.close()`d.
+    size_t block() const;
+
+    // Whether it was opened with `options::read_only()`.
+    //
+    // Throws `exc::arg` if the volume has been `.close()`d.
+    bool read_only() const;
+
+    // Reads from the volume. Like `pread()`, reads stop at the end of the volume.
+    //
+    // buf:    Where to put the bytes.
+    // size:   How many bytes to read.
+    // offset: Where in the volume to read from.
+    //
+    // Returns how many bytes were read.
+    //
+    // Throws `exc::arg` if `offset` is past the end of the volume, or it's been `.close()`d.
+    // Throws `exc::file` if a cover could not be read.
+    size_t read(char* buf, size_t size, size_t offset);
+
+    // Writes to the volume. Like `pwrite()`, writes stop at the end of the volume.
+    //
+    // buf:    The bytes to write.
+    // size:   How many bytes to write.
+    // offset: Where in the volume to write to.
+    //
+    // Returns how many bytes were written.
+    //
+    // Throws `exc::arg` if `offset` is past the end of the volume, it's `.read_only()`, or it's
+    // been `.close()`d.
+    // Throws `exc::file` if a cover could not be read, or the journal could not be written.
+    size_t write(const char* buf, size_t size, size_t offset);
+
+    // Reads lots of ranges at once. They're all done in parallel, so the covers behind every range
+    // load at the same time, rather than one range after another.
+    //
+    // requests: The ranges to read.
+    // count:    How many there are.
+    //
+    // Throws `exc::arg` if any range doesn't lie within the volume, (before reading anything), or
+    // it's been `.close()`d.
+    // Throws the first exception thrown by `.read()`, once every range is done.
+    void readv(const read_request* requests, size_t count);
+
+    // Writes lots of ranges at once. Like `.readv()`, they're done in parallel, unless any of them
+    // overlap, in which case they're done one after another, in order, so the last one wins.
+    //
+    // requests: The ranges to write.
+    // count:    How many there are.
+    //
+    // Throws `exc::arg` if any range doesn't lie within the volume, (before writing anything), or
+    // it's `.read_only()`, or it's been `.close()`d.
+    // Throws the first exception thrown by `.write()`, once every range is done.
+    void writev(const write_request* requests, size_t count);
+
+    // Writes everything that's been written to the covers, (and empties the journal, if there is
+    // one). Reads and writes carry on meanwhile. Does nothing if it's `.read_only()`.
+    //
+    // Throws `exc::arg` if the volume has been `.close()`d.
+    // Throws `exc::file` if a cover could not be written, after trying the rest.
+    void sync();
+
+    // Syncs the volume, then closes it. After this, every other method throws. Does nothing if it's
+    // closed already.
+    //
+    // Throws anything `.sync()` throws, in which case the volume is still open.
+    void close();
+
+    private:
+    // Everything else. See <Volume.cpp>.
+    class impl;
+    std::unique_ptr<impl> _impl;
+
+    // `_impl`, or throws `exc::arg` if it's been `.close()`d.
+    impl& get() const;
+};
+
+#endif
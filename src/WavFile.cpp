@@ -0,0 +1,263 @@
+#include <string>
+#include <sstream>
+#include <memory>
+#include <vector>
+#include <algorithm>
+
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "WavFile.h"
+#include "Arena.h"
+#include "fs.h"
+#include "exc.h"
+
+using namespace std;
+
+namespace
+{
+
+// How many samples to stream through at once. 8 samples per hidden byte, so this is 1 MiB of
+// hidden bytes at a time.
+const size_t CHUNK_SAMPLES = 8 << 20;
+
+// WAVE_FORMAT_PCM and WAVE_FORMAT_EXTENSIBLE, from the format chunk.
+const uint16_t FORMAT_PCM        = 1;
+const uint16_t FORMAT_EXTENSIBLE = 0xfffe;
+
+uint32_t get(const unsigned char* in, size_t bytes)
+{
+    uint32_t value = 0;
+    for (size_t i = 0; i < bytes; ++i) value |= (uint32_t)in[i] << (i * 8);
+    return value;
+}
+
+}
+
+WavFile::WavFile(const string& path): _data(0), _sample(0)
+{
+    _path  = intern(path);
+    _bytes = nullptr;
+
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+    {
+        stringstream ss;
+        ss << "could not open '" << path << "': " << strerror(errno);
+        THROW(file, ss.str());
+    }
+
+    fs::fd_guard guard(fd);
+    struct stat st;
+
+    if (fstat(fd, &st) < 0)
+    {
+        stringstream ss;
+        ss << "could not get size of '" << path << "': " << strerror(errno);
+        THROW(file, ss.str());
+    }
+
+    off_t file_size = st.st_size;
+    remember(fd);
+
+    unsigned char riff[12];
+
+    if (!fs::pread_all(fd, riff, sizeof(riff), 0)
+            || memcmp(riff, "RIFF", 4) || memcmp(riff + 8, "WAVE", 4))
+    {
+        stringstream ss;
+        ss << "'" << path << "' is not a WAV file";
+        THROW(file, ss.str());
+    }
+
+    // Walk the chunks until we've seen both the format and the samples. Chunks are padded to an
+    // even size.
+    uint16_t format = 0, bits = 0;
+    uint64_t samples_size = 0;
+    bool     found_format = false;
+
+    for (off_t at = sizeof(riff); at + 8 <= file_size;)
+    {
+        unsigned char header[8];
+
+        if (!fs::pread_all(fd, header, sizeof(header), at)) break;
+
+        uint32_t size = get(header + 4, 4);
+
+        if (!memcmp(header, "fmt ", 4))
+        {
+            unsigned char fmt[26] = { 0 };
+
+            if (size < 16 || !fs::pread_all(fd, fmt, min<size_t>(size, sizeof(fmt)), at + 8)) break;
+
+            format = get(fmt, 2);
+            bits   = get(fmt + 14, 2);
+
+            // WAVE_FORMAT_EXTENSIBLE keeps the real format at the start of the sub-format GUID.
+            if (format == FORMAT_EXTENSIBLE && size >= sizeof(fmt)) format = get(fmt + 24, 2);
+
+            found_format = true;
+        }
+
+        else if (!memcmp(header, "data", 4))
+        {
+            _data        = at + 8;
+            samples_size = min<uint64_t>(size, file_size - _data);
+            break;
+        }
+
+        at += 8 + size + (size & 1);
+    }
+
+    if (!found_format || !_data)
+    {
+        stringstream ss;
+        ss << "'" << path << "' is not a valid WAV file";
+        THROW(file, ss.str());
+    }
+
+    if (format != FORMAT_PCM || (bits != 8 && bits != 16 && bits != 24))
+    {
+        stringstream ss;
+        ss << "'" << path << "' is not 8, 16 or 24-bit PCM, which is all that's supported";
+        THROW(file, ss.str());
+    }
+
+    _sample   = bits / 8;
+    _capacity = samples_size / _sample / 8;
+}
+
+template <typename F> void WavFile::for_each_chunk(F fn)
+{
+    size_t samples = _capacity * 8;
+
+    for (size_t done = 0; done < samples; done += CHUNK_SAMPLES)
+        fn(_data + (off_t)(done * _sample), min(CHUNK_SAMPLES, samples - done), done / 8);
+}
+
+void WavFile::prepare()
+{
+    if (!_bytes) _bytes = Arena::get().allocate(_capacity);
+
+    int fd = open_checked(O_RDONLY);
+    fs::fd_guard guard(fd);
+
+    vector<unsigned char> samples;
+
+    for_each_chunk([&](off_t offset, size_t count, size_t first)
+    {
+        samples.resize(count * _sample);
+
+        if (!fs::pread_all(fd, samples.data(), samples.size(), offset))
+        {
+            stringstream ss;
+            ss << "could not read from '" << path() << "': " << strerror(errno);
+            THROW(file, ss.str());
+        }
+
+        // Samples are little endian, so the least significant bit is in the first byte.
+        for (size_t i = 0; i < count / 8; ++i)
+        {
+            const unsigned char* at = samples.data() + i * 8 * _sample;
+            unsigned char byte = 0;
+
+            for (size_t bit = 0; bit < 8; ++bit)
+                byte |= (at[bit * _sample] & 1) << bit;
+
+            _bytes[first + i] = byte;
+        }
+    });
+
+    _synced = true;
+}
+
+void WavFile::sync()
+{
+    if (synced()) return;
+
+    // Nothing to do if everything written since put back what was there. See `.unchanged()`.
+    uint64_t hash;
+
+    if (unchanged(&hash))
+    {
+        _synced = true;
+        return;
+    }
+
+    _hashed = false;
+
+    int fd = open_checked(O_RDWR);
+    fs::fd_guard guard(fd);
+
+    vector<unsigned char> samples;
+
+    auto hide = [&](off_t offset, size_t count, size_t first)
+    {
+        samples.resize(count * _sample);
+
+        if (!fs::pread_all(fd, samples.data(), samples.size(), offset))
+        {
+            stringstream ss;
+            ss << "could not read from '" << path() << "': " << strerror(errno);
+            THROW(file, ss.str());
+        }
+
+        bool changed = false;
+
+        for (size_t i = 0; i < count / 8; ++i)
+        {
+            unsigned char* at = samples.data() + i * 8 * _sample;
+
+            for (size_t bit = 0; bit < 8; ++bit)
+            {
+                unsigned char lsb = (_bytes[first + i] >> bit) & 1;
+
+                if ((at[bit * _sample] & 1) != lsb)
+                {
+                    at[bit * _sample] ^= 1;
+                    changed = true;
+                }
+            }
+        }
+
+        // Leave chunks nobody wrote to well alone.
+        if (changed && !fs::pwrite_all(fd, samples.data(), samples.size(), offset))
+        {
+            stringstream ss;
+            ss << "could not write to '" << path() << "': " << strerror(errno);
+            THROW(file, ss.str());
+        }
+    };
+
+    // Even if this fails part of the way, the chunks already written are ours.
+    try
+    {
+        for_each_chunk(hide);
+
+        // See `CachedFile::sync()`.
+        if (fsync(fd) < 0)
+        {
+            stringstream ss;
+            ss << "could not write to '" << path() << "': " << strerror(errno);
+            THROW(file, ss.str());
+        }
+    }
+
+    catch (...)
+    {
+        remember(fd);
+        throw;
+    }
+
+    remember(fd);
+    _hash   = hash;
+    _hashed = true;
+    _synced = true;
+}
@@ -0,0 +1,65 @@
+#ifndef WAVFILE_H
+#define WAVFILE_H
+
+#include <string>
+
+#include <sys/types.h>
+
+#include "CachedFile.h"
+
+// Like `StegFile`, but for uncompressed PCM WAV audio rather than images. The hidden bytes are kept
+// in the least significant bits of the samples, one bit per sample, 8 samples per byte.
+//
+// Unlike images, the samples of a WAV file just sit there at a fixed offset in the file, with no
+// codec in the way. So there's no need to decode the whole file, or write the whole file back out:
+// `.prepare()` and `.sync()` stream over the samples in big chunks with `pread()` and `pwrite()`,
+// and only the chunks of samples which actually changed are written back, in place.
+//
+// Only 8, 16 and 24-bit PCM is supported, with any number of channels.
+class WavFile : public CachedFile
+{
+    public:
+    // `WavFile` constructor. Only reads the header of the file, not the samples.
+    //
+    // path: The path to the WAV file to wrap.
+    //
+    // Throws `exc::file` if the file at `path` could not be read.
+    // Throws `exc::file` if the file at `path` is not a WAV file of 8, 16 or 24-bit PCM.
+    WavFile(const std::string& path);
+
+    // Deleted, see `StegFile`.
+    WavFile(WavFile&& other)                 = delete;
+    WavFile& operator=(WavFile&& other)      = delete;
+    WavFile(const WavFile& other)            = delete;
+    WavFile& operator=(const WavFile& other) = delete;
+
+    // Hides the cached bytes in the samples, and writes back the chunks of samples which changed.
+    // See `CachedFile::sync()`.
+    //
+    // Throws `exc::file` if the file at `.path()` could not be read or written to.
+    // Throws `exc::file` if the file at `.path()` has changed in the file system since the
+    //        `WavFile` was created.
+    void sync();
+
+    private:
+    // Extracts the hidden bytes from the samples into `_bytes`. See `CachedFile::prepare()`.
+    //
+    // Throws anything `Arena::allocate()` throws.
+    // Throws `exc::file` if the file at `.path()` could not be read.
+    // Throws `exc::file` if the file at `.path()` has changed in the file system since the
+    //        `WavFile` was created.
+    void prepare();
+
+    // Calls `fn` for every chunk of samples in the file, in order, with the offset of the chunk
+    // within the file, the number of samples in the chunk, (always a multiple of 8), and the index
+    // in `_bytes` of the first byte hidden in the chunk.
+    template <typename F> void for_each_chunk(F fn);
+
+    // Offset in the file of the first sample.
+    off_t _data;
+
+    // Size of one sample, in bytes. 1, 2 or 3.
+    size_t _sample;
+};
+
+#endif
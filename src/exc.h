@@ -60,6 +60,13 @@ class too_big : public exception
     too_big(const std::string& what): exception(what) { }
 };
 
+// To throw when the user asked for something which makes no sense, e.g. an unknown option value.
+class config : public exception
+{
+    public:
+    config(const std::string& what): exception(what) { }
+};
+
 // To throw when an argument to a function had an invalid value. This is intended to represent
 // errors caused by the programmer, not the user, so if this ever makes it to `main()`, there's a
 // bug somewhere. If this was caused by the user entering a dodgy value, throw something else.
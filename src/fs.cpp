@@ -1,10 +1,13 @@
 #include <vector>
 #include <string>
 #include <algorithm>
-#include <queue>
 #include <sstream>
 #include <fstream>
 #include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <exception>
 
 #include <cstring>
 #include <cerrno>
@@ -13,69 +16,186 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
-#include <string>
+#include <fcntl.h>
+#include <sys/syscall.h>
 
 #include "fs.h"
+#include "PathTable.h"
+#include "ThreadPool.h"
+#include "IoEngine.h"
 #include "exc.h"
 #include "util.h"
 
 using namespace std;
 
+namespace
+{
+
+// Stuck on the end of the path of an `fs::replacement`, when it needs a name before `.commit()`.
+const char TEMP_SUFFIX[] = ".loop-steg~";
+
+// Whether a file is an `fs::replacement` that was being written when something went wrong, i.e.
+// an image that was never finished, which shouldn't be taken for a cover.
+bool leftover(const char* name)
+{
+    size_t length = strlen(name);
+    size_t suffix = sizeof(TEMP_SUFFIX) - 1;
+    return length >= suffix && !strcmp(name + length - suffix, TEMP_SUFFIX);
+}
+
+}
+
 namespace fs
 {
 
-vector<string> list_files(string dir_path, bool recursive)
+PathTable list_files(string dir_path, bool recursive)
 {
     // Because we're joining paths in a moment, we ensure that this first one ends in a '/', as the
     // rest of them will later.
     if (dir_path.back() != '/') dir_path += '/';
 
-    vector<string> result;
+    PathTable result;
+    result.add_dir(dir_path);
 
-    // The way this function works is, we have a queue of directories, which initially just contains
-    // `dir_path`. Then, in a loop, we repeatedly take the next item from the queue, and iterate
-    // through all the items in that directory. For those that are files, we add them to `result`.
-    // For those that are directories, we push them to the queue and keep going. We repeat this
-    // until the queue is empty.
+    // Every other directory is opened relative to this one, so the kernel doesn't have to walk the
+    // whole path from the start every time.
+    int root = open(dir_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
 
-    queue<string> dirs;
-    dirs.push(dir_path);
+    if (root < 0)
+    {
+        stringstream ss;
+        ss << "could not open '" << dir_path << "': " << strerror(errno);
+        THROW(file, ss.str());
+    }
+
+    // The way this function works is, we have a stack of directories still to read, which
+    // initially just contains `dir_path`. A few threads at once take the next directory from the
+    // stack, and read through every entry in it. Those that are files get added to `result`. Those
+    // that are directories get pushed to the stack. We keep going until the stack is empty, and
+    // nobody is in the middle of reading a directory, (which might add more).
+    vector<size_t> todo(1, 0);
+    size_t busy = 0;
+    exception_ptr error;
+    mutex m;
+    condition_variable cv;
 
-    while (!dirs.empty())
+    auto work = [&]()
     {
-        unique_ptr<DIR, void(*)(DIR*)> dir
-        (
-            opendir(dirs.front().c_str()),
-            [](DIR* dir){ closedir(dir); }
-        );
+        // Big enough for a few thousand entries at a time.
+        vector<char> buf(1 << 16);
+
+        // Entries of the directory we're reading, so we don't have to lock for every one.
+        vector<char>   files;
+        vector<string> dirs;
 
-        if (!dir)
+        unique_lock<mutex> lock(m);
+
+        for (;;)
         {
-            stringstream ss;
-            ss << "could not open '" << dir_path << "': " << strerror(errno);
-            THROW(file, ss.str());
+            cv.wait(lock, [&]() { return !todo.empty() || !busy || error; });
+            if (todo.empty() || error) break;
+
+            size_t dir  = todo.back();
+            string path = result.dir(dir);
+            todo.pop_back();
+            ++busy;
+
+            lock.unlock();
+
+            files.clear();
+            dirs.clear();
+
+            try
+            {
+                string relative = path.substr(dir_path.size());
+                int fd = openat(root, relative.empty() ? "." : relative.c_str(),
+                        O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+                if (fd < 0)
+                {
+                    stringstream ss;
+                    ss << "could not open '" << path << "': " << strerror(errno);
+                    THROW(file, ss.str());
+                }
+
+                fd_guard guard(fd);
+
+                // `getdents64()` fills `buf` with as many entries as fit, each of them:
+                //
+                // [u64 inode][s64 offset][u16 length of this entry][u8 type][name, null terminated]
+                for (;;)
+                {
+                    long size = syscall(SYS_getdents64, fd, buf.data(), buf.size());
+
+                    if (size < 0 && errno == EINTR) continue;
+
+                    if (size < 0)
+                    {
+                        stringstream ss;
+                        ss << "could not read '" << path << "': " << strerror(errno);
+                        THROW(file, ss.str());
+                    }
+
+                    if (size == 0) break;
+
+                    for (long at = 0; at < size;)
+                    {
+                        unsigned short length;
+                        memcpy(&length, buf.data() + at + 16, sizeof(length));
+
+                        unsigned char type = buf[at + 18];
+                        const char*   name = buf.data() + at + 19;
+
+                        // If the current entry is a directory other than '.' or '..', add it to the
+                        // stack, but only bother with this if we're searching recursively.
+                        if (recursive && type == DT_DIR && strcmp(name, ".") && strcmp(name, ".."))
+                            dirs.emplace_back(path + name + "/");
+                        else if (type == DT_REG && !leftover(name))
+                            files.insert(files.end(), name, name + strlen(name) + 1);
+
+                        at += length;
+                    }
+                }
+            }
+
+            catch (...)
+            {
+                lock.lock();
+                if (!error) error = current_exception();
+                --busy;
+                cv.notify_all();
+                break;
+            }
+
+            lock.lock();
+
+            for (size_t at = 0; at < files.size(); at += strlen(files.data() + at) + 1)
+                result.add(dir, files.data() + at, strlen(files.data() + at));
+
+            for (const string& d : dirs)
+                todo.push_back(result.add_dir(d));
+
+            --busy;
+            cv.notify_all();
         }
+    };
 
-        // Iterate through every entry in the current directory.
-        for (struct dirent* ent; (ent = readdir(dir.get()));)
-            // If the current entry is a directory other than '.' or '..', add it to the queue, but
-            // only bother with this if we're searching recursively.
-            if (recursive &&
-                    (ent->d_type == DT_DIR && strcmp(ent->d_name, ".") && strcmp(ent->d_name, ".."))
-                )
-                dirs.emplace(dirs.front() + string(ent->d_name) + "/");
-            else if (ent->d_type == DT_REG)
-                result.emplace_back(dirs.front() + ent->d_name);
-
-        dirs.pop();
-    }
+    ThreadPool& pool = ThreadPool::get();
+    vector<future<void>> futures;
 
-    // Just so that it's in the same order every time.
-    sort(result.begin(), result.end());
+    for (size_t i = 1; i < pool.size(); ++i)
+        futures.emplace_back(pool.submit(work));
+
+    work();
+
+    for (auto& f : futures) f.get();
+
+    close(root);
+
+    if (error) rethrow_exception(error);
 
-    // Just in case. Might save us some memory.
-    for (string& s : result) s.shrink_to_fit();
-    result.shrink_to_fit();
+    // Just so that it's in the same order every time.
+    result.sort();
     return result;
 }
 
@@ -101,4 +221,106 @@ string read_to_string(const string& path)
     }
 }
 
+bool pread_all(int fd, void* buf, size_t size, off_t offset)
+{
+    return IoEngine::get().read(fd, buf, size, offset);
+}
+
+bool pwrite_all(int fd, const void* buf, size_t size, off_t offset)
+{
+    return IoEngine::get().write(fd, buf, size, offset);
+}
+
+void sync_dir(const string& path)
+{
+    size_t slash = path.rfind('/');
+    string dir   = slash == string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd < 0 || fsync(fd) < 0)
+    {
+        int error = errno;
+        if (fd >= 0) close(fd);
+
+        stringstream ss;
+        ss << "could not sync '" << dir << "': " << strerror(error);
+        THROW(file, ss.str());
+    }
+
+    close(fd);
+}
+
+replacement::replacement(const string& path, mode_t mode): _path(path), _fd(-1), _temp()
+{
+    // Best of all is a file with no name, so if we die half way through, there's nothing left lying
+    // around in the directory, (which would be taken for a cover next time).
+    string dir = _path.substr(0, _path.rfind('/') + 1);
+    _fd = open(dir.empty() ? "." : dir.c_str(), O_TMPFILE | O_WRONLY | O_CLOEXEC, mode);
+
+    // Not every file system can do that, so otherwise make do with a name.
+    if (_fd < 0)
+    {
+        _temp = _path + TEMP_SUFFIX;
+        _fd   = open(_temp.c_str(), O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, mode);
+    }
+
+    if (_fd < 0)
+    {
+        stringstream ss;
+        ss << "could not create a new copy of '" << _path << "': " << strerror(errno);
+        THROW(file, ss.str());
+    }
+}
+
+replacement::~replacement()
+{
+    if (_fd < 0) return;
+
+    close(_fd);
+    if (!_temp.empty()) unlink(_temp.c_str());
+}
+
+int replacement::fd() const { return _fd; }
+
+void replacement::commit()
+{
+    // The copy has to be on the disk before it replaces the old file, or a crash just after the
+    // rename could leave neither.
+    if (fsync(_fd) < 0) fail();
+
+    // Give it a name first, if it doesn't have one. The name doesn't matter, since we're about to
+    // rename it anyway.
+    if (_temp.empty())
+    {
+        string name = _path + TEMP_SUFFIX;
+        string self = "/proc/self/fd/" + to_string(_fd);
+
+        unlink(name.c_str());
+
+        if (linkat(AT_FDCWD, self.c_str(), AT_FDCWD, name.c_str(), AT_SYMLINK_FOLLOW) < 0) fail();
+
+        _temp = name;
+    }
+
+    if (rename(_temp.c_str(), _path.c_str()) < 0) fail();
+
+    close(_fd);
+    _fd = -1;
+    _temp.clear();
+
+    // And the rename has to be on the disk before anyone counts on the new file being there, (for
+    // example, by emptying the journal).
+    sync_dir(_path);
+}
+
+void replacement::fail() const
+{
+    stringstream ss;
+    ss << "could not write to '" << _path << "': " << strerror(errno);
+    THROW(file, ss.str());
+}
+
+fd_guard::~fd_guard() { if (_fd >= 0) close(_fd); }
+
 }
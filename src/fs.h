@@ -10,10 +10,15 @@
 
 #include <string>
 
+#include <sys/types.h>
+
+#include "PathTable.h"
+
 namespace fs
 {
 
-// Finds the path of every regular file in a directory.
+// Finds the path of every regular file in a directory. Directories are read in parallel, on
+// `ThreadPool::get()`, since with lots of them, most of the time is spent waiting on the disk.
 //
 // dir_path:  The path to the directory to search in.
 // recursive: If true, search recursively. Otherwise just search within the directory at `dir_path`.
@@ -25,8 +30,11 @@ namespace fs
 // Throws `exc::file` if `dir_path`, (or any directories beneath it, if `recursive` is true), could
 //        not be opened. (For example, if they are not a directory.)
 //
-// NOTE: The result is sorted using `std::sort()`, so that the result will be the same every time.
-std::vector<std::string> list_files(std::string dir_path, bool recursive = true);
+// NOTE: The result is sorted with `PathTable::sort()`, so that the result will be the same every
+//       time.
+// NOTE: Files ending in '.loop-steg~' are left out. They're `replacement`s which were never
+//       finished, left behind by a crash.
+PathTable list_files(std::string dir_path, bool recursive = true);
 
 // Reads the entire contents of a file into a string.
 //
@@ -37,6 +45,93 @@ std::vector<std::string> list_files(std::string dir_path, bool recursive = true)
 // Throws `exc::file` if the file at `path` could not be read.
 std::string read_to_string(const std::string& path);
 
+// Like `pread()`, but keeps going until it's read everything, or fails. Goes through
+// `IoEngine::get()`, so big reads are split up and batched with everyone else's.
+//
+// fd, buf, size, offset: As for `pread()`.
+//
+// Returns true if all `size` bytes were read. Otherwise false, with `errno` set, or 0 if the file
+//         ended first.
+bool pread_all(int fd, void* buf, size_t size, off_t offset);
+
+// Like `pwrite()`, but keeps going until it's written everything, or fails. Goes through
+// `IoEngine::get()`, like `pread_all()`.
+//
+// fd, buf, size, offset: As for `pwrite()`.
+//
+// Returns true if all `size` bytes were written. Otherwise false, with `errno` set.
+bool pwrite_all(int fd, const void* buf, size_t size, off_t offset);
+
+// `fsync()`s the directory a file is in, so that a rename, link or unlink of the file survives a
+// crash, the same way `fsync()` makes its contents survive one.
+//
+// path: The path to the file, (which needn't exist any more).
+//
+// Throws `exc::file` if the directory could not be opened or synced.
+void sync_dir(const std::string& path);
+
+// A new copy of a file, which nobody can see until `.commit()` puts it in place of the old one.
+// Either the old file or the new one is there afterwards, whatever happens: if we die half way
+// through, all that's left is the old file, and maybe a file named after it, ending in
+// '.loop-steg~', which `list_files()` ignores. If it's never committed, the destructor gets rid of
+// it.
+//
+// fs::replacement copy("/some/image.png", 0644);
+// fs::pwrite_all(copy.fd(), bytes, size, 0);
+// copy.commit();
+class replacement
+{
+    public:
+    // path: The file the copy is to replace.
+    // mode: Permissions for the copy, (say, the old file's).
+    //
+    // Throws `exc::file` if the new file could not be created.
+    replacement(const std::string& path, mode_t mode);
+
+    // Gets rid of the copy, unless it's been `.commit()`ed.
+    ~replacement();
+
+    replacement(const replacement& other)            = delete;
+    replacement& operator=(const replacement& other) = delete;
+
+    // The copy, open for writing.
+    int fd() const;
+
+    // `fsync()`s the copy, renames it over the old file, and `sync_dir()`s, so that once this
+    // returns, the copy is on the disk and in place.
+    //
+    // Throws `exc::file` if any of that fails, in which case the old file is still in place, unless
+    // it was `sync_dir()` that failed.
+    void commit();
+
+    private:
+    // The file being replaced.
+    std::string _path;
+
+    // The copy, or -1 once it's committed, and its path, if it has one yet. (With `O_TMPFILE`, it
+    // doesn't until `.commit()`.)
+    int         _fd;
+    std::string _temp;
+
+    // Throws `exc::file` saying what went wrong, from `errno`.
+    void fail() const;
+};
+
+// Closes a file descriptor when it goes out of scope.
+class fd_guard
+{
+    public:
+    fd_guard(int fd): _fd(fd) { }
+
+    fd_guard(const fd_guard& other)            = delete;
+    fd_guard& operator=(const fd_guard& other) = delete;
+
+    ~fd_guard();
+
+    private:
+    int _fd;
+};
+
 }
 
 #endif
@@ -18,32 +18,39 @@
 #include <memory>
 #include <algorithm>
 #include <chrono>
+#include <vector>
+#include <sstream>
+#include <exception>
+#include <thread>
+#include <atomic>
 
 #include <stdio.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <string.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stddef.h>
 #include <assert.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/mman.h>
 
 #define FUSE_USE_VERSION 34
 #include <fuse3/fuse.h>
 
-// For now, the only place I use <stb_image.h> is in <StegFile.cpp>. Configure it here, and at the
-// start of `main()`.
-#define STBI_FAILURE_USERMSG
-#define STB_IMAGE_IMPLEMENTATION
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include <stb/stb_image.h>
-#include <stb/stb_image_write.h>
-
 #include "exc.h"
 #include "fs.h"
 #include "CachedFile.h"
 #include "Manager.h"
+#include "Scheduler.h"
+#include "Layout.h"
 #include "StegFile.h"
+#include "NbdServer.h"
+#include "Arena.h"
+#include "ThreadPool.h"
 
 // This program uses a FUSE file system to expose one virtual file to the operating system. Any
 // reads or writes done by other programs to this file are distributed randomly across a series of
@@ -68,12 +75,23 @@
 // Strictly speaking, it's actually `StegFile` which is used, in <StegFile.h>, which derives from
 // `CachedFile`, and performs steganography on an image file to save its data when `.sync()`-ing.
 // You could add support for more file types, or more methods of steganography, by providing more
-// implementations of `CachedFile`.
+// implementations of `CachedFile`. For example, `WavFile`, in <WavFile.h>, does the same for WAV
+// audio.
 //
 // So that's basically how the program works. Other points of interest include:
 //
 // <Shuffler.h>: `Shuffler` class, which calculates random permutations of integers between two
 //               values. Used by `Manager` to randomly distribute bytes.
+// <Layout.h>:   `Layout` class, which decides where exactly each byte goes, using `Shuffler`.
+// <Arena.h>:    `Arena` class, which hands out the memory that covers cache their contents in.
+// <NbdServer.h>: `NbdServer` class, which serves `Manager` over NBD instead of FUSE. Optional.
+// <Journal.h>:  `Journal` class, a write-ahead log which makes `fsync()` cheap. Optional.
+// <Checkpoint.h>: `Checkpoint` class, which keeps track of how far `migrate` has got.
+// <Manifest.h>: `Manifest` class, which lists the covers of a volume that can grow, by segment.
+// <SegmentedLayout.h>: `SegmentedLayout` class, a layout made of one layout per segment.
+// <Volume.h>:   `Volume` class, the API of `libloopsteg.a`, for using a volume without FUSE or NBD.
+// <ThreadPool.h>: `ThreadPool` class, which the pieces of big requests are spread across.
+// <Scheduler.h>: `Scheduler` class, which keeps syncing and readahead out of the way of requests.
 // <exc.h>:      Exception classes.
 // <fs.h>:       Interactions with the file system. (I mean the real file system, i.e. reading and
 //               writing to files, nothing to do with FUSE.)
@@ -89,23 +107,195 @@ using namespace std;
 const bool SHUT_UP = false;
 
 // We'll initialise these in `main()`.
-unique_ptr<Manager> MANAGER; // Where all the magic happens.
+vector<unique_ptr<Manager>> MANAGERS; // Where all the magic happens. One per shard.
 const char* NAME = nullptr;  // `argv[0]`, for passing to `exc::exception::print()`.
 
-// The name of the one file in our FUSE file system.
+// The name of the one file in our FUSE file system, or with `-o shards`, of every file, followed by
+// the number of its shard.
 const char* FILENAME = "data";
 
-// Initialises the file system.
-void* init(struct fuse_conn_info* conn, struct fuse_config* cfg)
+// Biggest read or write we ask the kernel to send us at once, with `-o direct_io`. Every request
+// costs a trip through FUSE, so the fewer the better, but the kernel caps this anyway, at 1 MiB on
+// recent kernels and 128 KiB on old ones.
+const unsigned MAX_REQUEST = 1 << 20;
+
+// Options of our own which can be given with `-o`, alongside the usual FUSE mount options. FUSE
+// never sees these; `fuse_opt_parse()` takes them out of the arguments in `main()`.
+struct options
 {
-    (void)conn;
+    // Path to a journal file, or null for no journal. See <Journal.h>.
+    char* journal;
 
-    // This option disables flushing the cache of file contents on every `open()`.
-    // This is only usable on file systems where the files cannot be accessed in other ways
-    // outside this FUSE file system. (That's us!)
-    cfg->kernel_cache = 1;
+    // Size in MiB the journal can grow to before we sync everything and start it again.
+    unsigned long journal_size;
 
-    return NULL;
+    // Path to a file to keep discards in, or null to forget them at the end. See
+    // `Manager::keep_discards()`.
+    char* discards;
+
+    // Roughly how much memory in MiB `pack`, `unpack` and `init` can use for covers in flight.
+    unsigned long memory;
+
+    // For `init`: fill with zeros rather than random bytes.
+    int zero;
+
+    // For `init`: path to a file to write at the start of the volume, or null.
+    char* header;
+
+    // Which layout to use, or null for the default. See <Layout.h>.
+    char* layout;
+
+    // For `-o layout=stripe`: size of a block in bytes, and how many covers it's spread across.
+    unsigned long block_size;
+    unsigned long block_covers;
+
+    // MiB of decoded images that covers can keep between `.prepare()` and `.sync()`. See
+    // `StegFile::cache_pixels()`.
+    unsigned long pixel_cache;
+
+    // How many covers on each device can be loaded or synced at once, or 0 for no limit. See
+    // `Manager::Manager()`.
+    unsigned long device_jobs;
+
+    // Whether we were given `-o ro`. See `Manager::read_only()`.
+    int read_only;
+
+    // With `-o ro`, MiB of covers to keep loaded at once, or 0 for no limit.
+    unsigned long cache_limit;
+
+    // Whether to bypass the kernel's page cache for `data`. See `init()`.
+    int direct_io;
+
+    // How many covers a sync can write at once, and how many MiB of covers per second, or 0 for no
+    // limit. See `Manager::limit()`.
+    unsigned long sync_jobs;
+    unsigned long sync_rate;
+
+    // KiB to read ahead of sequential reads, or 0 not to. See `Manager::readahead()`.
+    unsigned long readahead;
+
+    // Whether covers' fingerprints include a hash of their headers. See
+    // `CachedFile::check_headers()`.
+    int check_headers;
+
+    // How many volumes to split the covers between. See `Manager::Manager()`.
+    unsigned long shards;
+
+    // For `migrate`: the layout to move to, like `layout`, `block_size` and `block_covers`. Null
+    // or 0 means the same as the old one.
+    char* new_layout;
+    unsigned long new_block_size;
+    unsigned long new_block_covers;
+
+    // Path to a manifest, so the volume can grow, or null for none. See <Manifest.h>.
+    char* manifest;
+
+    // Whether to grow the volume as soon as it's set up, as well as on SIGUSR1.
+    int grow;
+}
+OPTIONS = { nullptr, 64, nullptr, 1024, 0, nullptr, nullptr, 4096, 8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1,
+            nullptr, 0, 0, nullptr, 0 };
+
+// Keys for options which `fuse_opt_parse()` hands to `keep_option()` or `take_option()`.
+enum { KEY_READ_ONLY };
+
+#define OPTION(t, p) { t, offsetof(struct options, p), 1 }
+
+const struct fuse_opt OPTION_SPEC[] =
+{
+    OPTION("journal=%s",      journal),
+    OPTION("journal_size=%lu", journal_size),
+    OPTION("discards=%s",      discards),
+    OPTION("memory=%lu",       memory),
+    OPTION("zero",             zero),
+    OPTION("header=%s",        header),
+    OPTION("layout=%s",        layout),
+    OPTION("block_size=%lu",   block_size),
+    OPTION("block_covers=%lu", block_covers),
+    OPTION("pixel_cache=%lu",  pixel_cache),
+    OPTION("device_jobs=%lu",  device_jobs),
+    OPTION("cache_limit=%lu",  cache_limit),
+    OPTION("direct_io",        direct_io),
+    OPTION("sync_jobs=%lu",    sync_jobs),
+    OPTION("sync_rate=%lu",    sync_rate),
+    OPTION("readahead=%lu",    readahead),
+    OPTION("check_headers",    check_headers),
+    OPTION("shards=%lu",       shards),
+    OPTION("new_layout=%s",    new_layout),
+    OPTION("new_block_size=%lu", new_block_size),
+    OPTION("new_block_covers=%lu", new_block_covers),
+    OPTION("manifest=%s",      manifest),
+    OPTION("grow",             grow),
+    FUSE_OPT_KEY("ro",         KEY_READ_ONLY),
+    FUSE_OPT_END
+};
+
+// For `fuse_opt_parse()` when mounting. `-o ro` is FUSE's too, so we take note of it, but leave it
+// in for FUSE to see. Anything else that isn't ours is FUSE's business.
+int keep_option(void* data, const char* arg, int key, struct fuse_args* outargs)
+{
+    (void)data;
+    (void)arg;
+    (void)outargs;
+
+    if (key == KEY_READ_ONLY) OPTIONS.read_only = 1;
+    return 1;
+}
+
+// For `fuse_opt_parse()` without FUSE, where there's nobody else for `-o ro` to be for.
+int take_option(void* data, const char* arg, int key, struct fuse_args* outargs)
+{
+    keep_option(data, arg, key, outargs);
+    return key == KEY_READ_ONLY ? 0 : 1;
+}
+
+// The name of a shard's file.
+string filename(size_t shard)
+{
+    return MANAGERS.size() == 1 ? FILENAME : FILENAME + to_string(shard);
+}
+
+// The `Manager` behind a path in our file system.
+//
+// path: The path, from FUSE.
+//
+// Returns the `Manager`, or null if there's no such file.
+Manager* find(const char* path)
+{
+    if (*path++ != '/' || strncmp(path, FILENAME, strlen(FILENAME)) != 0) return nullptr;
+
+    const char* number = path + strlen(FILENAME);
+
+    if (MANAGERS.size() == 1) return *number ? nullptr : MANAGERS[0].get();
+
+    // Only the number exactly as `filename()` writes it, so there's only one name for each.
+    if (!isdigit(*number) || (number[0] == '0' && number[1])) return nullptr;
+
+    char* end;
+    unsigned long shard = strtoul(number, &end, 10);
+
+    return !*end && shard < MANAGERS.size() ? MANAGERS[shard].get() : nullptr;
+}
+
+// The block size to report for a shard's file: the layout's block size, rounded up to a whole
+// number of pages, so that requests come in whole blocks of the layout, without splitting any pages
+// either.
+blksize_t block_size(const Manager& manager)
+{
+    size_t page  = sysconf(_SC_PAGESIZE);
+    size_t block = manager.block();
+
+    // Lowest common multiple, by way of the greatest common divisor.
+    size_t a = page, b = block;
+
+    while (b)
+    {
+        size_t t = a % b;
+        a = b;
+        b = t;
+    }
+
+    return page / a * block;
 }
 
 // Gets a file's attributes, i.e. last modified time, permissions, stuff like that.
@@ -119,8 +309,8 @@ int getattr(const char* path, struct stat* stbuf, struct fuse_file_info* fi)
 
     memset(stbuf, 0, sizeof(struct stat));
 
-    // Only let the user get attributes of the root directory itself, or the one and only file
-    // within.
+    // Only let the user get attributes of the root directory itself, or the files within, (one
+    // per shard).
 
     // Root directory itself.
     if (strcmp(path, "/") == 0)
@@ -129,12 +319,14 @@ int getattr(const char* path, struct stat* stbuf, struct fuse_file_info* fi)
         stbuf->st_nlink = 2; // Two links, one for / and one for /.
     }
 
-    // Single file.
-    else if (strcmp(path + 1, FILENAME) == 0)
+    // A shard's file.
+    else if (Manager* manager = find(path))
     {
-        stbuf->st_mode  = S_IFREG | 0755; // rwx r-x r-x
-        stbuf->st_nlink = 1;
-        stbuf->st_size  = MANAGER->capacity();
+        stbuf->st_mode    = S_IFREG | 0755; // rwx r-x r-x
+        stbuf->st_nlink   = 1;
+        stbuf->st_size    = manager->capacity();
+        stbuf->st_blksize = block_size(*manager);
+        stbuf->st_blocks  = (manager->capacity() + 511) / 512;
     }
 
     else result = -ENOENT;
@@ -157,7 +349,9 @@ int readdir(const char* path, void* buf, fuse_fill_dir_t filler, off_t offset,
 
     filler(buf, ".",      NULL, 0, (fuse_fill_dir_flags)0);
     filler(buf, "..",     NULL, 0, (fuse_fill_dir_flags)0);
-    filler(buf, FILENAME, NULL, 0, (fuse_fill_dir_flags)0);
+
+    for (size_t i = 0; i < MANAGERS.size(); ++i)
+        filler(buf, filename(i).c_str(), NULL, 0, (fuse_fill_dir_flags)0);
 
     return 0;
 }
@@ -169,8 +363,8 @@ int open(const char* path, struct fuse_file_info* fi)
 
     if (!SHUT_UP) cout << "`open()`: entering function" << endl;
 
-    // Only let them open our one file.
-    if (strcmp(path + 1, FILENAME) != 0)
+    // Only let them open our files.
+    if (!find(path))
         return -ENOENT;
 
     // Don't actually need to do anything.
@@ -186,13 +380,15 @@ int read(const char* path, char* buf, size_t size, off_t offset, struct fuse_fil
     if (!SHUT_UP) cout << "`read()`: path: '" << path << "' size: " << size << " offset: " << offset
         << endl;
 
-    // Only let them read our one file.
-    if (strcmp(path + 1, FILENAME) != 0)
+    // Only let them read our files.
+    Manager* manager = find(path);
+
+    if (!manager)
         return -ENOENT;
 
     int result = 0;
 
-    try { result = MANAGER->read(buf, size, offset); }
+    try { result = manager->read(buf, size, offset); }
 
     catch (const exc::exception& e)
     {
@@ -212,9 +408,15 @@ int write(const char* path, const char* buf, size_t size, off_t offset, struct f
         << offset << endl;
 
     // You know how it is by now.
-    if (strcmp(path + 1, FILENAME) != 0)
+    Manager* manager = find(path);
+
+    if (!manager)
         return -ENOENT;
 
+    // FUSE shouldn't send us writes on a read-only mount anyway, but just in case.
+    if (manager->read_only())
+        return -EROFS;
+
     // You'd think we'd need to check to ensure nobody's writing off the end of the file here, since
     // our file isn't supposed to change size. Actually, we don't really care about that. Not our
     // job. Once the file is mounted as a loop device, we won't be able to write off the end of that
@@ -222,7 +424,7 @@ int write(const char* path, const char* buf, size_t size, off_t offset, struct f
 
     int result = 0;
 
-    try { result = MANAGER->write(buf, size, offset); }
+    try { result = manager->write(buf, size, offset); }
 
     catch (const exc::exception& e)
     {
@@ -233,43 +435,988 @@ int write(const char* path, const char* buf, size_t size, off_t offset, struct f
     return result;
 }
 
-int main(int argc, char *argv[])
+// Writes zeros over a range, a request at a time, for `fallocate()`.
+//
+// manager:        Where to write them.
+// offset, length: The range. Anything past `Manager::capacity()` is ignored.
+//
+// Throws anything `Manager::write()` throws.
+void zero(Manager& manager, size_t offset, size_t length)
 {
-    // TODO 5 Document somewhere or somehow make it obvious to the user that any modifications made
-    //        to mounted files by external programs while this program is running will mess
-    //        everything up.
+    static const vector<char> zeros(MAX_REQUEST, 0);
+    size_t end = min(offset + length, manager.capacity());
 
-    // stbi_image_write options; disable PNG compression.
-    stbi_write_png_compression_level = 0;
-    stbi_write_force_png_filter      = 0;
+    for (size_t at = offset; at < end; at += MAX_REQUEST)
+        manager.write(zeros.data(), min<size_t>(MAX_REQUEST, end - at), at);
+}
 
-    NAME = argv[0];
+// Punching holes in a file. This is how a loop device passes on discards from the file system on
+// top of it, (say, ext4 mounted with `-o discard`, or `fstrim`), but it's also how it passes on
+// requests to zero a range, and there's no telling which is which. Either way, the range has to
+// read as zeros from then on, which `Manager::discard()` only does for good with `-o discards`.
+// Without it, zeros are written over the range instead, which is as slow as any other write, but
+// right. The file's always as big as it's going to get, so there's nothing to allocate.
+int fallocate(const char* path, int mode, off_t offset, off_t length, struct fuse_file_info* fi)
+{
+    (void)fi;
+
+    if (!SHUT_UP) cout << "`fallocate()`: path: '" << path << "' mode: " << mode << " offset: "
+        << offset << " length: " << length << endl;
+
+    Manager* manager = find(path);
+
+    if (!manager)
+        return -ENOENT;
+
+    if (mode != (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE))
+        return -EOPNOTSUPP;
+
+    if (manager->read_only())
+        return -EROFS;
+
+    if (offset < 0 || length <= 0)
+        return -EINVAL;
+
+    // Nothing lives past the end to punch a hole in.
+    if ((size_t)offset >= manager->capacity())
+        return 0;
+
+    int result = 0;
+
+    try
+    {
+        if (manager->keeps_discards()) manager->discard(offset, length);
+        else                           zero(*manager, offset, length);
+    }
+
+    catch (const exc::exception& e)
+    {
+        e.print(NAME);
+        result = -EIO;
+    }
+
+    return result;
+}
+
+// Making a file durable. With a journal, this is cheap, so we do it properly. Without one, all we
+// could do is sync every dirty cover, which takes far too long to do every time someone calls
+// `fsync()`, so like always, writes only make it into the covers when we're unmounted.
+int fsync(const char* path, int datasync, struct fuse_file_info* fi)
+{
+    (void)datasync;
+    (void)fi;
+
+    if (!SHUT_UP) cout << "`fsync()`: path: '" << path << "'" << endl;
+
+    Manager* manager = find(path);
+
+    if (!manager)
+        return -ENOENT;
+
+    int result = 0;
+
+    try { manager->commit(); }
+
+    catch (const exc::exception& e)
+    {
+        e.print(NAME);
+        result = -EIO;
+    }
+
+    return result;
+}
+
+// The thread which runs `grower()`, if there's a manifest, and whether it should stop.
+thread       GROWER;
+atomic<bool> STOP_GROWING(false);
+
+// Posted once for every SIGUSR1, and once more by `stop_growing()`. A semaphore, since
+// `sem_post()` is one of the few things a signal handler is allowed to do.
+sem_t GROW_REQUESTS;
+
+// Grows a volume, and says by how much. See `Manager::grow()`.
+//
+// manager: The volume.
+// name:    Its name, to say which it was.
+//
+// Throws anything `Manager::grow()` throws.
+void grow(Manager& manager, const string& name)
+{
+    size_t added = manager.grow();
+
+    if (!SHUT_UP)
+        cout << "Grew '" << name << "' by " << added << " bytes, to " << manager.capacity()
+            << endl;
+}
+
+// Handles SIGUSR1, by asking `grower()` to grow, since growing can't be done in a signal handler.
+void request_growth(int signal)
+{
+    (void)signal;
+    sem_post(&GROW_REQUESTS);
+}
+
+// Grows every volume whenever we get SIGUSR1, (say, `pkill -USR1 loop-steg`, once there are new
+// covers in the directories), until `stop_growing()`. The signal can arrive on any thread, but the
+// growing happens here, on an ordinary thread. Requests carry on meanwhile. The new size shows up
+// in `getattr()`, but a loop device only notices if it's told to, with `losetup -c`, and an NBD
+// client when it reconnects.
+void grower()
+{
+    for (;;)
+    {
+        if (sem_wait(&GROW_REQUESTS) != 0) continue;
+
+        if (STOP_GROWING) return;
+
+        for (size_t i = 0; i < MANAGERS.size(); ++i)
+        {
+            try { grow(*MANAGERS[i], filename(i)); }
+            catch (const exc::exception& e) { e.print(NAME); }
+        }
+    }
+}
+
+// Starts `grower()`, if there's a manifest, and handles SIGUSR1 from now on. Until this is called,
+// SIGUSR1 does whatever it did before. This has to be called after FUSE forks into the background,
+// (from `init()`), or the thread would be left behind in the parent.
+void start_growing()
+{
+    if (!OPTIONS.manifest || OPTIONS.read_only || GROWER.joinable()) return;
+
+    sem_init(&GROW_REQUESTS, 0, 0);
+    GROWER = thread(grower);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_growth;
+    action.sa_flags   = SA_RESTART;
+    sigaction(SIGUSR1, &action, nullptr);
+}
+
+// Stops `grower()`, if it's running, and waits for it to finish whatever it's doing.
+void stop_growing()
+{
+    if (!GROWER.joinable()) return;
+
+    signal(SIGUSR1, SIG_DFL);
+
+    STOP_GROWING = true;
+    sem_post(&GROW_REQUESTS);
+    GROWER.join();
+}
+
+// Initialises the file system.
+void* init(struct fuse_conn_info* conn, struct fuse_config* cfg)
+{
+    // With `-o direct_io`, the kernel doesn't keep its own copy of `data` in the page cache. Every
+    // byte is already cached by the covers, and again by the loop device on top, so a third copy is
+    // just memory wasted. Reads and writes then come straight through, as big as whoever's on top
+    // asked for, so let them be big, and let several be in flight at once.
+    if (OPTIONS.direct_io)
+    {
+        cfg->direct_io  = 1;
+        conn->max_write = MAX_REQUEST;
+        conn->want     |= conn->capable & FUSE_CAP_ASYNC_DIO;
+    }
+
+    // Otherwise, this option disables flushing the cache of file contents on every `open()`.
+    // This is only usable on file systems where the files cannot be accessed in other ways
+    // outside this FUSE file system. (That's us!)
+    else cfg->kernel_cache = 1;
+
+    // We've forked into the background by now, (unless `-f`), so the thread stays with us.
+    start_growing();
+
+    return NULL;
+}
+
+// The layout given with `-o layout`, `-o block_size` and `-o block_covers`.
+//
+// target: For `migrate`, whether to give the layout it's moving to instead, from the `new_`
+//         versions of the options, which default to the old ones.
+Layout::options layout_options(bool target)
+{
+    Layout::options layout;
+    if (OPTIONS.layout) layout.policy = OPTIONS.layout;
+    layout.block  = OPTIONS.block_size;
+    layout.covers = OPTIONS.block_covers;
+
+    if (!target) return layout;
+
+    if (OPTIONS.new_layout)       layout.policy = OPTIONS.new_layout;
+    if (OPTIONS.new_block_size)   layout.block  = OPTIONS.new_block_size;
+    if (OPTIONS.new_block_covers) layout.covers = OPTIONS.new_block_covers;
+
+    return layout;
+}
+
+// Sets up `MANAGERS`, one per shard, from the arguments every mode has in common, starts their
+// journals if `-o journal` was given, and makes them read-only if `-o ro` was. Call
+// `fuse_opt_parse()` on the rest of the arguments first.
+//
+// seed_path: Path to the seed file.
+// dir:       The directories of covers, see `Manager::roots()`.
+//
+// Throws anything `fs::read_to_string()` throws.
+// Throws anything `Manager::Manager()` throws.
+// Throws `exc::config` if given both `-o ro` and `-o journal`.
+// Throws anything `Manager::journal()` throws.
+void setup(const char* seed_path, const char* dir)
+{
+    if (OPTIONS.read_only && OPTIONS.journal)
+        THROW(config, "-o ro and -o journal can't be used together");
+
+    if (OPTIONS.manifest && OPTIONS.shards > 1)
+        THROW(config, "-o manifest and -o shards can't be used together");
+
+    if (OPTIONS.grow && !OPTIONS.manifest)
+        THROW(config, "-o grow needs -o manifest");
+
+    string seed = fs::read_to_string(seed_path);
+    Layout::options layout = layout_options(false);
+
+    StegFile::cache_pixels(OPTIONS.pixel_cache << 20);
+    CachedFile::check_headers(OPTIONS.check_headers);
+
+    size_t shards = max(OPTIONS.shards, 1UL);
+    vector<Manager::root> roots = Manager::roots(dir);
+
+    auto start = chrono::high_resolution_clock::now();
+
+    for (size_t i = 0; i < shards; ++i)
+        MANAGERS.emplace_back(new Manager(roots, seed, layout, OPTIONS.device_jobs, i, shards,
+                                          OPTIONS.manifest ? OPTIONS.manifest : ""));
+
+    auto end = chrono::high_resolution_clock::now();
+
+    if (!SHUT_UP)
+        cout << "Set up time: "
+            << chrono::duration_cast<chrono::nanoseconds>(end - start).count() / 1000000.0
+            << "ms" << endl;
+
+    for (size_t i = 0; i < shards; ++i)
+    {
+        Manager& manager = *MANAGERS[i];
+
+        manager.limit(Scheduler::SYNC, OPTIONS.sync_jobs, OPTIONS.sync_rate << 20);
+        manager.readahead(OPTIONS.readahead << 10);
+
+        if (OPTIONS.grow) grow(manager, filename(i));
+
+        // Discards are replayed from the journal, so they have to be loaded first. Like journals,
+        // every shard has its own.
+        if (OPTIONS.discards)
+            manager.keep_discards(shards == 1 ? OPTIONS.discards
+                                              : OPTIONS.discards + ("." + to_string(i)));
+
+        // Every shard needs a journal of its own, since each one commits on its own.
+        if (OPTIONS.journal)
+            manager.journal(shards == 1 ? OPTIONS.journal
+                                        : OPTIONS.journal + ("." + to_string(i)),
+                            OPTIONS.journal_size << 20);
+
+        // The limit is for the whole mount, so the shards share it.
+        if (OPTIONS.read_only)
+            manager.read_only((OPTIONS.cache_limit << 20) / shards);
+    }
+
+    // Not fatal, but whatever's hidden could end up in swap, in the clear.
+    if (!Arena::get().locked())
+        cerr << NAME << ": warning: cover caches can't be locked in memory, so they may be swapped "
+            "out. Raise `ulimit -l`, or give loop-steg CAP_IPC_LOCK" << endl;
+}
+
+// Syncs every one of `MANAGERS` before we exit.
+//
+// Throws anything `Manager::sync()` throws, for the first shard that fails.
+void finish()
+{
+    // Nothing new should turn up in the middle of the last sync.
+    stop_growing();
+
+    auto start = chrono::high_resolution_clock::now();
+
+    // A shard failing doesn't stop the others from being synced.
+    exception_ptr failed;
+
+    for (unique_ptr<Manager>& manager : MANAGERS)
+    {
+        try { manager->sync(); }
+
+        catch (...)
+        {
+            if (!failed) failed = current_exception();
+        }
+    }
+
+    // Only the first cover to fail makes it into the exception, so say which were quarantined too.
+    if (failed)
+    {
+        for (unique_ptr<Manager>& manager : MANAGERS)
+            for (const string& path : manager->quarantined())
+                cerr << NAME << ": '" << path
+                    << "' was quarantined, and what's hidden in it is lost" << endl;
+
+        rethrow_exception(failed);
+    }
+
+    auto end = chrono::high_resolution_clock::now();
+
+    if (!SHUT_UP)
+        cout << "Sync time: "
+            << chrono::duration_cast<chrono::nanoseconds>(end - start).count() / 1000000.0
+            << "ms" << endl;
+}
+
+// Parses our own `-o` options, for the modes which don't involve FUSE. Anything that isn't one of
+// ours is an error, since there's no FUSE to pass it on to.
+//
+// argc, argv: As given to `main()`.
+// first:      Index in `argv` where the options start.
+//
+// Returns true if the options were OK, false if not, in which case an error has been printed.
+bool parse_options(int argc, char* argv[], int first)
+{
+    vector<char*> copy(1, argv[0]);
+    copy.insert(copy.end(), argv + min(first, argc), argv + argc);
+
+    struct fuse_args args = FUSE_ARGS_INIT((int)copy.size(), copy.data());
+
+    if (fuse_opt_parse(&args, &OPTIONS, OPTION_SPEC, take_option) == -1)
+        return false;
+
+    bool result = args.argc <= 1;
+
+    if (!result)
+        cerr << NAME << ": error: unknown argument '" << args.argv[1] << "'" << endl;
+
+    fuse_opt_free_args(&args);
+    return result;
+}
+
+// The NBD server, while `nbd()` is running, so that `stop_server()` can get at it.
+NbdServer* SERVER = nullptr;
+
+// Signal handler which stops `SERVER`.
+void stop_server(int signal)
+{
+    (void)signal;
+    SERVER->stop();
+}
+
+// `loop-steg nbd`: instead of mounting a FUSE file system, serve the hidden volume as an NBD export
+// on a Unix socket, until we get SIGINT or SIGTERM. See <NbdServer.h>.
+//
+// argc, argv: As given to `main()`, with `argv[1]` being "nbd".
+//
+// Returns the exit status.
+int nbd(int argc, char* argv[])
+{
+    if (argc < 5)
+    {
+        cout << "Usage: " << NAME << " nbd <seed file> <target directory> <socket> [-o <options>]"
+            << endl;
+        return 1;
+    }
+
+    const char* seed   = argv[2];
+    const char* path   = argv[3];
+    const char* socket = argv[4];
+
+    if (!parse_options(argc, argv, 5))
+        return 1;
+
+    try
+    {
+        setup(seed, path);
+        start_growing();
+
+        vector<NbdServer::volume> volumes;
 
+        for (size_t i = 0; i < MANAGERS.size(); ++i)
+            volumes.push_back({ filename(i), MANAGERS[i].get() });
+
+        NbdServer server(volumes, socket);
+        SERVER = &server;
+
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = stop_server;
+        sigaction(SIGINT,  &action, nullptr);
+        sigaction(SIGTERM, &action, nullptr);
+
+        if (!SHUT_UP) cout << "Serving on '" << socket << "'" << endl;
+
+        server.serve();
+
+        signal(SIGINT,  SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        SERVER = nullptr;
+
+        finish();
+    }
+
+    catch (const exc::exception& e)
+    {
+        e.print(NAME);
+        return 1;
+    }
+
+    return 0;
+}
+
+// `loop-steg pack`: fills the whole hidden volume from an image on standard input, one cover at a
+// time, without FUSE. See `Manager::pack()`. Standard input must be a regular file, since we need
+// to get at it out of order.
+//
+// argc, argv: As given to `main()`, with `argv[1]` being "pack".
+//
+// Returns the exit status.
+int pack(int argc, char* argv[])
+{
     if (argc < 4)
     {
-        cout << "Usage: " << NAME << " <seed file> <target directory> <mount point>"
-            " [<FUSE mount options>]" << endl;
+        cout << "Usage: " << NAME << " pack <seed file> <target directory> [-o <options>] < image"
+            << endl;
         return 1;
     }
 
-    // Let the seed file be the first argument, and the target directory be the second. Now shuffle
-    // the arguments so FUSE just sees "./a.out <mount point> [<FUSE mount options>]".
-    string seed(argv[1]);
-    string path(argv[2]);
+    if (!parse_options(argc, argv, 4))
+        return 1;
+
+    try
+    {
+        if (OPTIONS.read_only) THROW(config, "pack can't be used with -o ro");
+        if (OPTIONS.shards > 1) THROW(config, "pack can't be used with -o shards");
+
+        struct stat st;
+
+        if (fstat(STDIN_FILENO, &st) < 0 || !S_ISREG(st.st_mode))
+            THROW(file, "standard input must be a regular file, e.g. '< image'");
+
+        setup(argv[2], argv[3]);
+
+        Manager& manager = *MANAGERS[0];
+
+        if ((size_t)st.st_size > manager.capacity())
+        {
+            stringstream ss;
+            ss << "image is " << st.st_size << " bytes, but there's only room for "
+                << manager.capacity();
+            THROW(file, ss.str());
+        }
+
+        void* image = nullptr;
+
+        if (st.st_size)
+        {
+            image = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, STDIN_FILENO, 0);
+
+            if (image == MAP_FAILED)
+            {
+                stringstream ss;
+                ss << "could not map standard input: " << strerror(errno);
+                THROW(file, ss.str());
+            }
+        }
+
+        manager.pack(static_cast<char*>(image), st.st_size, OPTIONS.memory << 20);
+        if (image) munmap(image, st.st_size);
+
+        finish();
+    }
+
+    catch (const exc::exception& e)
+    {
+        e.print(NAME);
+        return 1;
+    }
+
+    return 0;
+}
+
+// `loop-steg unpack`: the opposite of `pack()`, copying the whole hidden volume out to standard
+// output, which must be a regular file.
+//
+// argc, argv: As given to `main()`, with `argv[1]` being "unpack".
+//
+// Returns the exit status.
+int unpack(int argc, char* argv[])
+{
+    if (argc < 4)
+    {
+        cout << "Usage: " << NAME << " unpack <seed file> <target directory> [-o <options>] > image"
+            << endl;
+        return 1;
+    }
+
+    if (!parse_options(argc, argv, 4))
+        return 1;
+
+    // The image is going to standard output, so nothing else had better.
+    cout.rdbuf(cerr.rdbuf());
+
+    try
+    {
+        if (OPTIONS.read_only) THROW(config, "unpack can't be used with -o ro");
+        if (OPTIONS.shards > 1) THROW(config, "unpack can't be used with -o shards");
+
+        struct stat st;
+
+        if (fstat(STDOUT_FILENO, &st) < 0 || !S_ISREG(st.st_mode))
+            THROW(file, "standard output must be a regular file, e.g. '> image'");
+
+        setup(argv[2], argv[3]);
+
+        Manager& manager = *MANAGERS[0];
+        size_t size = manager.capacity();
+
+        // The shell opens '> image' write only, but mapping it needs read and write. So open it
+        // again, properly this time.
+        int fd = ::open("/proc/self/fd/1", O_RDWR | O_CLOEXEC);
+
+        if (fd < 0 || ftruncate(fd, size) < 0)
+        {
+            stringstream ss;
+            ss << "could not open standard output for writing: " << strerror(errno);
+            if (fd >= 0) close(fd);
+            THROW(file, ss.str());
+        }
+
+        void* image = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+
+        if (image == MAP_FAILED)
+        {
+            stringstream ss;
+            ss << "could not map standard output: " << strerror(errno);
+            THROW(file, ss.str());
+        }
+
+        manager.unpack(static_cast<char*>(image), OPTIONS.memory << 20);
+
+        if (msync(image, size, MS_SYNC) < 0)
+        {
+            stringstream ss;
+            ss << "could not write to standard output: " << strerror(errno);
+            munmap(image, size);
+            THROW(file, ss.str());
+        }
+
+        munmap(image, size);
+        finish();
+    }
+
+    catch (const exc::exception& e)
+    {
+        e.print(NAME);
+        return 1;
+    }
+
+    return 0;
+}
+
+// `loop-steg init`: fills the whole hidden volume with random bytes, (or zeros, with `-o zero`),
+// and optionally a header from a file, one cover at a time, without FUSE. See `Manager::format()`.
+//
+// argc, argv: As given to `main()`, with `argv[1]` being "init".
+//
+// Returns the exit status.
+int init(int argc, char* argv[])
+{
+    if (argc < 4)
+    {
+        cout << "Usage: " << NAME << " init <seed file> <target directory> [-o <options>]" << endl;
+        return 1;
+    }
+
+    if (!parse_options(argc, argv, 4))
+        return 1;
+
+    try
+    {
+        if (OPTIONS.read_only) THROW(config, "init can't be used with -o ro");
+
+        // Which shard would it go in?
+        if (OPTIONS.header && OPTIONS.shards > 1)
+            THROW(config, "-o header can't be used with -o shards");
+
+        string header;
+        if (OPTIONS.header) header = fs::read_to_string(OPTIONS.header);
+
+        setup(argv[2], argv[3]);
+
+        if (header.size() > MANAGERS[0]->capacity())
+        {
+            stringstream ss;
+            ss << "header is " << header.size() << " bytes, but there's only room for "
+                << MANAGERS[0]->capacity();
+            THROW(file, ss.str());
+        }
+
+        for (unique_ptr<Manager>& manager : MANAGERS)
+            manager->format(!OPTIONS.zero, header, OPTIONS.memory << 20);
+
+        finish();
+    }
+
+    catch (const exc::exception& e)
+    {
+        e.print(NAME);
+        return 1;
+    }
+
+    return 0;
+}
+
+// Whether a file would be somewhere under one of the roots, where it would be taken for a cover.
+//
+// path:  The file, which needn't exist yet, though its directory must.
+// roots: The roots, as returned by `Manager::roots()`, so their paths are absolute already.
+bool inside(const string& path, const vector<Manager::root>& roots)
+{
+    string dir = path.substr(0, path.rfind('/') + 1);
+    char* real = realpath(dir.empty() ? "." : dir.c_str(), nullptr);
+
+    if (!real) return false;
+
+    string full = string(real) + "/";
+    free(real);
+
+    for (const Manager::root& r : roots)
+    {
+        string prefix = r.path.empty() || r.path.back() != '/' ? r.path + "/" : r.path;
+        if (full.compare(0, prefix.size(), prefix) == 0) return true;
+    }
+
+    return false;
+}
+
+// Writes zeros over the whole of a file, and syncs it, so that what it held isn't still sitting in
+// its blocks once it's unlinked. That's only as good as the file system and disk let it be: a
+// copy-on-write or log-structured file system, or an SSD, can keep the old blocks regardless.
+//
+// path: The file.
+//
+// Throws `exc::file` if the file could not be opened, written or synced.
+void shred(const string& path)
+{
+    int fd = ::open(path.c_str(), O_WRONLY | O_CLOEXEC);
+    fs::fd_guard guard(fd);
+    struct stat st;
+
+    bool ok = fd >= 0 && fstat(fd, &st) == 0;
+    vector<char> zeros(min<size_t>(ok ? st.st_size : 0, 1 << 20), 0);
+
+    for (off_t done = 0; ok && done < st.st_size; done += zeros.size())
+        ok = fs::pwrite_all(fd, zeros.data(), min<size_t>(zeros.size(), st.st_size - done), done);
+
+    if (!ok || fdatasync(fd) < 0)
+    {
+        stringstream ss;
+        ss << "could not overwrite '" << path << "': " << strerror(errno);
+        THROW(file, ss.str());
+    }
+}
+
+// `loop-steg migrate`: moves the hidden volume to a new seed, or a new layout, or both, in the same
+// covers. There's nowhere in the covers to put the volume while they're rearranged, so it's done in
+// two passes, each one cover at a time: first the whole volume is unpacked to a scratch file under
+// the old seed and layout, then packed back into the covers from there under the new ones. Progress
+// is kept in a `Checkpoint` next to the scratch file, so if this is interrupted, running it again
+// with the same arguments carries on where it left off.
+//
+// NOTE: The scratch file holds the whole hidden volume, in the clear, (or as clear as it is: if
+//       there's LUKS on top, that's ciphertext, but it's all in one obvious place), until this is
+//       done. It can't be inside any of the cover directories, where it would be taken for a
+//       cover. Once the covers are packed, it's overwritten with zeros before it's removed, along
+//       with the checkpoint.
+//
+// argc, argv: As given to `main()`, with `argv[1]` being "migrate".
+//
+// Returns the exit status.
+int migrate(int argc, char* argv[])
+{
+    if (argc < 6)
+    {
+        cout << "Usage: " << NAME << " migrate <old seed file> <new seed file> <target directory>"
+            " <scratch file> [-o <options>]" << endl
+            << endl
+            << "The scratch file holds the whole hidden volume, in the clear, until the migration"
+            << endl
+            << "is done, and it can't be inside the target directory. Put it somewhere only you can"
+            << endl
+            << "read. It's overwritten with zeros before it's removed." << endl;
+        return 1;
+    }
+
+    if (!parse_options(argc, argv, 6))
+        return 1;
 
-    // Make the path absolute, otherwise terrible things happen. If the path doesn't exist, just
-    // leave it how it is. Some other part of our code can handle that.
+    string scratch  = argv[5];
+    string progress = scratch + ".checkpoint";
+
+    try
     {
-        char* c_path;
+        if (OPTIONS.read_only)  THROW(config, "migrate can't be used with -o ro");
+        if (OPTIONS.journal)    THROW(config, "migrate can't be used with -o journal");
+        if (OPTIONS.shards > 1) THROW(config, "migrate can't be used with -o shards");
 
-        if ((c_path = realpath(argv[2], nullptr)))
+        string old_seed = fs::read_to_string(argv[2]);
+        string new_seed = fs::read_to_string(argv[3]);
+        vector<Manager::root> roots = Manager::roots(argv[4]);
+
+        // It would be taken for a cover, the next time anything lists the directories.
+        if (inside(scratch, roots))
         {
-            path = c_path;
-            free(c_path);
+            stringstream ss;
+            ss << "scratch file '" << scratch << "' can't be inside the target directory";
+            THROW(config, ss.str());
+        }
+
+        CachedFile::check_headers(OPTIONS.check_headers);
+
+        string manifest = OPTIONS.manifest ? OPTIONS.manifest : "";
+
+        unique_ptr<Manager> from(new Manager(roots, old_seed, layout_options(false),
+                                             OPTIONS.device_jobs, 0, 1, manifest));
+        unique_ptr<Manager> to(new Manager(roots, new_seed, layout_options(true),
+                                           OPTIONS.device_jobs, 0, 1, manifest));
+
+        size_t size = from->capacity();
+
+        // Only ever write over a scratch file we made ourselves, in case someone pointed us at
+        // something important by mistake.
+        bool resuming = access(progress.c_str(), F_OK) == 0;
+        Checkpoint checkpoint(progress, from->covers(), size);
+
+        int fd = ::open(scratch.c_str(), O_RDWR | O_CREAT | O_CLOEXEC | (resuming ? 0 : O_EXCL),
+                        0600);
+
+        struct stat st;
+
+        if (fd < 0 || fstat(fd, &st) < 0)
+        {
+            stringstream ss;
+            ss << "could not open scratch file '" << scratch << "': " << strerror(errno);
+            if (fd >= 0) close(fd);
+            if (!resuming) unlink(progress.c_str());
+            THROW(file, ss.str());
+        }
+
+        // Packing can only carry on from everything that was unpacked.
+        if (checkpoint.unpacked() && (size_t)st.st_size != size)
+        {
+            stringstream ss;
+            ss << "scratch file '" << scratch << "' should be " << size << " bytes, but it's "
+                << st.st_size;
+            close(fd);
+            THROW(file, ss.str());
+        }
+
+        if (ftruncate(fd, size) < 0)
+        {
+            stringstream ss;
+            ss << "could not resize scratch file '" << scratch << "': " << strerror(errno);
+            close(fd);
+            THROW(file, ss.str());
+        }
+
+        void* image = size ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                           : nullptr;
+        close(fd);
+
+        if (image == MAP_FAILED)
+        {
+            stringstream ss;
+            ss << "could not map scratch file '" << scratch << "': " << strerror(errno);
+            THROW(file, ss.str());
+        }
+
+        try
+        {
+            if (!checkpoint.unpacked())
+            {
+                if (!SHUT_UP) cout << "Unpacking to '" << scratch << "'" << endl;
+
+                if (OPTIONS.discards) from->keep_discards(OPTIONS.discards);
+                from->unpack(static_cast<char*>(image), OPTIONS.memory << 20);
+
+                if (image && msync(image, size, MS_SYNC) < 0)
+                {
+                    stringstream ss;
+                    ss << "could not write to scratch file '" << scratch << "': "
+                        << strerror(errno);
+                    THROW(file, ss.str());
+                }
+
+                checkpoint.mark_unpacked();
+            }
+
+            // Nothing's needed from the old seed any more.
+            from.reset();
+
+            // Anything discarded is zeros in the scratch file now, so the new volume can start
+            // with nothing discarded. Its capacity might not even fit the old discards.
+            if (OPTIONS.discards)
+            {
+                if (unlink(OPTIONS.discards) < 0 && errno != ENOENT)
+                {
+                    stringstream ss;
+                    ss << "could not remove discards '" << OPTIONS.discards << "': "
+                        << strerror(errno);
+                    THROW(file, ss.str());
+                }
+
+                to->keep_discards(OPTIONS.discards);
+            }
+
+            // The new layout can have a little less room, (say, `stripe` rounds down to whole
+            // blocks), which is fine as long as nothing was using the end of the volume. The covers
+            // haven't been touched yet if it isn't.
+            size_t fits = min(size, to->capacity());
+            const char* bytes = static_cast<const char*>(image);
+
+            if (any_of(bytes + fits, bytes + size, [](char c) { return c != 0; }))
+            {
+                stringstream ss;
+                ss << "the volume is " << size << " bytes, but there's only room for " << fits
+                    << " under the new seed and layout, and the rest isn't empty";
+                THROW(config, ss.str());
+            }
+
+            if (!SHUT_UP) cout << "Packing from '" << scratch << "'" << endl;
+
+            to->pack(bytes, fits, OPTIONS.memory << 20, &checkpoint);
+            to->sync();
+        }
+
+        catch (...)
+        {
+            if (image) munmap(image, size);
+            throw;
+        }
+
+        if (image) munmap(image, size);
+
+        // The scratch file is the only other copy of the volume, so before it goes, everything has
+        // to really be on the disk. `to->sync()` `fsync()`s the covers, but this is no time to
+        // count on nothing else being left in the page cache.
+        ::sync();
+
+        // The scratch file is the whole volume, in the clear, so don't leave it lying around, even
+        // in blocks the file system has freed.
+        shred(scratch);
+
+        if (unlink(scratch.c_str()) < 0 || unlink(progress.c_str()) < 0)
+        {
+            stringstream ss;
+            ss << "migrated, but could not remove '" << scratch << "' or '" << progress << "': "
+                << strerror(errno);
+            THROW(file, ss.str());
         }
     }
 
-    // Remove the first two arguments.
+    catch (const exc::exception& e)
+    {
+        e.print(NAME);
+        return 1;
+    }
+
+    return 0;
+}
+
+// Everything `main()` does, until it's time to clean up.
+//
+// argc, argv: As given to `main()`.
+//
+// Returns the exit status.
+int run(int argc, char *argv[])
+{
+    // TODO 5 Document somewhere or somehow make it obvious to the user that any modifications made
+    //        to mounted files by external programs while this program is running will mess
+    //        everything up.
+
+    NAME = argv[0];
+
+    if (argc >= 2 && strcmp(argv[1], "nbd")    == 0) return nbd(argc, argv);
+    if (argc >= 2 && strcmp(argv[1], "pack")   == 0) return pack(argc, argv);
+    if (argc >= 2 && strcmp(argv[1], "unpack") == 0) return unpack(argc, argv);
+    if (argc >= 2 && strcmp(argv[1], "init")   == 0) return init(argc, argv);
+    if (argc >= 2 && strcmp(argv[1], "migrate") == 0) return migrate(argc, argv);
+
+    if (argc < 4)
+    {
+        cout << "Usage: " << NAME << " <seed file> <target directory> <mount point>"
+            " [<FUSE mount options>]" << endl
+            << "       " << NAME << " nbd <seed file> <target directory> <socket> [-o <options>]"
+            << endl
+            << "       " << NAME << " pack <seed file> <target directory> [-o <options>] < image"
+            << endl
+            << "       " << NAME << " unpack <seed file> <target directory> [-o <options>] > image"
+            << endl
+            << "       " << NAME << " init <seed file> <target directory> [-o <options>]" << endl
+            << "       " << NAME << " migrate <old seed file> <new seed file> <target directory>"
+            " <scratch file> [-o <options>]" << endl
+            << endl
+            << "Options of our own, given with -o like the FUSE ones:" << endl
+            << "    -o journal=<file>      journal writes to <file>, so fsync() is cheap" << endl
+            << "    -o journal_size=<MiB>  sync everything once the journal is this big (64)"
+            << endl
+            << "    -o discards=<file>     keep discards in <file>, so they read as zeros for good"
+            << endl
+            << "    -o memory=<MiB>        memory for covers in flight in pack/unpack/init (1024)"
+            << endl
+            << "    -o zero                init fills with zeros rather than random bytes" << endl
+            << "    -o header=<file>       init writes <file> at the start of the volume" << endl
+            << "    -o layout=<policy>     'bytes' scatters every byte (default), 'stripe' keeps"
+            << endl
+            << "                           each block within a few covers" << endl
+            << "    -o block_size=<bytes>  block size for layout=stripe (4096)" << endl
+            << "    -o block_covers=<n>    covers each block is spread across (8)" << endl
+            << "    -o pixel_cache=<MiB>   keep decoded images of covers being written to (0)"
+            << endl
+            << "    -o device_jobs=<n>     covers per device loaded or synced at once (no limit)"
+            << endl
+            << "    -o ro                  read-only: no locking, nothing to sync" << endl
+            << "    -o cache_limit=<MiB>   with -o ro, covers to keep loaded at once (no limit)"
+            << endl
+            << "    -o direct_io           don't keep a copy of data in the page cache too" << endl
+            << "    -o sync_jobs=<n>       covers a sync writes at once (no limit)" << endl
+            << "    -o sync_rate=<MiB/s>   hidden MiB per second a sync gets through (no limit)"
+            << endl
+            << "    -o readahead=<KiB>     load covers this far ahead of sequential reads (0)"
+            << endl
+            << "    -o check_headers       also hash the start of covers to spot changes to them"
+            << endl
+            << "    -o shards=<n>          split the covers between <n> volumes, data0 to data<n-1>"
+            << endl
+            << "    -o new_layout=<policy> migrate to this layout (the same as -o layout)" << endl
+            << "    -o new_block_size=<bytes>, -o new_block_covers=<n>" << endl
+            << "                           migrate to this block_size/block_covers (the same)"
+            << endl
+            << "    -o manifest=<file>     list the covers in <file>, so the volume can grow"
+            << endl
+            << "    -o grow                add new covers at startup (and on SIGUSR1 anyway)"
+            << endl
+            << endl
+            << "The target directory can be several, separated by colons, each optionally with"
+            << endl
+            << "'@<weight>' after it, from just above 0 to 1: how much of its covers to use."
+            << endl
+            << endl
+            << "migrate's scratch file holds the whole hidden volume in the clear while it runs,"
+            << endl
+            << "so keep it out of the target directory, and somewhere only you can read." << endl;
+        return 1;
+    }
+
+    // Let the seed file be the first argument, and the target directory be the second. Now shuffle
+    // the arguments so FUSE just sees "./a.out <mount point> [<FUSE mount options>]".
+    const char* seed = argv[1];
+    const char* path = argv[2];
+
     argv[2] = argv[0];
     argv += 2;
     argc -= 2;
@@ -277,45 +1424,55 @@ int main(int argc, char *argv[])
     // If this isn't static, then you get a 'transport endpoint not connected' error for some
     // bizarre reason I don't understand.
     static struct fuse_operations oper;
-    oper.getattr = getattr;
-    oper.open    = open;
-    oper.read    = read;
-    oper.write   = write;
-    oper.readdir = readdir;
-    oper.init    = init;
-
-    int result = 1;
+    oper.getattr   = getattr;
+    oper.open      = open;
+    oper.read      = read;
+    oper.write     = write;
+    oper.readdir   = readdir;
+    oper.init      = init;
+    oper.fsync     = fsync;
+    oper.fallocate = fallocate;
+
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+
+    if (fuse_opt_parse(&args, &OPTIONS, OPTION_SPEC, keep_option) == -1)
+        return 1;
 
-    try
+    // The biggest read the kernel sends can only be raised with a mount option, unlike writes.
+    // See `init()`.
+    if (OPTIONS.direct_io)
     {
-        seed = fs::read_to_string(seed);
-
-        auto start = chrono::high_resolution_clock::now();
-        MANAGER = unique_ptr<Manager>(new Manager(path, seed));
-        auto end = chrono::high_resolution_clock::now();
-
-        if (!SHUT_UP)
-            cout << "Set up time: "
-                << chrono::duration_cast<chrono::nanoseconds>(end - start).count() / 1000000.0
-                << "ms" << endl;
+        string max_read = "-omax_read=" + to_string(MAX_REQUEST);
+        fuse_opt_add_arg(&args, max_read.c_str());
+    }
 
-        result = fuse_main(argc, argv, &oper, NULL);
+    int result = 1;
 
-        start = chrono::high_resolution_clock::now();
-        MANAGER->sync();
-        end = chrono::high_resolution_clock::now();
+    // FUSE forks into the background once we're set up, and the pools and the ring have to come
+    // with us.
+    ThreadPool::handle_forks();
 
-        if (!SHUT_UP)
-            cout << "Sync time: "
-                << chrono::duration_cast<chrono::nanoseconds>(end - start).count() / 1000000.0
-                << "ms" << endl;
+    try
+    {
+        setup(seed, path);
+        result = fuse_main(args.argc, args.argv, &oper, NULL);
+        finish();
     }
 
     catch (const exc::exception& e)
     {
         e.print(NAME);
+        fuse_opt_free_args(&args);
         return 1;
     }
 
+    fuse_opt_free_args(&args);
+    return result;
+}
+
+int main(int argc, char *argv[])
+{
+    int result = run(argc, argv);
+    stop_growing();
     return result;
 }
@@ -0,0 +1,17 @@
+// The implementations of <stb_image.h> and <stb_image_write.h>, which only <StegFile.cpp> uses.
+// They're in a file of their own, rather than in <main.cpp>, so that `libloopsteg.a` has them.
+#define STBI_FAILURE_USERMSG
+#define STB_IMAGE_IMPLEMENTATION
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include <stb/stb_image.h>
+#include <stb/stb_image_write.h>
+
+namespace
+{
+
+// stb_image_write options; disable PNG compression. These are set before `main()`, so that a
+// program using `libloopsteg.a` gets the same covers out as `loop-steg` does.
+const bool CONFIGURED = (stbi_write_png_compression_level = 0, stbi_write_force_png_filter = 0,
+                         true);
+
+}
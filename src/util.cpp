@@ -1,5 +1,8 @@
 #include <string>
 
+#include <cstring>
+#include <cstdint>
+
 #include "util.h"
 
 using namespace std;
@@ -14,4 +17,39 @@ string upper(const string& s)
     return result;
 }
 
+namespace
+{
+
+// Finaliser from MurmurHash3. Scrambles all 64 bits of `x` into each other.
+inline uint64_t mix(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+}
+
+uint64_t hash(const void* data, size_t size, uint64_t seed)
+{
+    const uint64_t m = 0x9e3779b97f4a7c15ULL;
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    uint64_t h = seed ^ (size * m);
+
+    // Eight bytes at a time, then whatever's left over.
+    for (; size >= 8; size -= 8, p += 8)
+    {
+        uint64_t k;
+        memcpy(&k, p, 8);
+        h = (h ^ mix(k)) * m;
+    }
+
+    uint64_t k = 0;
+    memcpy(&k, p, size);
+    return mix((h ^ k) * m);
+}
+
 }
@@ -3,6 +3,11 @@
 
 // This file contains miscellaneous utility functions which don't belong anywhere else.
 
+#include <string>
+
+#include <cstddef>
+#include <cstdint>
+
 namespace util
 {
 
@@ -44,6 +49,16 @@ inline std::string pretty_trim(const std::string& pretty_function, const std::st
 // Returns `s` in upper case, as defined by `std::toupper()`.
 std::string upper(const std::string& s);
 
+// Hashes a buffer of bytes. This is NOT a cryptographic hash; it's meant to be fast, and good
+// enough to catch torn writes and tell whether some data has changed.
+//
+// data: The bytes to hash.
+// size: The number of bytes in `data`.
+// seed: Different seeds give unrelated hashes for the same data. Defaults to 0.
+//
+// Returns the hash.
+uint64_t hash(const void* data, size_t size, uint64_t seed = 0);
+
 }
 
 #endif